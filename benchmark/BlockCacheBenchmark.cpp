@@ -0,0 +1,91 @@
+#include <benchmark/benchmark.h>
+
+#include "BlockCache.h"
+#include "BlockStorage.h"
+#include "ReservedMemory.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const size_t kBlockSize = 1028;
+const size_t kNumBlocksPerIteration = 64;
+
+std::unique_ptr<BlockStorage<kBlockSize> > g_storage;
+
+// Every thread creates kNumBlocksPerIteration blocks per iteration and frees
+// them again, all threads share one storage set up before they start.
+void setUp(const benchmark::State& state)
+{
+   g_storage = std::make_unique<BlockStorage<kBlockSize> >(std::make_unique<ReservedMemory>(size_t(1) << 30));
+   g_storage->reserve(static_cast<size_t>(state.threads()) * kNumBlocksPerIteration * 4);
+}
+
+void setUpLockFree(const benchmark::State& state)
+{
+   g_storage = std::make_unique<BlockStorage<kBlockSize> >(
+      std::make_unique<ReservedMemory>(size_t(1) << 30), BlockLayout::Packed, BlockAllocation::LockFree);
+   g_storage->reserve(static_cast<size_t>(state.threads()) * kNumBlocksPerIteration * 4);
+}
+
+void tearDown(const benchmark::State&)
+{
+   g_storage.reset();
+}
+
+void BM_BlockStorageCreateFree(benchmark::State& state)
+{
+   std::vector<uint64_t> blockIds(kNumBlocksPerIteration);
+   for (auto _ : state) {
+      for (size_t i = 0; i < kNumBlocksPerIteration; ++i) {
+         std::lock_guard<BlockStorage<kBlockSize> > lock(*g_storage);
+         blockIds[i] = g_storage->create().id();
+      }
+      for (size_t i = 0; i < kNumBlocksPerIteration; ++i) {
+         std::lock_guard<BlockStorage<kBlockSize> > lock(*g_storage);
+         g_storage->free(blockIds[i]);
+      }
+   }
+
+   state.SetItemsProcessed(state.iterations() * kNumBlocksPerIteration * 2);
+}
+BENCHMARK(BM_BlockStorageCreateFree)->Setup(setUp)->Teardown(tearDown)->ThreadRange(1, 32)->UseRealTime();
+
+// Same as BM_BlockStorageCreateFree without any lock.
+void BM_BlockStorageLockFreeCreateFree(benchmark::State& state)
+{
+   std::vector<uint64_t> blockIds(kNumBlocksPerIteration);
+   for (auto _ : state) {
+      for (size_t i = 0; i < kNumBlocksPerIteration; ++i) {
+         blockIds[i] = g_storage->create().id();
+      }
+      for (size_t i = 0; i < kNumBlocksPerIteration; ++i) {
+         g_storage->free(blockIds[i]);
+      }
+   }
+
+   state.SetItemsProcessed(state.iterations() * kNumBlocksPerIteration * 2);
+}
+BENCHMARK(BM_BlockStorageLockFreeCreateFree)->Setup(setUpLockFree)->Teardown(tearDown)->ThreadRange(1, 32)->UseRealTime();
+
+void BM_BlockCacheCreateFree(benchmark::State& state)
+{
+   std::vector<uint64_t> blockIds(kNumBlocksPerIteration);
+   {
+      BlockCache<kBlockSize> cache(*g_storage, static_cast<size_t>(state.range(0)));
+      for (auto _ : state) {
+         for (size_t i = 0; i < kNumBlocksPerIteration; ++i) {
+            blockIds[i] = cache.create().id();
+         }
+         for (size_t i = 0; i < kNumBlocksPerIteration; ++i) {
+            cache.free(blockIds[i]);
+         }
+      }
+   }
+
+   state.SetItemsProcessed(state.iterations() * kNumBlocksPerIteration * 2);
+}
+BENCHMARK(BM_BlockCacheCreateFree)->Setup(setUp)->Teardown(tearDown)->Arg(16)->Arg(64)->ThreadRange(1, 32)->UseRealTime();
+
+}
@@ -0,0 +1,63 @@
+#include <benchmark/benchmark.h>
+
+#include "IoEngine.h"
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+const size_t kPageSize = 4096;
+const size_t kNumPages = 16384; // 64 MB
+const size_t kBatchSize = 256;
+
+// Random page reads from a local file, one batch of kBatchSize reads per
+// iteration with state.range(0) of them in flight at the same time.
+template <typename Engine>
+void readBatch(benchmark::State& state, Engine& engine)
+{
+   char path[] = "/tmp/IoEngineBenchmark.XXXXXX";
+   int fd = mkstemp(path);
+   std::vector<uint8_t> page(kPageSize, 0xAB);
+   for (size_t i = 0; i < kNumPages; ++i) {
+      if (::pwrite(fd, page.data(), kPageSize, static_cast<off_t>(i * kPageSize)) != static_cast<ssize_t>(kPageSize)) {
+         state.SkipWithError("Failed to write benchmark file");
+         break;
+      }
+   }
+
+   std::default_random_engine generator(42);
+   std::uniform_int_distribution<size_t> pages(0, kNumPages - 1);
+   std::vector<uint8_t> buffers(kBatchSize * kPageSize);
+   std::vector<IoRequest> requests(kBatchSize);
+
+   for (auto _ : state) {
+      for (size_t i = 0; i < kBatchSize; ++i) {
+         requests[i] = IoRequest{IoRequest::Kind::Read, fd, buffers.data() + i * kPageSize, kPageSize, pages(generator) * kPageSize, 0};
+      }
+      engine.submit(requests.data(), requests.size());
+   }
+
+   state.SetItemsProcessed(state.iterations() * kBatchSize);
+   state.SetBytesProcessed(state.iterations() * kBatchSize * kPageSize);
+   ::close(fd);
+   ::unlink(path);
+}
+
+void BM_DefaultIoEngineRead(benchmark::State& state)
+{
+   std::unique_ptr<IoEngine> engine = makeIoEngine(static_cast<size_t>(state.range(0)));
+   readBatch(state, *engine);
+}
+BENCHMARK(BM_DefaultIoEngineRead)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
+
+void BM_ThreadPoolIoEngineRead(benchmark::State& state)
+{
+   ThreadPoolIoEngine engine(static_cast<size_t>(state.range(0)));
+   readBatch(state, engine);
+}
+BENCHMARK(BM_ThreadPoolIoEngineRead)->RangeMultiplier(4)->Range(1, 64)->UseRealTime();
+
+}
@@ -0,0 +1,120 @@
+#include <benchmark/benchmark.h>
+
+#include "BlockStorage.h"
+#include "RecordStorage.h"
+#include "ReservedMemory.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const size_t kBlockSize = 1028;
+
+std::unique_ptr<RecordStorage<kBlockSize> > makeStorage()
+{
+   return std::make_unique<RecordStorage<kBlockSize> >(
+      std::make_unique<BlockStorage<kBlockSize> >(std::make_unique<ReservedMemory>(size_t(1) << 30)));
+}
+
+// Adds and erases a record of state.range(0) bytes.
+void BM_RecordStorageAdd(benchmark::State& state)
+{
+   std::unique_ptr<RecordStorage<kBlockSize> > storage = makeStorage();
+   std::vector<uint8_t> record(static_cast<size_t>(state.range(0)), 42);
+
+   for (auto _ : state) {
+      RecordId recordId = storage->add(record.data(), record.size());
+      storage->erase(recordId);
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RecordStorageAdd)->Arg(64)->Arg(4096)->Arg(65536);
+
+// Streams a record of state.range(0) bytes in pieces of 1000 bytes and
+// erases it again.
+void BM_RecordStorageWriter(benchmark::State& state)
+{
+   std::unique_ptr<RecordStorage<kBlockSize> > storage = makeStorage();
+   std::vector<uint8_t> record(static_cast<size_t>(state.range(0)), 42);
+
+   for (auto _ : state) {
+      RecordStorage<kBlockSize>::RecordWriter writer = storage->writer();
+      for (size_t offset = 0; offset < record.size(); offset += 1000) {
+         writer.write(record.data() + offset, std::min<size_t>(1000, record.size() - offset));
+      }
+      storage->erase(writer.close());
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RecordStorageWriter)->Arg(64)->Arg(4096)->Arg(65536);
+
+// Appends 64 bytes to a 1 MiB record and cuts them off again, either in
+// place or by replacing the whole record.
+void BM_RecordStorageAppend(benchmark::State& state)
+{
+   std::unique_ptr<RecordStorage<kBlockSize> > storage = makeStorage();
+   std::vector<uint8_t> record(size_t(1) << 20, 42);
+   RecordId recordId = storage->add(record.data(), record.size());
+   std::vector<uint8_t> tail(64, 7);
+   std::vector<uint8_t> grown(record);
+   grown.insert(grown.end(), tail.begin(), tail.end());
+
+   for (auto _ : state) {
+      if (state.range(0) == 0) {
+         storage->append(recordId, tail.data(), tail.size());
+         storage->resize(recordId, record.size());
+      } else {
+         storage->replace(recordId, grown.data(), grown.size());
+         storage->replace(recordId, record.data(), record.size());
+      }
+   }
+}
+BENCHMARK(BM_RecordStorageAppend)->Arg(0)->Arg(1);
+
+// Reads a record of state.range(0) bytes into a new vector.
+void BM_RecordStorageGet(benchmark::State& state)
+{
+   std::unique_ptr<RecordStorage<kBlockSize> > storage = makeStorage();
+   std::vector<uint8_t> record(static_cast<size_t>(state.range(0)), 42);
+   RecordId recordId = storage->add(record.data(), record.size());
+
+   for (auto _ : state) {
+      std::vector<uint8_t> data = storage->get(recordId);
+      benchmark::DoNotOptimize(data.data());
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RecordStorageGet)->Arg(64)->Arg(4096)->Arg(65536);
+
+// Reads the same record into a buffer that is reused.
+void BM_RecordStorageGetIntoBuffer(benchmark::State& state)
+{
+   std::unique_ptr<RecordStorage<kBlockSize> > storage = makeStorage();
+   std::vector<uint8_t> record(static_cast<size_t>(state.range(0)), 42);
+   RecordId recordId = storage->add(record.data(), record.size());
+
+   std::vector<uint8_t> buffer(record.size());
+   for (auto _ : state) {
+      benchmark::DoNotOptimize(storage->get(recordId, buffer.data(), buffer.size()));
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RecordStorageGetIntoBuffer)->Arg(64)->Arg(4096)->Arg(65536);
+
+// Pins the same record and looks at its segments without copying.
+void BM_RecordStoragePin(benchmark::State& state)
+{
+   std::unique_ptr<RecordStorage<kBlockSize> > storage = makeStorage();
+   std::vector<uint8_t> record(static_cast<size_t>(state.range(0)), 42);
+   RecordId recordId = storage->add(record.data(), record.size());
+
+   for (auto _ : state) {
+      RecordStorage<kBlockSize>::PinnedRecord pinned = storage->pin(recordId);
+      benchmark::DoNotOptimize(pinned.iov());
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RecordStoragePin)->Arg(64)->Arg(4096)->Arg(65536);
+
+}
@@ -0,0 +1,98 @@
+#include <benchmark/benchmark.h>
+
+#include "BlockStorage.h"
+#include "ReservedMemory.h"
+#include <memory>
+#include <vector>
+
+namespace {
+
+const size_t kBlockSize = 1028;
+
+void BM_VectorViewIndex(benchmark::State& state)
+{
+   BlockStorage<kBlockSize> storage(std::make_unique<ReservedMemory>(size_t(1) << 30));
+   VectorView<uint64_t, kBlockSize> vector = VectorView<uint64_t, kBlockSize>::createVectorView(storage.create());
+   const uint64_t numItems = static_cast<uint64_t>(state.range(0));
+   for (uint64_t i = 0; i < numItems; ++i) {
+      vector.push_back(i);
+   }
+
+   // Strided, so consecutive lookups land in different blocks.
+   uint64_t index = 0;
+   uint64_t sum = 0;
+   for (auto _ : state) {
+      sum += vector[index];
+      index = (index + 7919) % numItems;
+   }
+   benchmark::DoNotOptimize(sum);
+}
+BENCHMARK(BM_VectorViewIndex)->Arg(1000)->Arg(1000000);
+
+// Sums the whole vector, one element per iteration through operator[], the
+// iterator or the segments.
+void BM_VectorViewScan(benchmark::State& state)
+{
+   BlockStorage<kBlockSize> storage(std::make_unique<ReservedMemory>(size_t(1) << 30));
+   VectorView<uint64_t, kBlockSize> vector = VectorView<uint64_t, kBlockSize>::createVectorView(storage.create());
+   const uint64_t numItems = 1000000;
+   for (uint64_t i = 0; i < numItems; ++i) {
+      vector.push_back(i);
+   }
+
+   for (auto _ : state) {
+      uint64_t sum = 0;
+      switch (state.range(0)) {
+      case 0:
+         for (uint64_t i = 0; i < numItems; ++i) {
+            sum += vector[i];
+         }
+         break;
+      case 1:
+         for (uint64_t item : vector) {
+            sum += item;
+         }
+         break;
+      default:
+         for (const Segment<uint64_t>& segment : vector.segments()) {
+            for (uint64_t item : segment) {
+               sum += item;
+            }
+         }
+         break;
+      }
+      benchmark::DoNotOptimize(sum);
+   }
+   state.SetItemsProcessed(state.iterations() * numItems);
+}
+BENCHMARK(BM_VectorViewScan)->Arg(0)->Arg(1)->Arg(2);
+
+void BM_VectorViewPushBack(benchmark::State& state)
+{
+   BlockStorage<kBlockSize> storage(std::make_unique<ReservedMemory>(size_t(1) << 30));
+   VectorView<uint64_t, kBlockSize> vector = VectorView<uint64_t, kBlockSize>::createVectorView(storage.create());
+   uint64_t i = 0;
+   for (auto _ : state) {
+      vector.push_back(i++);
+   }
+}
+BENCHMARK(BM_VectorViewPushBack);
+
+// Appends batches of ids, like the ingest path does.
+void BM_VectorViewAppend(benchmark::State& state)
+{
+   BlockStorage<kBlockSize> storage(std::make_unique<ReservedMemory>(size_t(1) << 32));
+   VectorView<uint64_t, kBlockSize> vector = VectorView<uint64_t, kBlockSize>::createVectorView(storage.create());
+   std::vector<uint64_t> batch(static_cast<size_t>(state.range(0)));
+   uint64_t i = 0;
+   for (auto _ : state) {
+      for (uint64_t& id : batch) {
+         id = i++;
+      }
+      vector.append(batch.data(), batch.size());
+   }
+   state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_VectorViewAppend)->Arg(1)->Arg(1024)->Arg(65536);
+
+}
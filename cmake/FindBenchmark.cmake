@@ -0,0 +1,27 @@
+# - Find Benchmark
+# Find the native Google Benchmark headers and libraries.
+#
+# BENCHMARK_INCLUDE_DIRS - where to find benchmark/benchmark.h, etc.
+# BENCHMARK_LIBRARIES    - List of libraries when using Benchmark.
+# BENCHMARK_FOUND        - True if Benchmark found.
+
+# Look for the header file.
+FIND_PATH(BENCHMARK_INCLUDE_DIR NAMES benchmark/benchmark.h)
+
+# Look for the library.
+FIND_LIBRARY(BENCHMARK_LIBRARY NAMES benchmark)
+
+# Handle the QUIETLY and REQUIRED arguments and set BENCHMARK_FOUND to TRUE if all listed variables are TRUE.
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(BENCHMARK DEFAULT_MSG BENCHMARK_LIBRARY BENCHMARK_INCLUDE_DIR)
+
+# Copy the results to the output variables.
+IF(BENCHMARK_FOUND)
+    SET(BENCHMARK_LIBRARIES ${BENCHMARK_LIBRARY})
+    SET(BENCHMARK_INCLUDE_DIRS ${BENCHMARK_INCLUDE_DIR})
+ELSE(BENCHMARK_FOUND)
+    SET(BENCHMARK_LIBRARIES)
+    SET(BENCHMARK_INCLUDE_DIRS)
+ENDIF(BENCHMARK_FOUND)
+
+MARK_AS_ADVANCED(BENCHMARK_INCLUDE_DIRS BENCHMARK_LIBRARIES)
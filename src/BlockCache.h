@@ -0,0 +1,121 @@
+#pragma once
+
+#include "BlockStorage.h"
+
+#include <mutex>
+#include <vector>
+
+// Per-thread cache of free blocks in front of a BlockStorage, in the spirit of
+// the thread caches of tcmalloc. Every thread owns its own BlockCache, create()
+// and free() only touch the cache and take the storage lock once per batch to
+// refill or drain it, instead of once per block.
+//
+// Blocks held by a cache are marked as used in the storage header, so other
+// processes sharing the storage see size() too large by at most the number of
+// cached blocks. Inside the process BlockStorage::size() and numFreeBlocks()
+// subtract them again and stay exact.
+//
+// Like Block handed out by BlockStorage the blocks of a cache are addressed
+// without the storage lock, so the storage should either be reserved up front
+// or sit on an address stable backend like ReservedMemory.
+template <size_t BlockSize>
+class BlockCache
+{
+public:
+   static const size_t kDefaultBatchSize = 64;
+
+   explicit BlockCache(BlockStorage<BlockSize>& storage, size_t batchSize = kDefaultBatchSize)
+      : m_storage(storage),
+        m_batchSize(std::max<size_t>(1, batchSize)),
+        m_blockIds()
+   {
+      m_blockIds.reserve(2 * m_batchSize);
+   }
+
+   BlockCache(const BlockCache&) = delete;
+   BlockCache& operator=(const BlockCache&) = delete;
+
+   ~BlockCache()
+   {
+      flush();
+   }
+
+   Block<BlockSize> create()
+   {
+      if (m_blockIds.empty()) {
+         refill();
+      }
+
+      uint64_t blockId = m_blockIds.back();
+      m_blockIds.pop_back();
+      m_storage.m_numCachedBlocks.fetch_sub(1);
+
+      // TODO: numeric_cast
+      size_t index = static_cast<size_t>(blockId);
+      Block<BlockSize>::createBlock(blockId, BlockSize, m_storage.getBlockAddress(index));
+      return Block<BlockSize>(&m_storage, index);
+   }
+
+   void free(uint64_t blockId)
+   {
+      m_blockIds.push_back(blockId);
+      m_storage.m_numCachedBlocks.fetch_add(1);
+
+      // Draining only down to one batch keeps a thread that alternates between
+      // create() and free() from taking the lock every time.
+      if (m_blockIds.size() >= 2 * m_batchSize) {
+         drain(m_batchSize);
+      }
+   }
+
+   void free(const Block<BlockSize>& block)
+   {
+      this->free(block.id());
+   }
+
+   // Returns all cached blocks to the storage.
+   void flush()
+   {
+      drain(m_blockIds.size());
+   }
+
+   size_t numCached() const
+   {
+      return m_blockIds.size();
+   }
+
+   size_t batchSize() const
+   {
+      return m_batchSize;
+   }
+
+private:
+   BlockStorage<BlockSize>& m_storage;
+   size_t m_batchSize;
+   std::vector<uint64_t> m_blockIds;
+
+   void refill()
+   {
+      std::lock_guard<BlockStorage<BlockSize> > lock(m_storage);
+
+      std::vector<Block<BlockSize> > blocks = m_storage.createN(m_batchSize);
+      // Handing out the lowest ids first, the same order create() uses.
+      for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+         m_blockIds.push_back(it->id());
+      }
+      m_storage.m_numCachedBlocks.fetch_add(blocks.size());
+   }
+
+   void drain(size_t count)
+   {
+      if (count == 0) return;
+
+      std::lock_guard<BlockStorage<BlockSize> > lock(m_storage);
+
+      for (size_t i = 0; i < count; ++i) {
+         m_storage.free(m_blockIds.back());
+         m_blockIds.pop_back();
+         m_storage.m_numCachedBlocks.fetch_sub(1);
+      }
+   }
+};
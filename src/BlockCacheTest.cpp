@@ -0,0 +1,80 @@
+#include <catch.hpp>
+
+#include "BlockCache.h"
+#include "BlockStorage.h"
+#include "ReservedMemory.h"
+#include <set>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Create and free Blocks through a BlockCache", "[BlockCache]") {
+    BlockStorage<1028> storage(std::make_unique<FakeSharedMemory>(0U));
+    {
+        BlockCache<1028> cache(storage, 8);
+
+        std::vector<uint64_t> blockIds;
+        for (size_t index = 0; index < 10; ++index) {
+            Block<1028> block = cache.create();
+            REQUIRE(block.id() == index);
+            REQUIRE(block.size() == 0U);
+            blockIds.push_back(block.id());
+
+            REQUIRE(storage.size() == index + 1);
+        }
+        // Two batches were taken, 6 blocks are still cached.
+        REQUIRE(cache.numCached() == 6U);
+        REQUIRE(storage.numFreeBlocks() == 6U);
+
+        for (uint64_t blockId : blockIds) {
+            cache.free(blockId);
+        }
+        REQUIRE(storage.size() == 1U /* free space map */);
+        REQUIRE(storage.numFreeBlocks() == 16U);
+        // Reaching two batches drains one of them to the storage.
+        REQUIRE(cache.numCached() == 8U);
+
+        Block<1028> block = cache.create();
+        REQUIRE(storage.size() == 2U);
+        REQUIRE(block.size() == 0U);
+    }
+
+    // Destroying the cache hands every cached block back.
+    REQUIRE(storage.size() == 2U);
+    REQUIRE(storage.numFreeBlocks() == 15U);
+}
+
+TEST_CASE("BlockCaches on many threads", "[BlockCache]") {
+    BlockStorage<1028> storage(std::make_unique<ReservedMemory>(64 << 20));
+    storage.reserve(20000);
+
+    const size_t numThreads = 8;
+    const size_t numBlocksPerThread = 1000;
+    std::vector<std::vector<uint64_t> > blockIds(numThreads);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&storage, &blockIds, t]() {
+            BlockCache<1028> cache(storage, 16);
+            for (size_t i = 0; i < numBlocksPerThread; ++i) {
+                Block<1028> block = cache.create();
+                blockIds[t].push_back(block.id());
+                if (i % 3 == 0) {
+                    cache.free(block);
+                    blockIds[t].pop_back();
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    std::set<uint64_t> uniqueIds;
+    for (const std::vector<uint64_t>& ids : blockIds) {
+        uniqueIds.insert(ids.begin(), ids.end());
+    }
+
+    const size_t numUsed = numThreads * (numBlocksPerThread - (numBlocksPerThread + 2) / 3);
+    REQUIRE(uniqueIds.size() == numUsed);
+    REQUIRE(storage.size() == numUsed + 1 /* free space map */);
+}
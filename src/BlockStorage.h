@@ -1,10 +1,23 @@
 #pragma once
 
+#include "BufferPool.h"
+#include "EpochManager.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <vector>
 #include <cstring>
 #include <cassert>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+
+#include <unistd.h>
 
 class ISharedMemory
 {
@@ -14,9 +27,23 @@ public:
    virtual void lock() = 0;
    virtual void unlock() = 0;
 
+   // Shared locking for readers. Backends without it fall back to the
+   // exclusive lock.
+   virtual void lock_shared() { lock(); }
+   virtual void unlock_shared() { unlock(); }
+
    virtual void* get() = 0;
    virtual size_t size() = 0;
    virtual void realloc(size_t requestedSize) = 0;
+
+   // Gives the memory beyond requestedSize back. Backends that cannot shrink
+   // simply keep it.
+   virtual void truncate(size_t /* requestedSize */) {}
+
+   // Tells the backend that the page aligned range [offset, offset + size) is
+   // unused, so it may give the physical pages behind it back. The range reads
+   // as zeros afterwards. Backends that cannot release pages keep them.
+   virtual void release(size_t /* offset */, size_t /* size */) {}
 };
 
 class FakeSharedMemory : public ISharedMemory
@@ -36,6 +63,15 @@ public:
       m_mutex.unlock();
    }
 
+   virtual void lock_shared() override
+   {
+      m_mutex.lock_shared();
+   }
+   virtual void unlock_shared() override
+   {
+      m_mutex.unlock_shared();
+   }
+
    virtual void* get() override
    {
       return m_buffer.data();
@@ -53,14 +89,37 @@ public:
       m_buffer.resize(requestedSize);
    }
 
+   virtual void truncate(size_t requestedSize) override
+   {
+      if (requestedSize >= size()) return;
+
+      m_buffer.resize(requestedSize);
+      m_buffer.shrink_to_fit();
+   }
+
 private:
-   mutable std::mutex m_mutex;
+   mutable std::shared_timed_mutex m_mutex;
    std::vector<uint8_t> m_buffer;
 };
 
 template <size_t BlockSize>
 class BlockStorage;
 
+template <size_t BlockSize>
+class BlockCache;
+
+// What a block is used for. Kept in the block header so compaction knows
+// which links point at a block it moves. Only blocks that are reachable
+// through links alone are tagged, ids handed out to callers never move.
+enum class BlockTag : uint8_t
+{
+   None,
+   FreeSpaceMap,
+   VectorContinuation,
+   RecordContinuation,
+   VectorDirectory
+};
+
 template <size_t BlockSize>
 class Block
 {
@@ -74,6 +133,8 @@ public:
       header->id = id;
       header->blockSize = blockSize;
       header->size = 0;
+      header->isFree = 0;
+      header->tag = static_cast<uint8_t>(BlockTag::None);
    }
 
    Block(BlockStorage<BlockSize>* storage, uint64_t id)
@@ -101,6 +162,52 @@ public:
       return getHeader()->size;
    }
 
+   bool isFree() const
+   {
+      return !!getHeader()->isFree;
+   }
+
+   BlockTag tag() const
+   {
+      return static_cast<BlockTag>(getHeader()->tag);
+   }
+
+   // Sequence number of the block, odd while a writer changes it. Readers
+   // that do not hold the lock read the version, copy what they need and
+   // read the version again. When it is odd or changed they have to retry.
+   uint32_t version() const
+   {
+      return __atomic_load_n(&getHeader()->version, __ATOMIC_ACQUIRE);
+   }
+
+   // Whether version is still the version of the block after reading it
+   // without the lock.
+   bool validate(uint32_t version) const
+   {
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      return (version & 1) == 0 && this->version() == version;
+   }
+
+   // Writers, holding the lock, bracket changes that optimistic readers may
+   // see with beginWrite() and endWrite().
+   void beginWrite()
+   {
+      Header* header = getHeader();
+      __atomic_store_n(&header->version, header->version + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+   }
+
+   void endWrite()
+   {
+      Header* header = getHeader();
+      __atomic_store_n(&header->version, header->version + 1, __ATOMIC_RELEASE);
+   }
+
+   void setTag(BlockTag tag)
+   {
+      getHeader()->tag = static_cast<uint8_t>(tag);
+   }
+
    uint8_t* data()
    {
       return reinterpret_cast<uint8_t*>(getHeader()) + sizeof(Header);
@@ -111,15 +218,27 @@ public:
       return reinterpret_cast<const uint8_t*>(getHeader())  + sizeof(Header);
    }
 
-   void set(uint8_t* data, uint64_t size)
+   // For writers that fill data() in place instead of calling set().
+   void setSize(uint64_t size)
+   {
+      if (size > blockSize()) {
+         // TODO: Throw
+      }
+
+      getHeader()->size = size;
+   }
+
+   void set(const uint8_t* data, uint64_t size)
    {
       if (size > blockSize()) {
          // TODO: Throw
       }
 
+      beginWrite();
       // TODO: numeric_cast
       std::memcpy(this->data(), data, static_cast<size_t>(size));
       getHeader()->size = size;
+      endWrite();
    }
 
    const BlockStorage<BlockSize>& storage() const
@@ -133,6 +252,8 @@ public:
    }
 
 private:
+   friend class BlockStorage<BlockSize>;
+
 #pragma pack(push, 8)
    struct Header
    {
@@ -140,18 +261,22 @@ private:
       uint64_t blockSize; // 8 bytes
       uint64_t size;      // 8 bytes
       uint8_t isFree;     // 1 bytes
-                          // 7 bytes (padding)
+      uint8_t tag;        // 1 bytes
+                          // 2 bytes (padding)
+      uint32_t version;   // 4 bytes, kept when the block is created again
    };
 #pragma pack(pop)
 
    Header* getHeader()
    {
-      return reinterpret_cast<Header*>(m_storage->getFirstBlockAddress() + (BlockSize * m_index));
+      return reinterpret_cast<Header*>(m_storage->getBlockAddress(m_index));
    }
 
+   // Reads go through the const address, a pooled storage does not write the
+   // page back for them.
    const Header* getHeader() const
    {
-      return reinterpret_cast<const Header*>(m_storage->getFirstBlockAddress() + (BlockSize * m_index));
+      return reinterpret_cast<const Header*>(static_cast<const BlockStorage<BlockSize>*>(m_storage)->getBlockAddress(m_index));
    }
 
    BlockStorage<BlockSize>* m_storage;
@@ -161,14 +286,199 @@ private:
 template <size_t BlockSize>
 const uint64_t Block<BlockSize>::MIN_BLOCK_SIZE = sizeof(Block<BlockSize>::Header);
 
+// Elements that lie next to each other in one block, as handed out by the
+// segments() of VectorView and RecordView.
+template <typename T>
+struct Segment
+{
+   T* data;
+   size_t size;
+
+   T* begin() const
+   {
+      return data;
+   }
+
+   T* end() const
+   {
+      return data + size;
+   }
+   operator Segment<const T>() const
+   {
+      return Segment<const T>{data, size};
+   }
+};
+
 template <typename T, size_t BlockSize>
 class VectorView
 {
 public:
+   // Random access iterator that remembers the block of the element it is at,
+   // so moving within a block needs no lookup. Like references returned by
+   // operator[] it is invalidated when the backing memory moves.
+   template <bool IsConst>
+   class Iterator
+   {
+   public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = T;
+      using difference_type = std::ptrdiff_t;
+      using pointer = typename std::conditional<IsConst, const T*, T*>::type;
+      using reference = typename std::conditional<IsConst, const T&, T&>::type;
+
+      Iterator()
+         : m_head(nullptr, 0),
+           m_index(0),
+           m_segmentBegin(0),
+           m_segmentEnd(0),
+           m_segment(nullptr)
+      {
+      }
+
+      Iterator(Block<BlockSize> head, uint64_t index)
+         : m_head(head),
+           m_index(index),
+           m_segmentBegin(0),
+           m_segmentEnd(0),
+           m_segment(nullptr)
+      {
+      }
+
+      // A const_iterator can be made from an iterator.
+      template <bool OtherIsConst, typename = typename std::enable_if<IsConst || !OtherIsConst>::type>
+      Iterator(const Iterator<OtherIsConst>& other)
+         : m_head(other.m_head),
+           m_index(other.m_index),
+           m_segmentBegin(other.m_segmentBegin),
+           m_segmentEnd(other.m_segmentEnd),
+           m_segment(other.m_segment)
+      {
+      }
+
+      reference operator*() const
+      {
+         if (m_index < m_segmentBegin || m_index >= m_segmentEnd) {
+            load();
+         }
+         // TODO: numeric_cast
+         return m_segment[static_cast<size_t>(m_index - m_segmentBegin)];
+      }
+
+      pointer operator->() const
+      {
+         return &**this;
+      }
+
+      reference operator[](difference_type n) const
+      {
+         return *(*this + n);
+      }
+
+      Iterator& operator++()
+      {
+         ++m_index;
+         return *this;
+      }
+
+      Iterator operator++(int)
+      {
+         Iterator result = *this;
+         ++m_index;
+         return result;
+      }
+
+      Iterator& operator--()
+      {
+         --m_index;
+         return *this;
+      }
+
+      Iterator operator--(int)
+      {
+         Iterator result = *this;
+         --m_index;
+         return result;
+      }
+
+      Iterator& operator+=(difference_type n)
+      {
+         m_index += n;
+         return *this;
+      }
+
+      Iterator& operator-=(difference_type n)
+      {
+         m_index -= n;
+         return *this;
+      }
+
+      friend Iterator operator+(Iterator it, difference_type n)
+      {
+         return it += n;
+      }
+
+      friend Iterator operator+(difference_type n, Iterator it)
+      {
+         return it += n;
+      }
+
+      friend Iterator operator-(Iterator it, difference_type n)
+      {
+         return it -= n;
+      }
+
+      friend difference_type operator-(const Iterator& lhs, const Iterator& rhs)
+      {
+         return static_cast<difference_type>(lhs.m_index) - static_cast<difference_type>(rhs.m_index);
+      }
+
+      friend bool operator==(const Iterator& lhs, const Iterator& rhs) { return lhs.m_index == rhs.m_index; }
+      friend bool operator!=(const Iterator& lhs, const Iterator& rhs) { return lhs.m_index != rhs.m_index; }
+      friend bool operator<(const Iterator& lhs, const Iterator& rhs) { return lhs.m_index < rhs.m_index; }
+      friend bool operator>(const Iterator& lhs, const Iterator& rhs) { return lhs.m_index > rhs.m_index; }
+      friend bool operator<=(const Iterator& lhs, const Iterator& rhs) { return lhs.m_index <= rhs.m_index; }
+      friend bool operator>=(const Iterator& lhs, const Iterator& rhs) { return lhs.m_index >= rhs.m_index; }
+
+      // The elements from this one to the end of its block.
+      Segment<typename std::remove_reference<reference>::type> segment() const
+      {
+         pointer first = &**this;
+         // TODO: numeric_cast
+         return {first, static_cast<size_t>(m_segmentEnd - m_index)};
+      }
+
+   private:
+      template <bool> friend class Iterator;
+
+      Block<BlockSize> m_head;
+      uint64_t m_index;
+      // Elements [m_segmentBegin, m_segmentEnd) lie in the block at m_segment.
+      mutable uint64_t m_segmentBegin;
+      mutable uint64_t m_segmentEnd;
+      mutable T* m_segment;
+
+      void load() const
+      {
+         VectorView<T, BlockSize> vector(m_head);
+         uint64_t indexInBlock = 0;
+         Block<BlockSize> block = vector.blockOf(m_index, indexInBlock);
+         m_segmentBegin = m_index - indexInBlock;
+         m_segmentEnd = m_segmentBegin + recordDataSize(block) / sizeof(T);
+         m_segment = reinterpret_cast<T*>(recordData(block));
+      }
+   };
+
+   using iterator = Iterator<false>;
+   using const_iterator = Iterator<true>;
+
    static VectorView<T, BlockSize> createVectorView(Block<BlockSize> block)
    {
       memset(block.data(), 0, block.capacity());
       // TODO: set magic number?
+      HeadFormat* head = getHeadFormat(block);
+      head->tailBlockId = block.id();
+      head->numBlocks = 1;
+      head->directoryBlockId = kNoBlock;
       return VectorView<T, BlockSize>(block);
    }
 
@@ -183,39 +493,21 @@ public:
       return m_block.id();
    }
 
+   // Blocks reserved past the last element count too.
    uint64_t capacity()
    {
-      Block<BlockSize> block = m_block;
-      uint64_t totalCapacity = recordCapacity(block);
-      while (hasNextBlockId(block)) {
-          block = m_block.storage().at(nextBlockId(block));
-          totalCapacity += recordCapacity(block);
-      }
-
-      return totalCapacity / sizeof(T);
+      const uint64_t numContinuationBlocks = getHead()->numBlocks - 1;
+      return numInBlock(m_block) + numContinuationBlocks * kNumPerContinuation;
    }
 
    uint64_t numBlocks()
    {
-      Block<BlockSize> block = m_block;
-      uint64_t numBlocks = 1;
-      while (hasNextBlockId(block)) {
-          block = m_block.storage().at(nextBlockId(block));
-          ++numBlocks;
-      }
-
-      return numBlocks;
+      return getHead()->numBlocks;
    }
 
    uint64_t size()
    {
-      Block<BlockSize> block = m_block;
-      uint64_t totalSize = recordDataSize(block);
-      while (hasNextBlockId(block)) {
-          block = m_block.storage().at(nextBlockId(block));
-          totalSize += recordDataSize(block);
-      }
-
+      const uint64_t totalSize = getHead()->totalSize;
       assert(totalSize % sizeof(T) == 0);
       return totalSize / sizeof(T);
    }
@@ -226,18 +518,57 @@ public:
          // TODO: throw exception
       }
 
+      uint64_t indexInBlock = 0;
+      Block<BlockSize> block = blockOf(idx, indexInBlock);
+      assert(indexInBlock < recordDataSize(block) / sizeof(T));
+      // TODO: numeric_cast
+      return reinterpret_cast<T*>(recordData(block))[static_cast<size_t>(indexInBlock)];
+   }
+
+   iterator begin()
+   {
+      return iterator(m_block, 0);
+   }
+
+   iterator end()
+   {
+      return iterator(m_block, size());
+   }
+
+   const_iterator cbegin()
+   {
+      return const_iterator(m_block, 0);
+   }
+
+   const_iterator cend()
+   {
+      return const_iterator(m_block, size());
+   }
+
+   // The elements block by block, for loops that want to work on plain
+   // arrays.
+   std::vector<Segment<T> > segments()
+   {
+      std::vector<Segment<T> > segments;
+      // TODO: numeric_cast
+      segments.reserve(static_cast<size_t>(numBlocks()));
+      prefetchBlocks(1, numBlocks());
+
+      const uint64_t tailBlockId = getHead()->tailBlockId;
       Block<BlockSize> block = m_block;
-      while (idx >= (recordDataSize(block) / sizeof(T))) {
-         assert(recordDataSize(block) % sizeof(T) == 0);
-         idx -= recordDataSize(block) / sizeof(T);
-         // The size check at the beginning should also validate
-         // this. asserting just to make sure.
-         assert(hasNextBlockId(block));
-         block = m_block.storage().at(nextBlockId(block));
+      while (true) {
+         // TODO: numeric_cast
+         segments.push_back(Segment<T>{reinterpret_cast<T*>(recordData(block)), static_cast<size_t>(recordDataSize(block) / sizeof(T))});
+         if (block.id() == tailBlockId) break;
+         block = m_block.storage().at(static_cast<size_t>(nextBlockId(block)));
       }
+      return segments;
+   }
 
-      assert(idx < recordDataSize(block) / sizeof(T));
-      return reinterpret_cast<T*>(recordData(block))[idx];
+   std::vector<Segment<const T> > csegments()
+   {
+      std::vector<Segment<T> > segments = this->segments();
+      return std::vector<Segment<const T> >(segments.begin(), segments.end());
    }
 
    void push_back(const T& data)
@@ -246,22 +577,32 @@ public:
       Block<BlockSize> end = getLastBlock();
 
       size_t neededSize = static_cast<size_t>(recordDataSize(end) + sizeOfData);
-      if (neededSize > recordCapacity(end)) {
+      if (neededSize > recordCapacity(end) && hasNextBlockId(end)) {
+         // TODO: numeric_cast
+         Block<BlockSize> newEnd = m_block.storage().at(static_cast<size_t>(nextBlockId(end)));
+         getHead()->tailBlockId = newEnd.id();
+         recordDataAppend(newEnd, reinterpret_cast<const uint8_t*>(&data), sizeOfData);
+      } else if (neededSize > recordCapacity(end)) {
          Block<BlockSize> newEnd = m_block.storage().create();
-         initializeVectorFormat(newEnd);
-         setPrevBlockId(newEnd, end.id());
-
+         HeadFormat* head = getHead();
+         initializeContinuation(newEnd, end.id(), head->numBlocks);
          setNextBlockId(end, newEnd.id());
 
+         setDirectoryEntry(head->numBlocks - 1, newEnd.id());
+         head = getHead();
+         head->tailBlockId = newEnd.id();
+         head->numBlocks += 1;
+
          recordDataAppend(newEnd, reinterpret_cast<const uint8_t*>(&data), sizeOfData);
       } else {
          recordDataAppend(end, reinterpret_cast<const uint8_t*>(&data), sizeOfData);
       }
+      getHead()->totalSize += sizeOfData;
    }
 
    T pop_back()
    {
-      if (getFormat()->size == 0) {
+      if (getHead()->totalSize == 0) {
          // TODO: throw exception
       }
 
@@ -269,20 +610,147 @@ public:
 
       T item;
       recordDataPop(end, reinterpret_cast<uint8_t*>(&item), sizeof(T));
+      getHead()->totalSize -= sizeof(T);
 
-      // Check if that end is empty. If so we should free it.
+      // Check if that end is empty. If so we should free it, together with
+      // any blocks reserved after it. Its entry in the directory is simply
+      // overwritten by the next block pushed.
       if (recordDataSize(end) == 0) {
          if (hasPrevBlockId(end)) {
             Block<BlockSize> prevBlock = m_block.storage().at(static_cast<size_t>(prevBlockId(end)));
-            clearNextBlockId(prevBlock);
-
-            m_block.storage().free(end);
+            releaseBlocksAfter(prevBlock);
          }
       }
 
       return item;
    }
 
+   // Allocates the blocks for n elements up front, all in one go.
+   void reserve(uint64_t n)
+   {
+      const uint64_t numNeeded = n <= numInBlock(m_block) ? 1 : blockNumberOf(n - 1) + 1;
+      const uint64_t numBlocks = getHead()->numBlocks;
+      if (numNeeded <= numBlocks) return;
+
+      // TODO: numeric_cast
+      std::vector<Block<BlockSize> > blocks = m_block.storage().createN(static_cast<size_t>(numNeeded - numBlocks));
+      Block<BlockSize> last = blockNumberToBlock(numBlocks - 1);
+      for (uint64_t i = 0; i < blocks.size(); ++i) {
+         Block<BlockSize>& block = blocks[i];
+         initializeContinuation(block, last.id(), numBlocks + i);
+         setNextBlockId(last, block.id());
+         setDirectoryEntry(numBlocks - 1 + i, block.id());
+         last = block;
+      }
+      getHead()->numBlocks = numNeeded;
+   }
+
+   // Appends [first, last) with one copy per block. Input iterators that can
+   // only be walked once are pushed one by one.
+   template <class InputIterator>
+   void append(InputIterator first, InputIterator last)
+   {
+      append(first, last, typename std::iterator_traits<InputIterator>::iterator_category());
+   }
+
+   void append(const T* data, size_t count)
+   {
+      append(data, data + count);
+   }
+
+   // Grows with copies of value or shrinks to n elements. Shrinking frees
+   // the blocks behind the new end, like pop_back does.
+   void resize(uint64_t n, const T& value = T())
+   {
+      const uint64_t oldSize = size();
+      if (n <= oldSize) {
+         truncate(n);
+         return;
+      }
+
+      const T copy = value;
+      grow(n);
+      forEachChunk(oldSize, n, [&copy](Block<BlockSize>&, T* data, size_t count) {
+         std::fill_n(data, count, copy);
+      });
+   }
+
+   iterator insert(const_iterator position, const T& value)
+   {
+      // Copied first, value may be an element of this vector.
+      const T copy = value;
+      return insert(position, &copy, &copy + 1);
+   }
+
+   // Moves the elements behind position back block by block and copies the
+   // new ones in between.
+   template <class InputIterator>
+   iterator insert(const_iterator position, InputIterator first, InputIterator last)
+   {
+      const uint64_t index = static_cast<uint64_t>(position - cbegin());
+      std::vector<T> items(first, last);
+      const uint64_t oldSize = size();
+      grow(oldSize + items.size());
+      moveElements(index, index + items.size(), oldSize - index);
+      copyIn(index, items.data(), items.size());
+      return begin() + index;
+   }
+
+   iterator erase(const_iterator position)
+   {
+      return erase(position, position + 1);
+   }
+
+   iterator erase(const_iterator first, const_iterator last)
+   {
+      const uint64_t from = static_cast<uint64_t>(first - cbegin());
+      const uint64_t to = static_cast<uint64_t>(last - cbegin());
+      const uint64_t oldSize = size();
+      if (from == to) return begin() + from;
+
+      moveElements(to, from, oldSize - to);
+      truncate(oldSize - (to - from));
+      return begin() + from;
+   }
+
+   // Points the neighbours of a continuation block, the block directory and
+   // the tail at its id again after BlockStorage::compact() moved it away from
+   // oldBlockId. Nothing here depends on T, compaction relinks every vector
+   // through VectorView<uint8_t>.
+   static void relink(Block<BlockSize> block, uint64_t oldBlockId)
+   {
+      Block<BlockSize> prevBlock = block.storage().at(static_cast<size_t>(prevBlockId(block)));
+      setNextBlockId(prevBlock, block.id());
+      if (hasNextBlockId(block)) {
+         Block<BlockSize> nextBlock = block.storage().at(static_cast<size_t>(nextBlockId(block)));
+         setPrevBlockId(nextBlock, block.id());
+      }
+
+      const ContinuationFormat* continuation = getContinuationFormat(block);
+      // TODO: numeric_cast
+      VectorView<T, BlockSize> vector(block.storage().at(static_cast<size_t>(continuation->headBlockId)));
+      if (vector.getHead()->tailBlockId == oldBlockId) {
+         vector.getHead()->tailBlockId = block.id();
+      }
+      vector.setDirectoryEntry(continuation->blockNumber - 1, block.id());
+   }
+
+   // Points the parent of a directory block at its id again after
+   // BlockStorage::compact() moved it.
+   static void relinkDirectory(Block<BlockSize> block)
+   {
+      const DirectoryFormat* directory = getDirectoryFormat(block);
+      VectorView<T, BlockSize> vector(block.storage().at(static_cast<size_t>(directory->headBlockId)));
+      HeadFormat* head = vector.getHead();
+      if (directory->level + 1 == head->directoryDepth) {
+         head->directoryBlockId = block.id();
+         return;
+      }
+
+      Block<BlockSize> parent = vector.directoryBlockAt(directory->firstEntry, directory->level + 1);
+      getDirectoryFormat(parent)->blockIds[vector.directorySlot(directory->firstEntry, directory->level + 1)] = block.id();
+   }
+
 private:
 #pragma pack(push, 8)
    struct VectorFormat
@@ -294,8 +762,44 @@ private:
       uint64_t size;        // 8 bytes
       uint8_t  data[1];       // 1 bytes
    };
+
+   // Kept in front of the data of the head block only.
+   struct HeadFormat
+   {
+      uint64_t totalSize;        // 8 bytes, of all blocks
+      uint64_t tailBlockId;      // 8 bytes
+      uint64_t numBlocks;        // 8 bytes
+      uint64_t directoryBlockId; // 8 bytes, root of the directory
+      uint64_t directoryDepth;   // 8 bytes
+   };
+
+   // Kept in front of the data of continuation blocks, so a block moved by
+   // compaction finds its head and its directory entry without a walk.
+   struct ContinuationFormat
+   {
+      uint64_t headBlockId; // 8 bytes
+      uint64_t blockNumber; // 8 bytes, position in the chain, the head is 0
+   };
+
+   // The block directory is a radix tree over the ids of the continuation
+   // blocks, entry n is the id of block n + 1 of the chain. Leaves are level
+   // 0, every level above fans out by kDirectoryFanout.
+   struct DirectoryFormat
+   {
+      uint64_t headBlockId; // 8 bytes
+      uint64_t level;       // 8 bytes
+      uint64_t firstEntry;  // 8 bytes, first entry below this block
+      uint64_t blockIds[1]; // 8 bytes per entry
+   };
 #pragma pack(pop)
 
+   static const uint64_t kNoBlock = UINT64_MAX;
+   static const uint64_t kContinuationCapacity =
+      BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE - offsetof(VectorFormat, data) - sizeof(ContinuationFormat);
+   static const uint64_t kDirectoryFanout =
+      (BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE - offsetof(DirectoryFormat, blockIds)) / sizeof(uint64_t);
+   static const uint64_t kNumPerContinuation = kContinuationCapacity / sizeof(T);
+
    Block<BlockSize> m_block;
 
    VectorFormat* getFormat()
@@ -303,43 +807,359 @@ private:
       return reinterpret_cast<VectorFormat*>(m_block.data());
    }
 
-   Block<BlockSize> getLastBlock()
+   HeadFormat* getHead()
    {
-      Block<BlockSize> block = m_block;
-      while (hasNextBlockId(block)) {
-          block = m_block.storage().at(nextBlockId(block));
-      }
-
-      return block;
+      return getHeadFormat(m_block);
    }
 
-   // TODO: should probably pass in size to validate
-   static void initializeVectorFormat(Block<BlockSize> block)
+   static HeadFormat* getHeadFormat(Block<BlockSize>& block)
    {
-      std::memset(block.data(), 0, offsetof(VectorFormat, data));
+      return reinterpret_cast<HeadFormat*>(reinterpret_cast<VectorFormat*>(block.data())->data);
    }
 
-   static VectorFormat* getVectorFormat(Block<BlockSize>& block)
+   static ContinuationFormat* getContinuationFormat(Block<BlockSize> block)
    {
-      return reinterpret_cast<VectorFormat*>(block.data());
+      return reinterpret_cast<ContinuationFormat*>(reinterpret_cast<VectorFormat*>(block.data())->data);
    }
-   static bool hasNextBlockId(const Block<BlockSize>& block)
+
+   static DirectoryFormat* getDirectoryFormat(Block<BlockSize> block)
    {
-      const VectorFormat* record = reinterpret_cast<const VectorFormat*>(block.data());
-      return record->hasNextBlock;
+      return reinterpret_cast<DirectoryFormat*>(block.data());
    }
 
-   static uint64_t nextBlockId(const Block<BlockSize>& block)
+   Block<BlockSize> getLastBlock()
    {
-      const VectorFormat* record = reinterpret_cast<const VectorFormat*>(block.data());
-      return record->nextBlockId;
+      // TODO: numeric_cast
+      return m_block.storage().at(static_cast<size_t>(getHead()->tailBlockId));
    }
 
-   static void setNextBlockId(Block<BlockSize>& block, uint64_t blockId)
+   // Every block but the last one is full, so the block of an element
+   // follows from its index and is looked up in the block directory.
+   Block<BlockSize> blockOf(uint64_t idx, uint64_t& indexInBlock)
    {
-      VectorFormat* record = reinterpret_cast<VectorFormat*>(block.data());
-      record->nextBlockId = blockId;
-      record->hasNextBlock = true;
+      const uint64_t numInHead = recordCapacity(m_block) / sizeof(T);
+      if (idx < numInHead) {
+         indexInBlock = idx;
+         return m_block;
+      }
+
+      const uint64_t numPerBlock = kContinuationCapacity / sizeof(T);
+      const uint64_t rest = idx - numInHead;
+      indexInBlock = rest % numPerBlock;
+      // TODO: numeric_cast
+      return m_block.storage().at(static_cast<size_t>(directoryEntry(rest / numPerBlock)));
+   }
+
+   // Position in the chain of the block holding the element, the head is 0.
+   uint64_t blockNumberOf(uint64_t idx)
+   {
+      const uint64_t numInHead = numInBlock(m_block);
+      return idx < numInHead ? 0 : (idx - numInHead) / kNumPerContinuation + 1;
+   }
+
+   Block<BlockSize> blockNumberToBlock(uint64_t blockNumber)
+   {
+      // TODO: numeric_cast
+      return blockNumber == 0 ? m_block : m_block.storage().at(static_cast<size_t>(directoryEntry(blockNumber - 1)));
+   }
+
+   // Number of elements the block holds when full.
+   static uint64_t numInBlock(const Block<BlockSize>& block)
+   {
+      return recordCapacity(block) / sizeof(T);
+   }
+
+   // Calls fn(block, data, count) for the elements [from, to), one run of
+   // elements in the same block at a time. The blocks have to exist.
+   template <typename Fn>
+   Block<BlockSize> forEachChunk(uint64_t from, uint64_t to, Fn fn)
+   {
+      prefetchBlocks(std::max<uint64_t>(blockNumberOf(from), 1), blockNumberOf(to - 1) + 1);
+
+      uint64_t indexInBlock = 0;
+      Block<BlockSize> block = blockOf(from, indexInBlock);
+      while (true) {
+         const uint64_t count = std::min(to - from, numInBlock(block) - indexInBlock);
+         // TODO: numeric_cast
+         fn(block, reinterpret_cast<T*>(recordData(block)) + indexInBlock, static_cast<size_t>(count));
+         from += count;
+         if (from == to) return block;
+
+         block = m_block.storage().at(static_cast<size_t>(nextBlockId(block)));
+         indexInBlock = 0;
+      }
+   }
+
+   // Prefetches the continuation blocks [first, last), numbered like
+   // blockNumberToBlock(), on a pooled storage. Their ids come from the
+   // directory, so all of them are read as one batch instead of one after the
+   // other along the chain.
+   void prefetchBlocks(uint64_t first, uint64_t last)
+   {
+      if (m_block.storage().bufferPool() == nullptr || first >= last) return;
+
+      std::vector<uint64_t> blockIds;
+      // TODO: numeric_cast
+      blockIds.reserve(static_cast<size_t>(last - first));
+      for (uint64_t blockNumber = first; blockNumber < last; ++blockNumber) {
+         blockIds.push_back(directoryEntry(blockNumber - 1));
+      }
+      m_block.storage().prefetch(blockIds);
+   }
+
+   void copyIn(uint64_t index, const T* data, size_t count)
+   {
+      if (count == 0) return;
+
+      forEachChunk(index, index + count, [&data](Block<BlockSize>&, T* destination, size_t n) {
+         std::memcpy(destination, data, n * sizeof(T));
+         data += n;
+      });
+   }
+
+   // Makes room for n elements, the new ones are left uninitialized. The
+   // sizes of the blocks and the head are set once, not per element.
+   void grow(uint64_t n)
+   {
+      const uint64_t oldSize = size();
+      if (n <= oldSize) return;
+
+      reserve(n);
+      Block<BlockSize> last = forEachChunk(oldSize, n, [](Block<BlockSize>& block, T*, size_t count) {
+         getVectorFormat(block)->size += count * sizeof(T);
+      });
+      HeadFormat* head = getHead();
+      head->totalSize = n * sizeof(T);
+      head->tailBlockId = last.id();
+   }
+
+   // Drops the elements from n on and frees the blocks behind the new end.
+   void truncate(uint64_t n)
+   {
+      if (n >= size()) return;
+
+      uint64_t indexInBlock = 0;
+      Block<BlockSize> last = n == 0 ? m_block : blockOf(n - 1, indexInBlock);
+      getVectorFormat(last)->size = n == 0 ? 0 : (indexInBlock + 1) * sizeof(T);
+      getHead()->totalSize = n * sizeof(T);
+      releaseBlocksAfter(last);
+   }
+
+   // Frees every block after last, which becomes the tail.
+   void releaseBlocksAfter(Block<BlockSize>& last)
+   {
+      uint64_t numFreed = 0;
+      bool hasNext = hasNextBlockId(last);
+      uint64_t blockId = nextBlockId(last);
+      clearNextBlockId(last);
+      while (hasNext) {
+         // TODO: numeric_cast
+         Block<BlockSize> block = m_block.storage().at(static_cast<size_t>(blockId));
+         hasNext = hasNextBlockId(block);
+         blockId = nextBlockId(block);
+         m_block.storage().free(block);
+         ++numFreed;
+      }
+
+      HeadFormat* head = getHead();
+      head->tailBlockId = last.id();
+      head->numBlocks -= numFreed;
+
+      // Entries past the end are overwritten when the vector grows again, but
+      // without continuation blocks the directory is not needed at all.
+      if (head->numBlocks == 1 && head->directoryBlockId != kNoBlock) {
+         const uint64_t rootId = head->directoryBlockId;
+         const uint64_t depth = head->directoryDepth;
+         head->directoryBlockId = kNoBlock;
+         head->directoryDepth = 0;
+         freeDirectory(rootId, depth - 1);
+      }
+   }
+
+   // Frees the directory block blockId of the given level and everything
+   // below it.
+   void freeDirectory(uint64_t blockId, uint64_t level)
+   {
+      // TODO: numeric_cast
+      Block<BlockSize> block = m_block.storage().at(static_cast<size_t>(blockId));
+      if (level > 0) {
+         for (uint64_t slot = 0; slot < kDirectoryFanout; ++slot) {
+            const uint64_t childId = getDirectoryFormat(block)->blockIds[slot];
+            if (childId != kNoBlock) {
+               freeDirectory(childId, level - 1);
+            }
+         }
+      }
+      m_block.storage().free(block);
+   }
+
+   // Like memmove for count elements from index from to index to, one run
+   // that is contiguous at both ends at a time.
+   void moveElements(uint64_t from, uint64_t to, uint64_t count)
+   {
+      while (count > 0) {
+         uint64_t fromIndex = 0;
+         uint64_t toIndex = 0;
+         uint64_t n = 0;
+         T* source = nullptr;
+         T* destination = nullptr;
+         if (to > from) {
+            // Back to front, so elements are read before they are
+            // overwritten.
+            Block<BlockSize> fromBlock = blockOf(from + count - 1, fromIndex);
+            Block<BlockSize> toBlock = blockOf(to + count - 1, toIndex);
+            n = std::min(count, std::min(fromIndex, toIndex) + 1);
+            source = reinterpret_cast<T*>(recordData(fromBlock)) + fromIndex + 1 - n;
+            destination = reinterpret_cast<T*>(recordData(toBlock)) + toIndex + 1 - n;
+         } else {
+            Block<BlockSize> fromBlock = blockOf(from, fromIndex);
+            Block<BlockSize> toBlock = blockOf(to, toIndex);
+            n = std::min(count, std::min(numInBlock(fromBlock) - fromIndex, numInBlock(toBlock) - toIndex));
+            source = reinterpret_cast<T*>(recordData(fromBlock)) + fromIndex;
+            destination = reinterpret_cast<T*>(recordData(toBlock)) + toIndex;
+            from += n;
+            to += n;
+         }
+         // TODO: numeric_cast
+         std::memmove(destination, source, static_cast<size_t>(n * sizeof(T)));
+         count -= n;
+      }
+   }
+
+   template <class InputIterator>
+   void append(InputIterator first, InputIterator last, std::input_iterator_tag)
+   {
+      for (; first != last; ++first) {
+         push_back(*first);
+      }
+   }
+
+   template <class ForwardIterator>
+   void append(ForwardIterator first, ForwardIterator last, std::forward_iterator_tag)
+   {
+      const uint64_t count = static_cast<uint64_t>(std::distance(first, last));
+      if (count == 0) return;
+
+      const uint64_t oldSize = size();
+      grow(oldSize + count);
+      // A single memmove per block when first is a pointer.
+      forEachChunk(oldSize, oldSize + count, [&first](Block<BlockSize>&, T* data, size_t n) {
+         std::copy_n(first, n, data);
+         std::advance(first, n);
+      });
+   }
+
+   static uint64_t directoryCoverage(uint64_t level)
+   {
+      uint64_t coverage = 1;
+      for (uint64_t i = 0; i < level; ++i) {
+         coverage *= kDirectoryFanout;
+      }
+      return coverage;
+   }
+
+   uint64_t directorySlot(uint64_t entry, uint64_t level)
+   {
+      return (entry / directoryCoverage(level)) % kDirectoryFanout;
+   }
+
+   // Directory block of the given level on the way to entry.
+   Block<BlockSize> directoryBlockAt(uint64_t entry, uint64_t level)
+   {
+      const HeadFormat* head = getHead();
+      // TODO: numeric_cast
+      Block<BlockSize> block = m_block.storage().at(static_cast<size_t>(head->directoryBlockId));
+      for (uint64_t current = head->directoryDepth - 1; current > level; --current) {
+         block = m_block.storage().at(static_cast<size_t>(getDirectoryFormat(block)->blockIds[directorySlot(entry, current)]));
+      }
+      return block;
+   }
+
+   uint64_t directoryEntry(uint64_t entry)
+   {
+      return getDirectoryFormat(directoryBlockAt(entry, 0))->blockIds[entry % kDirectoryFanout];
+   }
+
+   Block<BlockSize> createDirectoryBlock(uint64_t level, uint64_t firstEntry)
+   {
+      Block<BlockSize> block = m_block.storage().create();
+      block.setTag(BlockTag::VectorDirectory);
+      DirectoryFormat* directory = getDirectoryFormat(block);
+      directory->headBlockId = m_block.id();
+      directory->level = level;
+      directory->firstEntry = firstEntry;
+      // All ones, kNoBlock in every entry.
+      std::memset(directory->blockIds, 0xFF, kDirectoryFanout * sizeof(uint64_t));
+      return block;
+   }
+
+   // Grows the directory by a level on top whenever the entry lies beyond it.
+   void setDirectoryEntry(uint64_t entry, uint64_t blockId)
+   {
+      while (getHead()->directoryBlockId == kNoBlock || entry >= directoryCoverage(getHead()->directoryDepth)) {
+         const uint64_t depth = getHead()->directoryBlockId == kNoBlock ? 0 : getHead()->directoryDepth;
+         Block<BlockSize> root = createDirectoryBlock(depth, 0);
+         if (depth > 0) {
+            getDirectoryFormat(root)->blockIds[0] = getHead()->directoryBlockId;
+         }
+         HeadFormat* head = getHead();
+         head->directoryBlockId = root.id();
+         head->directoryDepth = depth + 1;
+      }
+
+      // TODO: numeric_cast
+      Block<BlockSize> block = m_block.storage().at(static_cast<size_t>(getHead()->directoryBlockId));
+      for (uint64_t level = getHead()->directoryDepth - 1; level > 0; --level) {
+         const uint64_t slot = directorySlot(entry, level);
+         if (getDirectoryFormat(block)->blockIds[slot] == kNoBlock) {
+            const uint64_t firstEntry = (entry / directoryCoverage(level)) * directoryCoverage(level);
+            Block<BlockSize> child = createDirectoryBlock(level - 1, firstEntry);
+            getDirectoryFormat(block)->blockIds[slot] = child.id();
+         }
+         block = m_block.storage().at(static_cast<size_t>(getDirectoryFormat(block)->blockIds[slot]));
+      }
+      getDirectoryFormat(block)->blockIds[entry % kDirectoryFanout] = blockId;
+   }
+
+   // TODO: should probably pass in size to validate
+   static void initializeVectorFormat(Block<BlockSize> block)
+   {
+      std::memset(block.data(), 0, offsetof(VectorFormat, data));
+   }
+
+   // Makes block number blockNumber of this vector's chain, following
+   // prevBlockId.
+   void initializeContinuation(Block<BlockSize>& block, uint64_t prevBlockId, uint64_t blockNumber)
+   {
+      initializeVectorFormat(block);
+      block.setTag(BlockTag::VectorContinuation);
+      setPrevBlockId(block, prevBlockId);
+      ContinuationFormat* continuation = getContinuationFormat(block);
+      continuation->headBlockId = m_block.id();
+      continuation->blockNumber = blockNumber;
+   }
+
+   static VectorFormat* getVectorFormat(Block<BlockSize>& block)
+   {
+      return reinterpret_cast<VectorFormat*>(block.data());
+   }
+   static bool hasNextBlockId(const Block<BlockSize>& block)
+   {
+      const VectorFormat* record = reinterpret_cast<const VectorFormat*>(block.data());
+      return record->hasNextBlock;
+   }
+
+   static uint64_t nextBlockId(const Block<BlockSize>& block)
+   {
+      const VectorFormat* record = reinterpret_cast<const VectorFormat*>(block.data());
+      return record->nextBlockId;
+   }
+
+   static void setNextBlockId(Block<BlockSize>& block, uint64_t blockId)
+   {
+      VectorFormat* record = reinterpret_cast<VectorFormat*>(block.data());
+      record->nextBlockId = blockId;
+      record->hasNextBlock = true;
    }
 
    static void clearNextBlockId(Block<BlockSize>& block)
@@ -375,9 +1195,16 @@ private:
       record->hasPrevBlock = false;
    }
 
+   // The head keeps the HeadFormat in front of its elements, continuation
+   // blocks the ContinuationFormat.
+   static uint64_t headerSize(const Block<BlockSize>& block)
+   {
+      return hasPrevBlockId(block) ? sizeof(ContinuationFormat) : sizeof(HeadFormat);
+   }
+
    static uint64_t recordCapacity(const Block<BlockSize>& block)
    {
-      return block.capacity() - offsetof(VectorFormat, data);
+      return block.capacity() - offsetof(VectorFormat, data) - headerSize(block);
    }
 
    static uint64_t recordDataSize(const Block<BlockSize>& block)
@@ -389,13 +1216,13 @@ private:
    static const uint8_t* recordData(const Block<BlockSize>& block)
    {
       const VectorFormat* record = reinterpret_cast<const VectorFormat*>(block.data());
-      return record->data;
+      return record->data + headerSize(block);
    }
 
    static uint8_t* recordData(Block<BlockSize>& block)
    {
       VectorFormat* record = reinterpret_cast<VectorFormat*>(block.data());
-      return record->data;
+      return record->data + headerSize(block);
    }
 
    static void recordDataAppend(Block<BlockSize>& block, const uint8_t* data, size_t size)
@@ -427,6 +1254,158 @@ template <size_t BlockSize>
 class RecordView
 {
 public:
+   // Bidirectional iterator over the bytes of the record that remembers the
+   // block and offset it is at. The blocks of a record are only linked to
+   // each other, so it cannot jump like the iterator of VectorView.
+   template <bool IsConst>
+   class Iterator
+   {
+   public:
+      using iterator_category = std::bidirectional_iterator_tag;
+      using value_type = uint8_t;
+      using difference_type = std::ptrdiff_t;
+      using pointer = typename std::conditional<IsConst, const uint8_t*, uint8_t*>::type;
+      using reference = typename std::conditional<IsConst, const uint8_t&, uint8_t&>::type;
+
+      Iterator()
+         : m_head(nullptr, 0),
+           m_block(nullptr, 0),
+           m_offset(0),
+           m_atEnd(true)
+      {
+      }
+
+      // Starts at the first byte of the record, or at its end when it is
+      // empty.
+      explicit Iterator(Block<BlockSize> head)
+         : m_head(head),
+           m_block(head),
+           m_offset(0),
+           m_atEnd(false)
+      {
+         skipEmptyBlocks();
+      }
+
+      static Iterator end(Block<BlockSize> head)
+      {
+         Iterator it;
+         it.m_head = head;
+         it.m_block = head;
+         return it;
+      }
+
+      template <bool OtherIsConst, typename = typename std::enable_if<IsConst || !OtherIsConst>::type>
+      Iterator(const Iterator<OtherIsConst>& other)
+         : m_head(other.m_head),
+           m_block(other.m_block),
+           m_offset(other.m_offset),
+           m_atEnd(other.m_atEnd)
+      {
+      }
+
+      reference operator*() const
+      {
+         Block<BlockSize> block = m_block;
+         // TODO: numeric_cast
+         return recordData(block)[static_cast<size_t>(m_offset)];
+      }
+
+      pointer operator->() const
+      {
+         return &**this;
+      }
+
+      Iterator& operator++()
+      {
+         assert(!m_atEnd);
+         ++m_offset;
+         if (m_offset == recordDataSize(m_block)) {
+            if (!hasNextBlockId(m_block)) {
+               m_atEnd = true;
+               return *this;
+            }
+            // TODO: numeric_cast
+            m_block = m_head.storage().at(static_cast<size_t>(nextBlockId(m_block)));
+            m_offset = 0;
+            skipEmptyBlocks();
+         }
+         return *this;
+      }
+
+      Iterator operator++(int)
+      {
+         Iterator result = *this;
+         ++*this;
+         return result;
+      }
+
+      Iterator& operator--()
+      {
+         if (m_atEnd) {
+            m_atEnd = false;
+            m_block = lastBlock(m_head);
+            m_offset = recordDataSize(m_block);
+         }
+         while (m_offset == 0) {
+            assert(hasPrevBlockId(m_block));
+            // TODO: numeric_cast
+            m_block = m_head.storage().at(static_cast<size_t>(prevBlockId(m_block)));
+            m_offset = recordDataSize(m_block);
+         }
+         --m_offset;
+         return *this;
+      }
+
+      Iterator operator--(int)
+      {
+         Iterator result = *this;
+         --*this;
+         return result;
+      }
+
+      friend bool operator==(const Iterator& lhs, const Iterator& rhs)
+      {
+         if (lhs.m_atEnd || rhs.m_atEnd) return lhs.m_atEnd == rhs.m_atEnd;
+         return lhs.m_block.id() == rhs.m_block.id() && lhs.m_offset == rhs.m_offset;
+      }
+
+      friend bool operator!=(const Iterator& lhs, const Iterator& rhs)
+      {
+         return !(lhs == rhs);
+      }
+
+      // The bytes from this one to the end of its block.
+      Segment<typename std::remove_reference<reference>::type> segment() const
+      {
+         if (m_atEnd) return {nullptr, 0};
+         // TODO: numeric_cast
+         return {&**this, static_cast<size_t>(recordDataSize(m_block) - m_offset)};
+      }
+
+   private:
+      template <bool> friend class Iterator;
+
+      Block<BlockSize> m_head;
+      Block<BlockSize> m_block;
+      uint64_t m_offset;
+      bool m_atEnd;
+
+      void skipEmptyBlocks()
+      {
+         while (recordDataSize(m_block) == 0) {
+            if (!hasNextBlockId(m_block)) {
+               m_atEnd = true;
+               return;
+            }
+            // TODO: numeric_cast
+            m_block = m_head.storage().at(static_cast<size_t>(nextBlockId(m_block)));
+         }
+      }
+   };
+
+   using iterator = Iterator<false>;
+   using const_iterator = Iterator<true>;
+
    static RecordView<BlockSize> createRecordView(Block<BlockSize> block)
    {
       memset(block.data(), 0, block.capacity());
@@ -445,6 +1424,28 @@ public:
       return m_block.id();
    }
 
+   // Points the neighbours of a continuation block at its id again after
+   // BlockStorage::compact() moved it, pass it as relinkRecordBlock:
+   //
+   //    storage.compact(maxMoves, &RecordView<BlockSize>::relink);
+   static void relink(Block<BlockSize> block, uint64_t /*oldBlockId*/)
+   {
+      // TODO: numeric_cast
+      Block<BlockSize> prevBlock = block.storage().at(static_cast<size_t>(prevBlockId(block)));
+      Block<BlockSize> head = prevBlock;
+      while (hasPrevBlockId(head)) {
+         head = block.storage().at(static_cast<size_t>(prevBlockId(head)));
+      }
+
+      head.beginWrite();
+      setNextBlockId(prevBlock, block.id());
+      if (hasNextBlockId(block)) {
+         Block<BlockSize> nextBlock = block.storage().at(static_cast<size_t>(nextBlockId(block)));
+         setPrevBlockId(nextBlock, block.id());
+      }
+      head.endWrite();
+   }
+
    uint64_t capacity()
    {
       Block<BlockSize> block = m_block;
@@ -484,23 +1485,31 @@ public:
    std::vector<uint8_t> data()
    {
       std::vector<uint8_t> data;
+      // TODO: numeric_cast
+      data.reserve(static_cast<size_t>(size()));
 
-      Block<BlockSize> block = m_block;
-      data.insert(data.end(), recordData(block), recordData(block) + recordDataSize(block));
-      while (hasNextBlockId(block)) {
-          block = m_block.storage().at(nextBlockId(block));
-          data.insert(data.end(), recordData(block), recordData(block) + recordDataSize(block));
+      for (const Segment<uint8_t>& segment : segments()) {
+          data.insert(data.end(), segment.begin(), segment.end());
       }
 
-      // TODO: more straight forward way?
-      // std::vector<Block<BlockSize> > blocks = getBlocks();
-      // for (Block<BlockSize>& block: blocks) {
-      //     data.insert(data.end(), recordData(block), recordData(block) + recordDataSize(block));
-      // }
-
       return data;
    }
 
+   // Copies the record into buffer when it fits into capacity bytes and
+   // returns its size either way.
+   size_t copyTo(uint8_t* buffer, size_t capacity)
+   {
+      // TODO: numeric_cast
+      const size_t dataSize = static_cast<size_t>(size());
+      if (dataSize <= capacity) {
+         for (const Segment<uint8_t>& segment : segments()) {
+            std::memcpy(buffer, segment.data, segment.size);
+            buffer += segment.size;
+         }
+      }
+      return dataSize;
+   }
+
    uint8_t& operator[](size_t idx)
    {
       if (idx >= size()) {
@@ -514,21 +1523,69 @@ public:
          block = m_block.storage().at(nextBlockId(block));
       }
 
-      assert(idx < recordDataSize(block.size()));
+      assert(idx < recordDataSize(block));
       return recordData(block)[idx];
    }
 
-   void assign(size_t n, uint8_t value)
+   iterator begin()
    {
+      return iterator(m_block);
    }
 
+   iterator end()
+   {
+      return iterator::end(m_block);
+   }
 
-   template <class InputIterator>
-   void assign(InputIterator first, InputIterator last)
+   const_iterator cbegin()
+   {
+      return const_iterator(m_block);
+   }
+
+   const_iterator cend()
    {
-      size_t dataSize = std::distance(first, last);
+      return const_iterator::end(m_block);
+   }
+
+   // The bytes of the record block by block, empty blocks left out.
+   std::vector<Segment<uint8_t> > segments()
+   {
+      std::vector<Segment<uint8_t> > segments;
+      Block<BlockSize> block = m_block;
+      while (true) {
+         if (recordDataSize(block) > 0) {
+            // TODO: numeric_cast
+            segments.push_back(Segment<uint8_t>{recordData(block), static_cast<size_t>(recordDataSize(block))});
+         }
+         if (!hasNextBlockId(block)) break;
+         block = m_block.storage().at(nextBlockId(block));
+      }
+      return segments;
+   }
+
+   std::vector<Segment<const uint8_t> > csegments()
+   {
+      std::vector<Segment<uint8_t> > segments = this->segments();
+      return std::vector<Segment<const uint8_t> >(segments.begin(), segments.end());
+   }
+
+   // Replaces the data with n copies of value. The blocks are filled front
+   // to back, blocks are added at the end or freed from it as needed.
+   void assign(size_t n, uint8_t value)
+   {
+      resize(n);
+      for (const Segment<uint8_t>& segment : segments()) {
+         std::memset(segment.data, value, segment.size);
+      }
+   }
 
+   // Integers go to assign(n, value), like for std::vector.
+   template <class InputIterator, typename = typename std::enable_if<!std::is_integral<InputIterator>::value>::type>
+   void assign(InputIterator first, InputIterator last)
+   {
+      assign(first, last, typename std::iterator_traits<InputIterator>::iterator_category());
    }
+
 private:
 #pragma pack(push, 8)
    struct RecordFormat
@@ -551,9 +1608,72 @@ private:
 
    Block<BlockSize> getLastBlock()
    {
+      return lastBlock(m_block);
+   }
+
+   // Input iterators can only be read once, so they are read into a buffer
+   // first to learn the size.
+   template <class InputIterator>
+   void assign(InputIterator first, InputIterator last, std::input_iterator_tag)
+   {
+      std::vector<uint8_t> data(first, last);
+      assign(data.begin(), data.end(), std::forward_iterator_tag());
+   }
+
+   template <class ForwardIterator>
+   void assign(ForwardIterator first, ForwardIterator last, std::forward_iterator_tag)
+   {
+      // TODO: numeric_cast
+      resize(static_cast<size_t>(std::distance(first, last)));
+      for (const Segment<uint8_t>& segment : segments()) {
+         std::copy_n(first, segment.size, segment.data);
+         std::advance(first, segment.size);
+      }
+   }
+
+   // Sets the sizes of the blocks so they hold n bytes, every block but the
+   // last one full. The content is left as it is. New blocks are tagged as
+   // continuations, so compact() can move them with relink().
+   void resize(uint64_t n)
+   {
+      m_block.beginWrite();
       Block<BlockSize> block = m_block;
+      while (true) {
+         const uint64_t blockDataSize = std::min(n, recordCapacity(block));
+         getRecordFormat(block)->size = blockDataSize;
+         n -= blockDataSize;
+         if (n == 0) break;
+
+         if (!hasNextBlockId(block)) {
+            Block<BlockSize> next = m_block.storage().create();
+            initializeRecordFormat(next);
+            next.setTag(BlockTag::RecordContinuation);
+            setPrevBlockId(next, block.id());
+            setNextBlockId(block, next.id());
+         }
+         block = m_block.storage().at(nextBlockId(block));
+      }
+
+      // Frees the blocks no longer needed. The record format has no free
+      // flag, a freed block is left empty and unlinked instead, so a reader
+      // still holding on to it ends the record there.
+      bool hasNext = hasNextBlockId(block);
+      uint64_t blockId = nextBlockId(block);
+      clearNextBlockId(block);
+      while (hasNext) {
+         Block<BlockSize> next = m_block.storage().at(blockId);
+         hasNext = hasNextBlockId(next);
+         blockId = nextBlockId(next);
+         initializeRecordFormat(next);
+         m_block.storage().free(next);
+      }
+      m_block.endWrite();
+   }
+
+   static Block<BlockSize> lastBlock(Block<BlockSize> block)
+   {
       while (hasNextBlockId(block)) {
-          block = m_block.storage().at(nextBlockId(block));
+          block = block.storage().at(nextBlockId(block));
       }
 
       return block;
@@ -671,56 +1791,543 @@ private:
 
 };
 
+// Persistent bitmap of the free blocks of a BlockStorage, one bit per block id.
+//
+// The bitmap is kept in ordinary blocks of the storage chained together, each
+// one covering bitsPerBitmapBlock() consecutive block ids. Every bitmap block
+// also keeps the number of free blocks it covers and a summary word with one
+// bit per bitmap word that has a free block, so finding a free block only
+// looks at the summary and at one word. A hint in the storage header points at
+// the bitmap block the last free block came from.
+//
+// Bitmap blocks are created lazily, only when a block they cover is freed.
+// Ids that are not covered by any bitmap block are in use.
 template <size_t BlockSize>
-class BlockStorage
+class FreeSpaceMap
 {
 public:
-   const size_t block_size;
+   static const uint64_t kNoBlock = UINT64_MAX;
 
-   explicit BlockStorage(std::unique_ptr<ISharedMemory> memory)
-      : block_size(BlockSize),
-        m_memory(std::move(memory))
+   explicit FreeSpaceMap(BlockStorage<BlockSize>* storage)
+      : m_storage(storage),
+        m_bitmapBlockIds(),
+        m_version(0),
+        m_shortestMissingRun(UINT64_MAX)
+   {}
+
+   static uint64_t bitsPerBitmapBlock()
    {
-      {
-         std::lock_guard<BlockStorage<BlockSize> > lock(*this);
+      return numBitmapWords() * 64;
+   }
+
+   bool isFree(uint64_t blockId)
+   {
+      refresh();
+
+      uint64_t bitmapIndex = blockId / bitsPerBitmapBlock();
+      if (bitmapIndex >= m_bitmapBlockIds.size()) return false;
+
+      uint64_t bit = blockId % bitsPerBitmapBlock();
+      return (bitmap(bitmapIndex)[bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
+   }
+
+   void markFree(uint64_t blockId)
+   {
+      ensureCoverage(blockId);
+
+      uint64_t bitmapIndex = blockId / bitsPerBitmapBlock();
+      uint64_t bit = blockId % bitsPerBitmapBlock();
+      uint64_t word = bit / 64;
+
+      BitmapFormat* format = getFormat(bitmapIndex);
+      assert((bitmap(format)[word] & (uint64_t(1) << (bit % 64))) == 0);
+      bitmap(format)[word] |= uint64_t(1) << (bit % 64);
+      format->words[word / 64] |= uint64_t(1) << (word % 64);
+      format->numFree += 1;
+      m_shortestMissingRun = UINT64_MAX;
+
+      if (bitmapIndex < m_storage->header()->freeSpaceMapHint) {
+         m_storage->header()->freeSpaceMapHint = bitmapIndex;
+      }
+   }
+
+   // Takes a free block out of the map and returns its id, or kNoBlock when
+   // there is none.
+   uint64_t allocate()
+   {
+      refresh();
+
+      const uint64_t numBitmapBlocks = m_bitmapBlockIds.size();
+      const uint64_t hint = m_storage->header()->freeSpaceMapHint;
+      for (uint64_t i = 0; i < numBitmapBlocks; ++i) {
+         uint64_t bitmapIndex = (hint + i) % numBitmapBlocks;
+         BitmapFormat* format = getFormat(bitmapIndex);
+         if (format->numFree == 0) continue;
+
+         for (uint64_t summaryWord = 0; summaryWord < numSummaryWords(); ++summaryWord) {
+            uint64_t summary = format->words[summaryWord];
+            if (summary == 0) continue;
+
+            uint64_t word = summaryWord * 64 + countTrailingZeros(summary);
+            uint64_t bit = countTrailingZeros(bitmap(format)[word]);
+            clearBit(format, word, bit);
+
+            m_storage->header()->freeSpaceMapHint = bitmapIndex;
+            return bitmapIndex * bitsPerBitmapBlock() + word * 64 + bit;
+         }
+      }
+
+      return kNoBlock;
+   }
+
+   // Returns the first id of count contiguous free blocks starting at a
+   // multiple of alignment, or kNoBlock when there is no such run. The blocks
+   // stay in the map. A run that was not found is not looked for again until
+   // this process frees a block, so adds that keep missing do not scan the
+   // whole bitmap every time. Runs freed by other processes are only found
+   // after that.
+   uint64_t findRun(uint64_t count, uint64_t alignment = 1)
+   {
+      refresh();
+      if (count == 0) return kNoBlock;
+      if (alignment == 1 && count >= m_shortestMissingRun) return kNoBlock;
+
+      const uint64_t runId = scanForRun(count, alignment);
+      if (runId == kNoBlock && alignment == 1) {
+         m_shortestMissingRun = count;
+      }
+      return runId;
+   }
+
+   // Takes count blocks starting at firstBlockId out of the map, all of them
+   // have to be free.
+   void allocateRun(uint64_t firstBlockId, uint64_t count)
+   {
+      refresh();
+
+      for (uint64_t blockId = firstBlockId; blockId < firstBlockId + count; ++blockId) {
+         uint64_t bitmapIndex = blockId / bitsPerBitmapBlock();
+         uint64_t bit = blockId % bitsPerBitmapBlock();
+         clearBit(getFormat(bitmapIndex), bit / 64, bit % 64);
+      }
+   }
+
+   std::vector<uint64_t> freeBlockIds()
+   {
+      refresh();
+
+      std::vector<uint64_t> blockIds;
+      for (uint64_t bitmapIndex = 0; bitmapIndex < m_bitmapBlockIds.size(); ++bitmapIndex) {
+         BitmapFormat* format = getFormat(bitmapIndex);
+         for (uint64_t word = 0; word < numBitmapWords() && format->numFree > 0; ++word) {
+            uint64_t bits = bitmap(format)[word];
+            while (bits != 0) {
+               uint64_t bit = countTrailingZeros(bits);
+               blockIds.push_back(bitmapIndex * bitsPerBitmapBlock() + word * 64 + bit);
+               bits &= bits - 1;
+            }
+         }
+      }
+      return blockIds;
+   }
+
+   // Creates the bitmap blocks needed to cover blockId.
+   void ensureCoverage(uint64_t blockId)
+   {
+      refresh();
+
+      const uint64_t bitmapIndex = blockId / bitsPerBitmapBlock();
+      while (m_bitmapBlockIds.size() <= bitmapIndex) {
+         // Creating the block may grow and move the memory, so no pointers into
+         // the storage are held across it.
+         Block<BlockSize> block = m_storage->create();
+         std::memset(block.data(), 0, static_cast<size_t>(block.capacity()));
+         block.setTag(BlockTag::FreeSpaceMap);
+
+         if (m_bitmapBlockIds.empty()) {
+            m_storage->header()->freeSpaceMapBlockId = block.id();
+         } else {
+            getFormat(m_bitmapBlockIds.size() - 1)->nextBlockId = block.id();
+         }
+         m_storage->header()->numFreeSpaceMapBlocks += 1;
+         m_bitmapBlockIds.push_back(block.id());
+      }
+   }
+   // Updates the chain after the bitmap block oldBlockId was moved to
+   // newBlockId.
+   void relocate(uint64_t oldBlockId, uint64_t newBlockId)
+   {
+      refresh();
+
+      for (size_t i = 0; i < m_bitmapBlockIds.size(); ++i) {
+         if (m_bitmapBlockIds[i] != oldBlockId) continue;
+
+         if (i == 0) {
+            m_storage->header()->freeSpaceMapBlockId = newBlockId;
+         } else {
+            getFormat(i - 1)->nextBlockId = newBlockId;
+         }
+         m_bitmapBlockIds[i] = newBlockId;
+         // Tells the maps of other processes that their chain is stale.
+         m_storage->header()->freeSpaceMapVersion += 1;
+         m_version = m_storage->header()->freeSpaceMapVersion;
+         return;
+      }
+      assert(false);
+   }
+
+   // Marks every block as used, the bitmap blocks themselves are kept.
+   void clear()
+   {
+      refresh();
+
+      for (uint64_t bitmapIndex = 0; bitmapIndex < m_bitmapBlockIds.size(); ++bitmapIndex) {
+         BitmapFormat* format = getFormat(bitmapIndex);
+         std::memset(format->words, 0, static_cast<size_t>((numSummaryWords() + numBitmapWords()) * sizeof(uint64_t)));
+         format->numFree = 0;
+      }
+      m_storage->header()->freeSpaceMapHint = 0;
+   }
+
+private:
+#pragma pack(push, 8)
+   struct BitmapFormat
+   {
+      uint64_t nextBlockId; // 8 bytes
+      uint64_t numFree;     // 8 bytes
+      uint64_t words[1];    // summary words followed by the bitmap words
+   };
+#pragma pack(pop)
+
+   BlockStorage<BlockSize>* m_storage;
+   // Ids of the bitmap blocks in chain order. Only a cache of the chain in the
+   // storage, it is caught up whenever the chain got longer and read again
+   // when a bitmap block was moved.
+   std::vector<uint64_t> m_bitmapBlockIds;
+   uint64_t m_version;
+   // Shortest run findRun() did not find since this process last freed a
+   // block, UINT64_MAX when none.
+   uint64_t m_shortestMissingRun;
+
+   static uint64_t numWords()
+   {
+      return (BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE - offsetof(BitmapFormat, words)) / sizeof(uint64_t);
+   }
+
+   static uint64_t numBitmapWords()
+   {
+      // Every 64 bitmap words need one summary word.
+      return numWords() - ((numWords() + 64) / 65);
+   }
+
+   static uint64_t numSummaryWords()
+   {
+      return (numBitmapWords() + 63) / 64;
+   }
+
+   static uint64_t countTrailingZeros(uint64_t value)
+   {
+      assert(value != 0);
+      return static_cast<uint64_t>(__builtin_ctzll(value));
+   }
+
+   static uint64_t* bitmap(BitmapFormat* format)
+   {
+      return format->words + numSummaryWords();
+   }
+
+   uint64_t* bitmap(uint64_t bitmapIndex)
+   {
+      return bitmap(getFormat(bitmapIndex));
+   }
+
+   BitmapFormat* getFormat(uint64_t bitmapIndex)
+   {
+      // TODO: numeric_cast
+      Block<BlockSize> block = m_storage->at(static_cast<size_t>(m_bitmapBlockIds[static_cast<size_t>(bitmapIndex)]));
+      return reinterpret_cast<BitmapFormat*>(block.data());
+   }
+
+   void clearBit(BitmapFormat* format, uint64_t word, uint64_t bit)
+   {
+      assert((bitmap(format)[word] & (uint64_t(1) << bit)) != 0);
+      bitmap(format)[word] &= ~(uint64_t(1) << bit);
+      if (bitmap(format)[word] == 0) {
+         format->words[word / 64] &= ~(uint64_t(1) << (word % 64));
+      }
+      format->numFree -= 1;
+   }
+
+   uint64_t scanForRun(uint64_t count, uint64_t alignment)
+   {
+      uint64_t runStart = 0;
+      uint64_t runLength = 0;
+      for (uint64_t bitmapIndex = 0; bitmapIndex < m_bitmapBlockIds.size(); ++bitmapIndex) {
+         BitmapFormat* format = getFormat(bitmapIndex);
+         if (format->numFree == 0) {
+            runLength = 0;
+            continue;
+         }
+
+         const uint64_t firstId = bitmapIndex * bitsPerBitmapBlock();
+         for (uint64_t word = 0; word < numBitmapWords(); ++word) {
+            uint64_t bits = bitmap(format)[word];
+            if (bits == 0) {
+               runLength = 0;
+               continue;
+            }
+
+            const uint64_t wordId = firstId + word * 64;
+            if (bits == ~uint64_t(0) && (runLength > 0 || wordId % alignment == 0)) {
+               if (runLength == 0) runStart = wordId;
+               runLength += 64;
+               if (runLength >= count) return runStart;
+               continue;
+            }
+
+            for (uint64_t bit = 0; bit < 64; ++bit) {
+               if ((bits & (uint64_t(1) << bit)) == 0) {
+                  runLength = 0;
+                  continue;
+               }
+               if (runLength == 0) {
+                  if ((wordId + bit) % alignment != 0) continue;
+                  runStart = wordId + bit;
+               }
+               if (++runLength >= count) return runStart;
+            }
+         }
+      }
+
+      return kNoBlock;
+   }
+
+   void refresh()
+   {
+      const uint64_t numBitmapBlocks = m_storage->header()->numFreeSpaceMapBlocks;
+      if (m_bitmapBlockIds.size() > numBitmapBlocks || m_version != m_storage->header()->freeSpaceMapVersion) {
+         m_bitmapBlockIds.clear();
+         m_version = m_storage->header()->freeSpaceMapVersion;
+      }
+
+      while (m_bitmapBlockIds.size() < numBitmapBlocks) {
+         if (m_bitmapBlockIds.empty()) {
+            m_bitmapBlockIds.push_back(m_storage->header()->freeSpaceMapBlockId);
+         } else {
+            m_bitmapBlockIds.push_back(getFormat(m_bitmapBlockIds.size() - 1)->nextBlockId);
+         }
+      }
+   }
+};
+
+// How blocks are laid out in the backing memory.
+//
+// Packed puts the blocks right after the storage header, BlockSize bytes
+// apart. Aligned pads the header to its own page and places blocks a power of
+// two apart, so with a power of two BlockSize of at least the page size every
+// block starts on a page boundary and can be read or written with O_DIRECT.
+enum class BlockLayout
+{
+   Packed,
+   Aligned
+};
+
+// How free blocks are tracked.
+//
+// FreeSpaceMap keeps a bitmap of the free blocks, hands out the lowest free
+// ids first and supports extents, spans and compaction. All of it expects the
+// storage lock to be held.
+//
+// LockFree keeps the free blocks on a Treiber stack and fresh blocks come from
+// a bump pointer, both updated with atomic operations in the shared header.
+// create() and free() then neither need nor take the lock, also across
+// processes. The stack head carries a tag that changes with every push and
+// pop, so a block popped and pushed again in between does not fool a pop
+// (ABA). Blocks are addressed without the lock, so the storage should sit on
+// an address stable backend like ReservedMemory, and the capacity has to be
+// reserved up front: create() throws std::length_error instead of growing
+// when it is used up. compact(), rebuildFreeSpaceMap() and released pages are
+// not supported.
+//
+// Shared between processes, e.g. on PosixSharedMemory, the capacity is
+// reserved once, by the process that creates the storage, before any other
+// process attaches. A process maps the memory when it attaches and only
+// remaps it under the lock, which the lock-free operations never take, so
+// growing it later would leave the others addressing blocks they have not
+// mapped. reserve() therefore throws std::logic_error once the capacity is
+// set, and the lock-free operations of a process that attached before the
+// reservation throw std::logic_error instead of touching unmapped blocks.
+enum class BlockAllocation
+{
+   FreeSpaceMap,
+   LockFree
+};
+
+// Page size of the BufferPool a pooled BlockStorage reads its blocks through,
+// the smallest power of two that holds a block.
+constexpr size_t pooledPageSize(size_t blockSize, size_t pageSize = 1)
+{
+   return pageSize >= blockSize ? pageSize : pooledPageSize(blockSize, pageSize * 2);
+}
+
+template <size_t BlockSize>
+class BlockStorage
+{
+public:
+   // Longest span createSpan() hands out, in blocks.
+   static const size_t kMaxSpanLength = 256;
+   // Returned by createRun() when the blocks should come from scattered free
+   // blocks instead.
+   static const uint64_t kNoRun = UINT64_MAX;
+   // Every block of a pooled storage lies in a page of its own.
+   static const size_t kPageSize = pooledPageSize(BlockSize);
+
+   const size_t block_size;
+
+   // The layout and allocation are only used when the storage is created, an
+   // existing storage keeps the ones it was created with.
+   explicit BlockStorage(
+      std::unique_ptr<ISharedMemory> memory,
+      BlockLayout layout = BlockLayout::Packed,
+      BlockAllocation allocation = BlockAllocation::FreeSpaceMap)
+      : block_size(BlockSize),
+        m_memory(std::move(memory)),
+        m_pool(),
+        m_headerPage(),
+        m_firstBlockOffset(0),
+        m_blockStride(0),
+        m_allocation(BlockAllocation::FreeSpaceMap),
+        m_freeSpaceMap(this),
+        m_numCachedBlocks(0),
+        m_releaseFreedPages(false),
+        m_epochs(nullptr),
+        m_retiredMutex(),
+        m_retiredBlocks()
+   {
+      {
+         std::lock_guard<BlockStorage<BlockSize> > lock(*this);
 
          // If shared memory has not been initialized by any other process, make sure it has enough space
-         // to store the size of the table.
-         if (m_memory->size() < sizeof(Header))
+         // to store the size of the table. Memory that holds anything at all
+         // is never initialized again, it may be a storage of an older format
+         // with a smaller header.
+         if (m_memory->size() == 0)
          {
-            m_memory->realloc(sizeof(Header));
-            std::memset(m_memory->get(), 0, sizeof(Header));
+            uint64_t firstBlockOffset = sizeof(Header);
+            uint64_t blockStride = BlockSize;
+            if (layout == BlockLayout::Aligned) {
+               firstBlockOffset = roundUpToPowerOfTwo(std::max<uint64_t>(sizeof(Header), static_cast<uint64_t>(::sysconf(_SC_PAGESIZE))));
+               blockStride = roundUpToPowerOfTwo(BlockSize);
+            }
+
+            // TODO: numeric_cast
+            m_memory->realloc(static_cast<size_t>(firstBlockOffset));
+            std::memset(m_memory->get(), 0, static_cast<size_t>(firstBlockOffset));
 
-            Header* header = this->header();
-            header->magicNumber = kMagicNumber;
-            header->blockSize = BlockSize;
+            initializeHeader(firstBlockOffset, blockStride, allocation);
          } else {
-            Header* header = this->header();
-            if (header->magicNumber != kMagicNumber) {
-               // TODO: throw exception
+            if (m_memory->size() < sizeof(Header)) {
+               throw std::runtime_error("Shared memory is too small for a BlockStorage header");
             }
 
-            if (header->blockSize != BlockSize) {
-               // TODO: throw exception
+            checkHeader();
+         }
+
+         loadHeader();
+      }
+   }
+
+   // Keeps the blocks in the file of the pool and reads and writes them
+   // through it, so the storage can grow far beyond the memory of the pool.
+   // The file uses the aligned layout with one block per page.
+   //
+   // A thread that holds the lock, exclusive or shared, keeps every page it
+   // touched pinned until it unlocks. So blocks are only accessible under the
+   // lock, and the pool needs a frame for every block the largest single
+   // operation touches. Pages that were only read through const blocks are
+   // not written back. The lock only works within the process. Spans, the
+   // LockFree allocation, released pages and optimistic readers without the
+   // lock are not supported, and compact() keeps the file at its size.
+   explicit BlockStorage(std::unique_ptr<BufferPool<kPageSize> > pool)
+      : block_size(BlockSize),
+        m_memory(new FakeSharedMemory(0)),
+        m_pool(std::move(pool)),
+        m_headerPage(),
+        m_firstBlockOffset(0),
+        m_blockStride(0),
+        m_allocation(BlockAllocation::FreeSpaceMap),
+        m_freeSpaceMap(this),
+        m_numCachedBlocks(0),
+        m_releaseFreedPages(false),
+        m_epochs(nullptr),
+        m_retiredMutex(),
+        m_retiredBlocks()
+   {
+      static_assert(sizeof(Header) <= kPageSize, "The BlockStorage header does not fit into a page");
+
+      // The header stays pinned, it is written back when the pool flushes.
+      m_headerPage = m_pool->fetch(0);
+      m_headerPage.markDirty();
+      {
+         std::lock_guard<BlockStorage<BlockSize> > lock(*this);
+
+         if (m_pool->numPages() == 0)
+         {
+            const uint64_t alignedOffset = roundUpToPowerOfTwo(std::max<uint64_t>(sizeof(Header), static_cast<uint64_t>(::sysconf(_SC_PAGESIZE))));
+            initializeHeader(std::max<uint64_t>(alignedOffset, kPageSize), kPageSize, BlockAllocation::FreeSpaceMap);
+         } else {
+            checkHeader();
+
+            if (header()->blockStride != kPageSize ||
+                header()->firstBlockOffset % kPageSize != 0 ||
+                static_cast<BlockAllocation>(header()->allocation) != BlockAllocation::FreeSpaceMap) {
+               throw std::runtime_error("BlockStorage does not fit into the pages of a BufferPool");
             }
          }
+
+         loadHeader();
+      }
+   }
+
+   // Blocks still retired are freed for good.
+   ~BlockStorage()
+   {
+      if (!m_retiredBlocks.empty()) {
+         std::lock_guard<BlockStorage<BlockSize> > lock(*this);
+         setEpochManager(nullptr);
       }
    }
 
    void lock()
    {
       m_memory->lock();
+      openPinScope();
    }
 
    void unlock()
    {
+      closePinScope();
       m_memory->unlock();
    }
 
+   void lock_shared()
+   {
+      m_memory->lock_shared();
+      openPinScope();
+   }
+
+   void unlock_shared()
+   {
+      closePinScope();
+      m_memory->unlock_shared();
+   }
+
+   // Number of blocks in use. Blocks held by a BlockCache of this process
+   // are counted as free.
    size_t size()
    {
       // TODO: numeric_cast
-      return static_cast<size_t>(static_cast<Header*>(m_memory->get())->size);
+      return static_cast<size_t>(loadCounter(header()->size) - m_numCachedBlocks.load());
    }
 
    Block<BlockSize> at(size_t index)
@@ -734,22 +2341,288 @@ public:
 
    Block<BlockSize> create()
    {
+      if (m_allocation == BlockAllocation::LockFree) {
+         checkCapacityMapped();
+         uint64_t blockId = popFreeBlock();
+         if (blockId == kNoFreeBlock) {
+            blockId = bumpFreshBlocks(1, 1);
+         }
+         // TODO: numeric_cast
+         size_t index = static_cast<size_t>(blockId);
+         Block<BlockSize>::createBlock(blockId, BlockSize, getBlockAddress(index));
+         __atomic_fetch_add(&header()->size, 1, __ATOMIC_RELAXED);
+         return Block<BlockSize>(this, index);
+      }
+
       if (header()->numFreeBlocks > 0) {
-         VectorView<uint64_t, BlockSize> spaceTracker = getSpaceTrackingVector();
+         uint64_t freeBlockId = m_freeSpaceMap.allocate();
+         assert(freeBlockId != FreeSpaceMap<BlockSize>::kNoBlock);
 
          header()->size += 1;
          header()->numFreeBlocks -= 1;
-         uint64_t freeBlock = spaceTracker.pop_back();
-         return at(freeBlock);
+         // TODO: numeric_cast
+         size_t index = static_cast<size_t>(freeBlockId);
+         Block<BlockSize>::createBlock(freeBlockId, BlockSize, getBlockAddress(index));
+         return Block<BlockSize>(this, index);
       } else {
-         m_memory->realloc(m_memory->size() + BlockSize);
-         header()->size += 1;
+         grow(numBlocks() + 1);
+         return createFresh();
+      }
+   }
+
+   // Creates count blocks at once. Free blocks are reused first and the
+   // backing memory is grown at most once for the remaining ones. Like
+   // create() this expects the caller to hold the storage lock for the whole
+   // call.
+   std::vector<Block<BlockSize> > createN(size_t count)
+   {
+      std::vector<Block<BlockSize> > blocks;
+      blocks.reserve(count);
+
+      if (m_allocation == BlockAllocation::LockFree) {
+         for (size_t i = 0; i < count; ++i) {
+            blocks.push_back(create());
+         }
+         return blocks;
+      }
+
+      while (count > 0 && header()->numFreeBlocks > 0) {
+         blocks.push_back(create());
+         --count;
+      }
+
+      grow(numBlocks() + count);
+      for (size_t i = 0; i < count; ++i) {
+         blocks.push_back(createFresh());
+      }
+
+      return blocks;
+   }
+
+   // Creates count blocks, with consecutive ids whenever the free space
+   // allows, so they also lie next to each other in memory. See createRun()
+   // for where they come from; when it finds no run the free blocks are used
+   // wherever they are, like createN() does. Expects the caller to hold the
+   // storage lock.
+   std::vector<Block<BlockSize> > createExtent(size_t count)
+   {
+      std::vector<Block<BlockSize> > blocks;
+      if (count == 0) return blocks;
+
+      const uint64_t firstBlockId = createRun(count);
+      if (firstBlockId == kNoRun) return createN(count);
+
+      blocks.reserve(count);
+      for (size_t i = 0; i < count; ++i) {
+         // TODO: numeric_cast
+         blocks.push_back(Block<BlockSize>(this, static_cast<size_t>(firstBlockId) + i));
+      }
+      return blocks;
+   }
+
+   // Creates count blocks with consecutive ids and returns the id of the
+   // first one, for callers that do not want the list of blocks allocated.
+   // The lowest run of free blocks that is long enough is used. Without one
+   // the storage grows at its end, on top of the free blocks already there,
+   // but only when there are no other free blocks: then nothing is created
+   // and kNoRun is returned, so the caller can reuse the scattered free
+   // blocks with create() or createN() instead. count has to be at least 1.
+   uint64_t createRun(size_t count)
+   {
+      assert(count > 0);
+      if (m_allocation == BlockAllocation::LockFree) {
+         checkCapacityMapped();
+         // Extents always come from the bump pointer.
+         const uint64_t firstBlockId = bumpFreshBlocks(count, 1);
+         for (size_t i = 0; i < count; ++i) {
+            // TODO: numeric_cast
+            size_t index = static_cast<size_t>(firstBlockId) + i;
+            Block<BlockSize>::createBlock(index, BlockSize, getBlockAddress(index));
+         }
+         __atomic_fetch_add(&header()->size, count, __ATOMIC_RELAXED);
+         return firstBlockId;
+      }
+
+      size_t numReused = 0;
+      uint64_t firstBlockId = header()->numFreeBlocks >= count
+         ? m_freeSpaceMap.findRun(count)
+         : FreeSpaceMap<BlockSize>::kNoBlock;
+      if (firstBlockId != FreeSpaceMap<BlockSize>::kNoBlock) {
+         numReused = count;
+      } else {
+         firstBlockId = numBlocks();
+         while (numReused < count && firstBlockId > 0 && m_freeSpaceMap.isFree(firstBlockId - 1)) {
+            --firstBlockId;
+            ++numReused;
+         }
+         if (numReused < header()->numFreeBlocks) return kNoRun;
+      }
+
+      m_freeSpaceMap.allocateRun(firstBlockId, numReused);
+      header()->size += numReused;
+      header()->numFreeBlocks -= numReused;
+      for (size_t i = 0; i < numReused; ++i) {
+         // TODO: numeric_cast
+         size_t index = static_cast<size_t>(firstBlockId) + i;
+         Block<BlockSize>::createBlock(index, BlockSize, getBlockAddress(index));
+      }
+
+      grow(numBlocks() + (count - numReused));
+      for (size_t i = numReused; i < count; ++i) {
+         createFresh();
+      }
+
+      return firstBlockId;
+   }
+
+   // Creates a span, one block whose data covers numBlocks consecutive blocks.
+   // numBlocks is rounded up to a power of two and a span of n blocks starts
+   // at a multiple of n, which keeps finding the first block of the span any
+   // block lies in cheap. blockSize() and capacity() of the returned block
+   // cover the whole span, free() gives all blocks of it back. Expects the
+   // caller to hold the storage lock.
+   Block<BlockSize> createSpan(size_t numBlocks)
+   {
+      const size_t length = static_cast<size_t>(roundUpToPowerOfTwo(std::max<size_t>(1, numBlocks)));
+      if (length > kMaxSpanLength) {
+         throw std::length_error("Span is longer than the longest supported span");
+      }
+      if (length == 1) return create();
+      if (m_pool) {
+         throw std::logic_error("Spans do not fit into the pages of a pooled BlockStorage");
+      }
+
+      if (m_allocation == BlockAllocation::LockFree) {
+         checkCapacityMapped();
+         const uint64_t firstBlockId = bumpFreshBlocks(length, length);
+         __atomic_fetch_add(&header()->size, length, __ATOMIC_RELAXED);
+         // TODO: numeric_cast
+         size_t index = static_cast<size_t>(firstBlockId);
+         Block<BlockSize>::createBlock(firstBlockId, spanBlockSize(length), getBlockAddress(index));
+         return Block<BlockSize>(this, index);
+      }
+
+      uint64_t firstBlockId = header()->numFreeBlocks >= length
+         ? m_freeSpaceMap.findRun(length, length)
+         : FreeSpaceMap<BlockSize>::kNoBlock;
+      if (firstBlockId != FreeSpaceMap<BlockSize>::kNoBlock) {
+         m_freeSpaceMap.allocateRun(firstBlockId, length);
+         header()->numFreeBlocks -= length;
+         header()->size += length;
+      } else {
+         // Placing the span at the end, on top of the free blocks already
+         // there. Blocks skipped to align the span stay free.
+         const size_t oldNumBlocks = this->numBlocks();
+         size_t tailBegin = oldNumBlocks;
+         while (tailBegin > 0 && m_freeSpaceMap.isFree(tailBegin - 1)) {
+            --tailBegin;
+         }
+         const size_t first = ((tailBegin + length - 1) / length) * length;
+         const size_t numReused = first < oldNumBlocks ? oldNumBlocks - first : 0;
+
+         m_freeSpaceMap.allocateRun(first, numReused);
+         header()->numFreeBlocks -= numReused;
+         header()->size += numReused;
+
+         grow(first + length);
+         std::vector<uint64_t> paddingIds;
+         while (this->numBlocks() < first + length) {
+            Block<BlockSize> block = createFresh();
+            if (block.id() < first) {
+               paddingIds.push_back(block.id());
+            }
+         }
+         for (uint64_t paddingId : paddingIds) {
+            this->free(paddingId);
+         }
+         firstBlockId = first;
+      }
+
+      // TODO: numeric_cast
+      size_t index = static_cast<size_t>(firstBlockId);
+      Block<BlockSize>::createBlock(firstBlockId, spanBlockSize(length), getBlockAddress(index));
+      return Block<BlockSize>(this, index);
+   }
+
+   // Number of blocks the block covers, 1 unless it is a span.
+   size_t spanLength(const Block<BlockSize>& block) const
+   {
+      // TODO: numeric_cast
+      return static_cast<size_t>((block.blockSize() - BlockSize) / m_blockStride) + 1;
+   }
+
+   // Makes sure the backing memory can hold at least numBlocks blocks without
+   // being reallocated, the same way std::vector::reserve does.
+   void reserve(size_t numBlocks)
+   {
+      if (numBlocks <= capacity()) return;
+      if (m_allocation == BlockAllocation::LockFree && capacity() > 0) {
+         throw std::logic_error("The capacity of a LockFree BlockStorage can only be reserved once");
+      }
+
+      // The file of a pooled storage grows as its pages are written back.
+      if (!m_pool) {
+         m_memory->realloc(m_firstBlockOffset + (m_blockStride * numBlocks));
+      }
+      __atomic_store_n(&header()->capacity, numBlocks, __ATOMIC_RELEASE);
+   }
+
+   BlockAllocation allocation() const
+   {
+      return m_allocation;
+   }
+
+   BlockLayout layout() const
+   {
+      return m_firstBlockOffset == sizeof(Header) && m_blockStride == BlockSize ? BlockLayout::Packed : BlockLayout::Aligned;
+   }
 
-         size_t zeroBasedIndex = size() - 1;
-         uint8_t* blockAddress = getFirstBlockAddress() + (BlockSize * zeroBasedIndex);
-         Block<BlockSize>::createBlock(zeroBasedIndex, BlockSize, blockAddress);
-         return Block<BlockSize>(this, zeroBasedIndex);
+   // Offset of a block from the start of the backing memory. With the aligned
+   // layout this is also the file offset to use for direct I/O on the block.
+   size_t blockOffset(size_t index) const
+   {
+      return m_firstBlockOffset + (m_blockStride * index);
+   }
+
+   // Reads the blocks of a pooled storage that are not in its pool yet as one
+   // batch with all reads in flight at once, so a walk over a chain does not
+   // wait for one read after the other. Only a hint: blocks that do not fit
+   // into the pool are skipped, and a storage in memory has nothing to read.
+   // Expects the lock.
+   void prefetch(const std::vector<uint64_t>& blockIds)
+   {
+      if (!m_pool) return;
+
+      const size_t numBlocks = this->numBlocks();
+      std::vector<uint64_t> pageIds;
+      pageIds.reserve(blockIds.size());
+      for (uint64_t blockId : blockIds) {
+         if (blockId >= numBlocks) continue;
+
+         // TODO: numeric_cast
+         pageIds.push_back(blockOffset(static_cast<size_t>(blockId)) / kPageSize);
       }
+      m_pool->prefetch(pageIds);
+   }
+
+   // The pool a pooled storage reads its blocks through, nullptr otherwise.
+   // Flushing it needs the lock, so no writer changes a page meanwhile.
+   BufferPool<kPageSize>* bufferPool()
+   {
+      return m_pool.get();
+   }
+
+   // Distance between two consecutive blocks in the backing memory.
+   size_t blockStride() const
+   {
+      return m_blockStride;
+   }
+
+   // Number of blocks the backing memory has room for.
+   size_t capacity()
+   {
+      // TODO: numeric_cast
+      return static_cast<size_t>(loadCounter(header()->capacity));
    }
 
    void free(uint64_t blockId)
@@ -757,73 +2630,688 @@ public:
       this->free(at(blockId));
    }
 
+   // Frees the block, or every block of it when it is a span. With an
+   // EpochManager the block is only retired and freed by a later
+   // reclaimRetiredBlocks(), once no pinned reader can reach it anymore.
    void free(Block<BlockSize> block)
    {
-      // Something fishy if not
-      assert(size() > 0);
+      if (m_epochs) {
+         retire(block.id());
+         return;
+      }
+      freeNow(block);
+   }
+
+   // Readers that walk blocks without the lock pin an epoch of the manager,
+   // see EpochManager. The manager has to outlive the storage or be unset
+   // again, unsetting it frees all retired blocks right away. Off by
+   // default.
+   void setEpochManager(EpochManager* epochs)
+   {
+      m_epochs = epochs;
+      if (!m_epochs) {
+         std::vector<RetiredBlock> retiredBlocks;
+         {
+            std::lock_guard<std::mutex> lock(m_retiredMutex);
+            retiredBlocks.swap(m_retiredBlocks);
+         }
+         for (const RetiredBlock& retired : retiredBlocks) {
+            // TODO: numeric_cast
+            freeNow(Block<BlockSize>(this, static_cast<size_t>(retired.blockId)));
+         }
+      }
+   }
+
+   EpochManager* epochManager() const
+   {
+      return m_epochs;
+   }
+
+   // Frees the retired blocks no pinned reader can reach anymore and returns
+   // how many. free() calls it once kReclaimBatchSize blocks are retired, a
+   // background thread may call it more often. Expects the caller to hold the
+   // storage lock unless the allocation is LockFree.
+   size_t reclaimRetiredBlocks()
+   {
+      if (!m_epochs) return 0;
+
+      m_epochs->tryAdvance();
+      const uint64_t safeEpoch = m_epochs->safeEpoch();
+
+      std::vector<RetiredBlock> reclaimable;
+      {
+         std::lock_guard<std::mutex> lock(m_retiredMutex);
+         // Retired in order, so the reclaimable ones come first.
+         auto end = std::find_if(m_retiredBlocks.begin(), m_retiredBlocks.end(), [safeEpoch](const RetiredBlock& retired) {
+            return retired.epoch >= safeEpoch;
+         });
+         reclaimable.assign(m_retiredBlocks.begin(), end);
+         m_retiredBlocks.erase(m_retiredBlocks.begin(), end);
+      }
+
+      for (const RetiredBlock& retired : reclaimable) {
+         // TODO: numeric_cast
+         freeNow(Block<BlockSize>(this, static_cast<size_t>(retired.blockId)));
+      }
+      return reclaimable.size();
+   }
+
+   // Blocks freed but not reclaimed yet, size() still counts them as used.
+   size_t numRetiredBlocks()
+   {
+      std::lock_guard<std::mutex> lock(m_retiredMutex);
+      return m_retiredBlocks.size();
+   }
 
-      // std::cout << "markAsFree(block: id=" << block.id() << ")" << std::endl;
-      VectorView<uint64_t, BlockSize> spaceTracker = getSpaceTrackingVector();
-      spaceTracker.push_back(block.id());
-      ++header()->numFreeBlocks;
-      header()->size -= 1;
+   // When enabled free() hands the pages that only hold free blocks back to
+   // the backing memory, so they stop counting against the resident set or
+   // the file size until the blocks are created again. The header of such a
+   // block reads as zeros, the free space map stays the authority on which
+   // blocks are free. Off by default, it costs a system call per released
+   // page.
+   void setReleaseFreedPages(bool releaseFreedPages)
+   {
+      // Free blocks of the LockFree allocation hold the links of the stack.
+      m_releaseFreedPages = releaseFreedPages && m_allocation == BlockAllocation::FreeSpaceMap && !m_pool;
+   }
 
-      // TODO: mark block itself as free
+   bool releaseFreedPages() const
+   {
+      return m_releaseFreedPages;
    }
 
    uint64_t numFreeBlocks()
    {
-      return header()->numFreeBlocks;
+      return loadCounter(header()->numFreeBlocks) + m_numCachedBlocks.load();
+   }
+
+   bool isFree(uint64_t blockId)
+   {
+      if (m_allocation == BlockAllocation::LockFree) {
+         // TODO: numeric_cast
+         return blockId >= numBlocks() || Block<BlockSize>(this, static_cast<size_t>(blockId)).isFree();
+      }
+      return m_freeSpaceMap.isFree(blockId);
+   }
+
+   // Ids of all free blocks in ascending order.
+   std::vector<uint64_t> freeBlockIds()
+   {
+      if (m_allocation == BlockAllocation::LockFree) {
+         std::vector<uint64_t> blockIds;
+         const size_t total = numBlocks();
+         for (size_t index = 0; index < total;) {
+            Block<BlockSize> block(this, index);
+            if (block.isFree()) {
+               blockIds.push_back(index);
+               ++index;
+            } else {
+               index += spanLength(block);
+            }
+         }
+         return blockIds;
+      }
+      return m_freeSpaceMap.freeBlockIds();
+   }
+
+   // Rebuilds the free space map from the isFree flags in the block headers,
+   // for example after a crash left the map and the blocks out of sync. Blocks
+   // whose header was never written count as free.
+   void rebuildFreeSpaceMap()
+   {
+      assert(m_allocation == BlockAllocation::FreeSpaceMap);
+
+      const size_t total = numBlocks();
+      m_freeSpaceMap.clear();
+      header()->size = total;
+      header()->numFreeBlocks = 0;
+
+      for (size_t index = 0; index < total;) {
+         Block<BlockSize> block(this, index);
+         if (!block.isFree() && block.blockSize() != 0) {
+            // The other blocks of a span hold its data, not headers.
+            index += spanLength(block);
+            continue;
+         }
+
+         m_freeSpaceMap.markFree(index);
+         block.getHeader()->isFree = 1;
+         ++header()->numFreeBlocks;
+         header()->size -= 1;
+         ++index;
+      }
+   }
+
+   // Moves up to maxMoves blocks from the end of the storage into the lowest
+   // free blocks and gives the memory of the free blocks left at the end back.
+   // Each call does a bounded amount of work, so compaction can run in small
+   // steps between other operations while holding the lock.
+   //
+   // Only tagged blocks are moved, whoever links to them is fixed up
+   // afterwards. Moving RecordContinuation blocks needs relinkRecordBlock,
+   // which is called with the block at its new id and the old id. An untagged
+   // block at the end stops compaction. Returns the number of blocks moved.
+   size_t compact(size_t maxMoves, const std::function<void(Block<BlockSize>, uint64_t)>& relinkRecordBlock = nullptr)
+   {
+      if (m_allocation == BlockAllocation::LockFree) return 0;
+
+      reclaimRetiredBlocks();
+      size_t numMoves = 0;
+      while (true) {
+         trimFreeBlocksAtEnd();
+         // A retired block may still be read where it is.
+         if (numMoves >= maxMoves || header()->numFreeBlocks == 0 || numRetiredBlocks() > 0) break;
+
+         const size_t lastIndex = numBlocks() - 1;
+         const size_t headIndex = spanHead(lastIndex);
+         Block<BlockSize> head(this, headIndex);
+         if (!isMovable(head.tag(), relinkRecordBlock)) break;
+         const size_t length = spanLength(head);
+
+         // Freeing the last block below may need another bitmap block, which
+         // should be taken from the free blocks now rather than appended.
+         m_freeSpaceMap.ensureCoverage(lastIndex);
+         if (header()->numFreeBlocks < length) break;
+
+         uint64_t targetId = length == 1
+            ? m_freeSpaceMap.allocate()
+            : m_freeSpaceMap.findRun(length, length);
+         if (targetId == FreeSpaceMap<BlockSize>::kNoBlock || targetId > headIndex) {
+            if (targetId != FreeSpaceMap<BlockSize>::kNoBlock && length == 1) {
+               m_freeSpaceMap.markFree(targetId);
+            }
+            break;
+         }
+         if (length > 1) {
+            m_freeSpaceMap.allocateRun(targetId, length);
+         }
+
+         // TODO: numeric_cast
+         size_t targetIndex = static_cast<size_t>(targetId);
+         std::memcpy(getBlockAddress(targetIndex), getBlockAddress(headIndex), static_cast<size_t>(head.blockSize()));
+
+         Block<BlockSize> target(this, targetIndex);
+         target.getHeader()->id = targetId;
+         switch (target.tag()) {
+            case BlockTag::FreeSpaceMap:
+               m_freeSpaceMap.relocate(headIndex, targetId);
+               break;
+            case BlockTag::VectorContinuation:
+               VectorView<uint8_t, BlockSize>::relink(target, headIndex);
+               break;
+            case BlockTag::VectorDirectory:
+               VectorView<uint8_t, BlockSize>::relinkDirectory(target);
+               break;
+            case BlockTag::RecordContinuation:
+               relinkRecordBlock(target, headIndex);
+               break;
+            case BlockTag::None:
+               assert(false);
+               break;
+         }
+
+         // The free blocks taken above and these balance each other, the
+         // counters stay the same.
+         for (size_t index = headIndex; index < headIndex + length; ++index) {
+            m_freeSpaceMap.markFree(index);
+            Block<BlockSize>(this, index).getHeader()->isFree = 1;
+         }
+         ++numMoves;
+      }
+
+      const size_t numBlocks = this->numBlocks();
+      if (numBlocks < capacity()) {
+         header()->capacity = numBlocks;
+         if (!m_pool) {
+            m_memory->truncate(m_firstBlockOffset + (m_blockStride * numBlocks));
+         }
+      }
+
+      return numMoves;
    }
 
 private:
    friend class Block<BlockSize>;
+   friend class FreeSpaceMap<BlockSize>;
+   friend class BlockCache<BlockSize>;
 
    static const uint64_t kMagicNumber = 12345654321;
+   // Layout of everything the storage persists: this header, the block
+   // headers, the free space map and the formats VectorView and
+   // RecordStorage keep in blocks. Bump it with every change to one of them.
+   // Storages from before the version existed hold their block size where
+   // the version is now, far beyond any version so far.
+   static const uint64_t kFormatVersion = 2;
 #pragma pack(push, 8)
    struct Header
    {
       uint64_t magicNumber;   // 8 bytes
+      uint64_t formatVersion; // 8 bytes
       uint64_t blockSize;     // 8 bytes
       uint64_t size;          // 8 bytes
       uint64_t numFreeBlocks; // 8 bytes
-      uint64_t freedBlockId;  // 8 bytes
+      uint64_t freeSpaceMapBlockId; // 8 bytes
+      uint64_t capacity;      // 8 bytes
+      uint64_t firstBlockOffset; // 8 bytes
+      uint64_t blockStride;   // 8 bytes
+      uint64_t numFreeSpaceMapBlocks; // 8 bytes
+      uint64_t freeSpaceMapHint; // 8 bytes
+      uint64_t freeSpaceMapVersion; // 8 bytes
+      uint64_t allocation;    // 8 bytes
+      uint64_t freeStackTop;  // 8 bytes, tagged id of the top free block for LockFree
+      uint64_t numFreshBlocks; // 8 bytes, bump pointer for LockFree
    };
 #pragma pack(pop)
 
+   // The top of the free stack packs the block id plus one into the low bits
+   // and a tag that changes on every push and pop into the high bits.
+   static const uint64_t kStackIdBits = 40;
+   static const uint64_t kStackIdMask = (uint64_t(1) << kStackIdBits) - 1;
+   static const uint64_t kNoFreeBlock = UINT64_MAX;
+
    std::unique_ptr<ISharedMemory> m_memory;
+   // Only set for a pooled storage, m_memory then just provides the lock.
+   std::unique_ptr<BufferPool<kPageSize> > m_pool;
+   PageHandle<kPageSize> m_headerPage;
+   // Copies of the header fields, they never change once the storage exists.
+   size_t m_firstBlockOffset;
+   size_t m_blockStride;
+   BlockAllocation m_allocation;
+   FreeSpaceMap<BlockSize> m_freeSpaceMap;
+   // Blocks taken out of the storage by the BlockCaches of this process that
+   // are not handed out yet. The header counts them as used.
+   std::atomic<uint64_t> m_numCachedBlocks;
+   bool m_releaseFreedPages;
+
+   struct RetiredBlock
+   {
+      uint64_t blockId;
+      uint64_t epoch;
+   };
+
+   static const size_t kReclaimBatchSize = 64;
+
+   EpochManager* m_epochs;
+   std::mutex m_retiredMutex;
+   std::vector<RetiredBlock> m_retiredBlocks;
+
+   void retire(uint64_t blockId)
+   {
+      size_t numRetired = 0;
+      {
+         std::lock_guard<std::mutex> lock(m_retiredMutex);
+         m_retiredBlocks.push_back(RetiredBlock{blockId, m_epochs->epoch()});
+         numRetired = m_retiredBlocks.size();
+      }
+
+      if (numRetired >= kReclaimBatchSize) {
+         reclaimRetiredBlocks();
+      }
+   }
+
+   uint8_t* getBlockAddress(size_t index)
+   {
+      if (m_pool) return pinBlock(index, true);
+
+      return static_cast<uint8_t*>(m_memory->get()) + blockOffset(index);
+   }
+
+   const uint8_t* getBlockAddress(size_t index) const
+   {
+      if (m_pool) return pinBlock(index, false);
+
+      return static_cast<const uint8_t*>(m_memory->get()) + blockOffset(index);
+   }
 
-   uint8_t* getFirstBlockAddress()
+   // A page a thread pinned in the pool while it holds the lock.
+   struct PinnedPage
    {
-      return static_cast<uint8_t*>(m_memory->get()) + sizeof(Header);
+      uint8_t* data;
+      bool dirty;
+   };
+
+   // The pages a thread pinned under the lock of a pooled storage, they are
+   // unpinned when the thread gives up its last hold of the lock.
+   struct PinScope
+   {
+      PinScope()
+         : depth(0),
+           pages()
+      {}
+
+      size_t depth;
+      std::unordered_map<uint64_t, PinnedPage> pages;
+   };
+
+   static std::unordered_map<const BlockStorage<BlockSize>*, PinScope>& pinScopes()
+   {
+      static thread_local std::unordered_map<const BlockStorage<BlockSize>*, PinScope> scopes;
+      return scopes;
+   }
+
+   void openPinScope()
+   {
+      if (!m_pool) return;
+
+      pinScopes()[this].depth += 1;
+   }
+
+   void closePinScope()
+   {
+      if (!m_pool) return;
+
+      auto scope = pinScopes().find(this);
+      assert(scope != pinScopes().end());
+      if (--scope->second.depth > 0) return;
+
+      for (const auto& page : scope->second.pages) {
+         m_pool->unpin(page.first, page.second.dirty);
+      }
+      pinScopes().erase(scope);
+   }
+
+   // Pins the page of the block for the rest of the pin scope, dirty when it
+   // is handed out for writing.
+   uint8_t* pinBlock(size_t index, bool dirty) const
+   {
+      auto scope = pinScopes().find(this);
+      if (scope == pinScopes().end()) {
+         throw std::logic_error("Blocks of a pooled BlockStorage are only accessible under its lock");
+      }
+
+      const uint64_t pageId = blockOffset(index) / kPageSize;
+      auto page = scope->second.pages.find(pageId);
+      if (page == scope->second.pages.end()) {
+         page = scope->second.pages.emplace(pageId, PinnedPage{m_pool->pin(pageId), false}).first;
+      }
+      page->second.dirty = page->second.dirty || dirty;
+      return page->second.data;
    }
 
-   const uint8_t* getFirstBlockAddress() const
+   static uint64_t roundUpToPowerOfTwo(uint64_t value)
    {
-      return static_cast<uint8_t*>(m_memory->get()) + sizeof(Header);
+      uint64_t result = 1;
+      while (result < value) {
+         result <<= 1;
+      }
+      return result;
    }
 
    Header* header()
    {
+      if (m_pool) return reinterpret_cast<Header*>(m_headerPage.data());
+
       return reinterpret_cast<Header*>(m_memory->get());
    }
 
-   VectorView<uint64_t, BlockSize> getSpaceTrackingVector()
+   void initializeHeader(uint64_t firstBlockOffset, uint64_t blockStride, BlockAllocation allocation)
    {
-      if (header()->freedBlockId == 0) {
-         Block<BlockSize> block = create();
-         VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(block);
+      Header* header = this->header();
+      header->magicNumber = kMagicNumber;
+      header->formatVersion = kFormatVersion;
+      header->blockSize = BlockSize;
+      header->firstBlockOffset = firstBlockOffset;
+      header->blockStride = blockStride;
+      header->allocation = static_cast<uint64_t>(allocation);
+   }
 
-         // std::cout << "Creating Space Tracking block: id=" << block.id() << std::endl;
-         header()->freedBlockId = block.id();
-         // std::cout << "Returning Space Tracking block: id=" << header()->freedBlockId << std::endl;
-         return block;
-      } else {
-         // std::cout << "Returning Space Tracking block: id=" << header()->freedBlockId << std::endl;
+   void checkHeader()
+   {
+      Header* header = this->header();
+      if (header->magicNumber != kMagicNumber) {
+         throw std::runtime_error("Shared memory does not contain a BlockStorage");
+      }
+
+      if (header->formatVersion != kFormatVersion) {
+         throw std::runtime_error("BlockStorage was created with a different format version");
+      }
+
+      if (header->blockSize != BlockSize) {
+         throw std::runtime_error("BlockStorage was created with a different block size");
+      }
+   }
+
+   void loadHeader()
+   {
+      // TODO: numeric_cast
+      m_firstBlockOffset = static_cast<size_t>(header()->firstBlockOffset);
+      m_blockStride = static_cast<size_t>(header()->blockStride);
+      m_allocation = static_cast<BlockAllocation>(header()->allocation);
+   }
+
+   // Number of blocks laid out in memory, both used and free.
+   size_t numBlocks()
+   {
+      if (m_allocation == BlockAllocation::LockFree) {
+         // TODO: numeric_cast
+         return static_cast<size_t>(loadCounter(header()->numFreshBlocks));
+      }
+      // TODO: numeric_cast
+      return static_cast<size_t>(header()->size + header()->numFreeBlocks);
+   }
+
+   // Header counters the LockFree allocation changes without the lock.
+   static uint64_t loadCounter(const uint64_t& counter)
+   {
+      return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+   }
+
+   // The LockFree allocation never remaps, see BlockAllocation. Taking the
+   // lock once maps a capacity reserved after this process attached.
+   void checkCapacityMapped()
+   {
+      if (m_memory->size() < blockOffset(static_cast<size_t>(loadCounter(header()->capacity)))) {
+         throw std::logic_error("The capacity of the BlockStorage was reserved after this process attached, "
+                                "lock it once before allocating");
+      }
+   }
+
+   // The link to the next free block lives in the data of a free block.
+   uint64_t* freeStackLink(uint64_t blockId)
+   {
+      // TODO: numeric_cast
+      return reinterpret_cast<uint64_t*>(getBlockAddress(static_cast<size_t>(blockId)) + Block<BlockSize>::MIN_BLOCK_SIZE);
+   }
+
+   void pushFreeBlock(uint64_t blockId)
+   {
+      // TODO: numeric_cast
+      Block<BlockSize>::createBlock(blockId, BlockSize, getBlockAddress(static_cast<size_t>(blockId)));
+      Block<BlockSize>(this, static_cast<size_t>(blockId)).getHeader()->isFree = 1;
+
+      uint64_t* top = &header()->freeStackTop;
+      uint64_t oldTop = __atomic_load_n(top, __ATOMIC_RELAXED);
+      uint64_t newTop = 0;
+      do {
+         __atomic_store_n(freeStackLink(blockId), oldTop & kStackIdMask, __ATOMIC_RELAXED);
+         newTop = ((oldTop & ~kStackIdMask) + (kStackIdMask + 1)) | (blockId + 1);
+      } while (!__atomic_compare_exchange_n(top, &oldTop, newTop, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+      __atomic_fetch_add(&header()->numFreeBlocks, 1, __ATOMIC_RELAXED);
+   }
+
+   // Returns kNoFreeBlock when the stack is empty.
+   uint64_t popFreeBlock()
+   {
+      uint64_t* top = &header()->freeStackTop;
+      uint64_t oldTop = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+      uint64_t newTop = 0;
+      do {
+         if ((oldTop & kStackIdMask) == 0) return kNoFreeBlock;
+
+         // The block may be popped by another thread in between and the link
+         // read here be stale, the tag then makes the exchange fail.
+         uint64_t next = __atomic_load_n(freeStackLink((oldTop & kStackIdMask) - 1), __ATOMIC_RELAXED);
+         newTop = ((oldTop & ~kStackIdMask) + (kStackIdMask + 1)) | (next & kStackIdMask);
+      } while (!__atomic_compare_exchange_n(top, &oldTop, newTop, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+      __atomic_fetch_sub(&header()->numFreeBlocks, 1, __ATOMIC_RELAXED);
+      return (oldTop & kStackIdMask) - 1;
+   }
+
+   // Takes count fresh blocks from the bump pointer, the first one a multiple
+   // of alignment. Blocks skipped for the alignment go onto the free stack.
+   uint64_t bumpFreshBlocks(size_t count, size_t alignment)
+   {
+      uint64_t* numFresh = &header()->numFreshBlocks;
+      uint64_t oldNumFresh = __atomic_load_n(numFresh, __ATOMIC_RELAXED);
+      uint64_t first = 0;
+      do {
+         first = ((oldNumFresh + alignment - 1) / alignment) * alignment;
+         if (first + count > loadCounter(header()->capacity)) {
+            throw std::length_error("BlockStorage is out of reserved blocks");
+         }
+      } while (!__atomic_compare_exchange_n(numFresh, &oldNumFresh, first + count, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+      for (uint64_t blockId = oldNumFresh; blockId < first; ++blockId) {
+         pushFreeBlock(blockId);
+      }
+      return first;
+   }
+
+   uint64_t spanBlockSize(size_t length) const
+   {
+      return static_cast<uint64_t>((length - 1) * m_blockStride + BlockSize);
+   }
+
+   // First block of the span the block at index lies in, index itself when it
+   // is not part of a longer span. Spans never cross a multiple of
+   // kMaxSpanLength, so the block there has a valid header and the walk from
+   // it is short.
+   size_t spanHead(size_t index)
+   {
+      size_t head = index - (index % kMaxSpanLength);
+      while (true) {
+         size_t length = m_freeSpaceMap.isFree(head) ? 1 : spanLength(Block<BlockSize>(this, head));
+         if (head + length > index) return head;
+         head += length;
+      }
+   }
+
+   static bool isMovable(BlockTag tag, const std::function<void(Block<BlockSize>, uint64_t)>& relinkRecordBlock)
+   {
+      switch (tag) {
+         case BlockTag::FreeSpaceMap:
+         case BlockTag::VectorContinuation:
+         case BlockTag::VectorDirectory:
+            return true;
+         case BlockTag::RecordContinuation:
+            return !!relinkRecordBlock;
+         case BlockTag::None:
+            break;
+      }
+      return false;
+   }
+
+   void freeNow(Block<BlockSize> block)
+   {
+      const uint64_t blockId = block.id();
+      const size_t length = spanLength(block);
+
+      // Something fishy if not
+      assert(loadCounter(header()->size) >= length);
+      assert(!block.isFree());
+
+      if (m_allocation == BlockAllocation::LockFree) {
+         checkCapacityMapped();
+         for (size_t i = 0; i < length; ++i) {
+            pushFreeBlock(blockId + i);
+         }
+         __atomic_fetch_sub(&header()->size, length, __ATOMIC_RELAXED);
+         return;
+      }
+
+      // Marking the blocks in the map first, it may have to create a bitmap
+      // block which changes the counters below.
+      for (size_t i = 0; i < length; ++i) {
          // TODO: numeric_cast
-         return at(static_cast<size_t>(header()->freedBlockId));
+         size_t index = static_cast<size_t>(blockId) + i;
+         m_freeSpaceMap.markFree(index);
+         Block<BlockSize>(this, index).getHeader()->isFree = 1;
+      }
+
+      header()->numFreeBlocks += length;
+      header()->size -= length;
+
+      if (m_releaseFreedPages) {
+         releaseFreePages(blockId, length);
+      }
+   }
+
+   // Releases the pages the blocks [blockId, blockId + count) lie on that hold
+   // nothing but free blocks. Blocks are not page aligned in general, a page
+   // is released once the last block on it is freed.
+   void releaseFreePages(uint64_t blockId, size_t count)
+   {
+      const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+      // TODO: numeric_cast
+      const size_t index = static_cast<size_t>(blockId);
+      const size_t firstPage = blockOffset(index) / pageSize;
+      const size_t lastPage = (blockOffset(index + count - 1) + BlockSize - 1) / pageSize;
+      // Blocks past the last one are not laid out yet and count as free.
+      const size_t numBlocks = this->numBlocks();
+
+      size_t releaseBegin = 0;
+      size_t releaseEnd = 0;
+      for (size_t page = firstPage; page <= lastPage; ++page) {
+         const size_t pageBegin = page * pageSize;
+         const size_t pageEnd = pageBegin + pageSize;
+         // The page with the storage header always stays.
+         if (pageBegin < m_firstBlockOffset) continue;
+
+         bool isPageFree = true;
+         const size_t firstIndex = (pageBegin - m_firstBlockOffset) / m_blockStride;
+         const size_t lastIndex = std::min((pageEnd - 1 - m_firstBlockOffset) / m_blockStride, numBlocks - 1);
+         for (size_t i = firstIndex; i <= lastIndex && isPageFree; ++i) {
+            isPageFree = m_freeSpaceMap.isFree(i);
+         }
+         if (!isPageFree) continue;
+
+         if (releaseBegin == releaseEnd) {
+            releaseBegin = pageBegin;
+         }
+         releaseEnd = pageEnd;
+      }
+
+      if (releaseBegin != releaseEnd) {
+         m_memory->release(releaseBegin, std::min(releaseEnd, m_memory->size()) - releaseBegin);
       }
    }
+
+   // Drops the free blocks at the end of the storage, they are simply not laid
+   // out anymore.
+   void trimFreeBlocksAtEnd()
+   {
+      while (header()->numFreeBlocks > 0 && m_freeSpaceMap.isFree(numBlocks() - 1)) {
+         m_freeSpaceMap.allocateRun(numBlocks() - 1, 1);
+         header()->numFreeBlocks -= 1;
+      }
+   }
+
+   // Grows the capacity geometrically so that creating N blocks one at a time
+   // only reallocates the backing memory O(log N) times.
+   void grow(size_t minNumBlocks)
+   {
+      if (minNumBlocks <= capacity()) return;
+
+      reserve(std::max(minNumBlocks, capacity() * 2));
+   }
+
+   Block<BlockSize> createFresh()
+   {
+      assert(numBlocks() < capacity());
+
+      size_t zeroBasedIndex = numBlocks();
+      header()->size += 1;
+
+      uint8_t* blockAddress = getBlockAddress(zeroBasedIndex);
+      Block<BlockSize>::createBlock(zeroBasedIndex, BlockSize, blockAddress);
+      return Block<BlockSize>(this, zeroBasedIndex);
+   }
 };
 
+template <size_t BlockSize>
+const size_t BlockStorage<BlockSize>::kMaxSpanLength;
 
+template <size_t BlockSize>
+const size_t BlockStorage<BlockSize>::kPageSize;
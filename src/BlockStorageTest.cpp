@@ -1,6 +1,13 @@
 #include <catch.hpp>
 
 #include "BlockStorage.h"
+#include "ReservedMemory.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <unistd.h>
 
 TEST_CASE("Create/Delete BlockStorage", "[BlockStorage]") {
     std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
@@ -10,6 +17,19 @@ TEST_CASE("Create/Delete BlockStorage", "[BlockStorage]") {
     REQUIRE(storage.numFreeBlocks() == 0U);
 }
 
+TEST_CASE("BlockStorage of an older format is not opened", "[BlockStorage]") {
+    // The header used to start with the magic number and the block size.
+    const uint64_t oldHeader[] = {12345654321U, 1028, 0, 0, 0};
+
+    std::unique_ptr<ISharedMemory> small = std::make_unique<FakeSharedMemory>(sizeof(oldHeader));
+    std::memcpy(small->get(), oldHeader, sizeof(oldHeader));
+    REQUIRE_THROWS_AS(BlockStorage<1028>(std::move(small)), std::runtime_error);
+
+    std::unique_ptr<ISharedMemory> large = std::make_unique<FakeSharedMemory>(4096U);
+    std::memcpy(large->get(), oldHeader, sizeof(oldHeader));
+    REQUIRE_THROWS_AS(BlockStorage<1028>(std::move(large)), std::runtime_error);
+}
+
 TEST_CASE("Create new Block", "[BlockStorage]") {
     std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
     BlockStorage<1028> storage(std::move(memory));
@@ -87,3 +107,407 @@ TEST_CASE("Free a Block", "[BlockStorage]") {
         REQUIRE(storage.numFreeBlocks() == (blockIds.size() - oneBasedIndex));
     }
 }
+
+TEST_CASE("Reserve BlockStorage capacity", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+    REQUIRE(storage.capacity() == 0U);
+
+    storage.reserve(100);
+    REQUIRE(storage.capacity() == 100U);
+    REQUIRE(storage.size() == 0U);
+
+    for (size_t index = 0; index < 100; ++index) {
+        storage.create();
+    }
+    REQUIRE(storage.capacity() == 100U);
+
+    storage.create();
+    REQUIRE(storage.size() == 101U);
+    REQUIRE(storage.capacity() == 200U);
+}
+
+TEST_CASE("Create multiple Blocks at once", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    std::vector<Block<1028> > blocks = storage.createN(100);
+    REQUIRE(blocks.size() == 100U);
+    REQUIRE(storage.size() == 100U);
+    REQUIRE(storage.capacity() == 100U);
+    for (size_t index = 0; index < blocks.size(); ++index) {
+        REQUIRE(blocks[index].id() == index);
+        REQUIRE(blocks[index].size() == 0U);
+    }
+
+    storage.free(blocks[10]);
+    storage.free(blocks[20]);
+    REQUIRE(storage.numFreeBlocks() == 2U);
+
+    blocks = storage.createN(3);
+    REQUIRE(blocks.size() == 3U);
+    REQUIRE(storage.numFreeBlocks() == 0U);
+    // Freed blocks are reused lowest id first, 100 is the free space map.
+    REQUIRE(blocks[0].id() == 10U);
+    REQUIRE(blocks[1].id() == 20U);
+    REQUIRE(blocks[2].id() == 101U);
+}
+
+TEST_CASE("Create an extent of Blocks", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+    storage.createN(100);
+
+    // 100 is the free space map, the only run of 3 free blocks is 40-42.
+    storage.free(10);
+    storage.free(20);
+    for (size_t index = 40; index < 43; ++index) {
+        storage.free(index);
+    }
+
+    std::vector<Block<1028> > blocks = storage.createExtent(3);
+    REQUIRE(blocks.size() == 3U);
+    REQUIRE(blocks[0].id() == 40U);
+    REQUIRE(blocks[1].id() == 41U);
+    REQUIRE(blocks[2].id() == 42U);
+    REQUIRE(storage.numFreeBlocks() == 2U);
+
+    // Without a long enough run the free blocks are used wherever they are.
+    blocks = storage.createExtent(2);
+    REQUIRE(blocks[0].id() == 10U);
+    REQUIRE(blocks[1].id() == 20U);
+    REQUIRE(storage.numFreeBlocks() == 0U);
+
+    // The storage only grows once no block is free, free blocks at the end
+    // are extended with fresh ones.
+    blocks = storage.createExtent(2);
+    REQUIRE(blocks[0].id() == 101U);
+    REQUIRE(blocks[1].id() == 102U);
+    storage.free(102);
+    blocks = storage.createExtent(3);
+    REQUIRE(blocks[0].id() == 102U);
+    REQUIRE(blocks[2].id() == 104U);
+    REQUIRE(storage.size() == 105U);
+}
+
+TEST_CASE("Free space map of BlockStorage", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    // More blocks than a single bitmap block covers.
+    const size_t numBlocks = 3 * FreeSpaceMap<1028>::bitsPerBitmapBlock();
+    storage.createN(numBlocks);
+
+    size_t numFreed = 0;
+    for (size_t index = 5; index < numBlocks; index += 7) {
+        storage.free(index);
+        ++numFreed;
+    }
+    REQUIRE(storage.isFree(19));
+    REQUIRE(!storage.isFree(20));
+    REQUIRE(storage.at(19).isFree());
+
+    // The bitmap blocks after the first one reuse the lowest free blocks.
+    std::vector<uint64_t> freedIds = storage.freeBlockIds();
+    REQUIRE(storage.numFreeBlocks() == numFreed - 2);
+    REQUIRE(freedIds.size() == numFreed - 2);
+    REQUIRE(freedIds.front() == 19U);
+    REQUIRE(std::is_sorted(freedIds.begin(), freedIds.end()));
+
+    for (size_t i = 0; i < freedIds.size(); ++i) {
+        Block<1028> block = storage.create();
+        REQUIRE(block.id() == freedIds[i]);
+        REQUIRE(!block.isFree());
+    }
+    REQUIRE(storage.numFreeBlocks() == 0U);
+    REQUIRE(storage.freeBlockIds().empty());
+}
+
+TEST_CASE("Rebuild free space map of BlockStorage", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    storage.createN(100);
+    storage.free(3);
+    storage.free(50);
+    storage.free(99);
+    const size_t size = storage.size();
+
+    storage.rebuildFreeSpaceMap();
+    REQUIRE(storage.size() == size);
+    REQUIRE(storage.numFreeBlocks() == 3U);
+    REQUIRE(storage.freeBlockIds() == std::vector<uint64_t>({3, 50, 99}));
+
+    REQUIRE(storage.create().id() == 3U);
+    REQUIRE(storage.create().id() == 50U);
+    REQUIRE(storage.create().id() == 99U);
+}
+
+TEST_CASE("Aligned BlockStorage layout", "[BlockStorage]") {
+    // Alignment is relative to the start of the memory, which has to be page
+    // aligned itself.
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<ReservedMemory>(1 << 20);
+    BlockStorage<1028> storage(std::move(memory), BlockLayout::Aligned);
+    REQUIRE(storage.layout() == BlockLayout::Aligned);
+
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    REQUIRE(storage.blockOffset(0) == pageSize);
+    REQUIRE(storage.blockOffset(1) == pageSize + 2048);
+
+    for (size_t index = 0; index < 100; ++index) {
+        Block<1028> block = storage.create();
+        REQUIRE(block.id() == index);
+        REQUIRE(block.blockSize() == 1028);
+        REQUIRE(block.capacity() == 1028 - Block<1028>::MIN_BLOCK_SIZE);
+    }
+
+    for (size_t index = 0; index < 100; ++index) {
+        REQUIRE(storage.at(index).id() == index);
+        REQUIRE((reinterpret_cast<uintptr_t>(storage.at(index).data()) - Block<1028>::MIN_BLOCK_SIZE) % 2048 == 0);
+    }
+
+    std::unique_ptr<ISharedMemory> packedMemory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> packed(std::move(packedMemory));
+    REQUIRE(packed.layout() == BlockLayout::Packed);
+    REQUIRE(packed.blockOffset(1) - packed.blockOffset(0) == 1028U);
+}
+
+TEST_CASE("Compact BlockStorage", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    storage.createN(50);
+    VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(storage.create());
+    REQUIRE(vector.id() == 50U);
+    for (uint64_t i = 0; i < 2000; ++i) {
+        vector.push_back(i);
+    }
+    const uint64_t numVectorBlocks = vector.numBlocks();
+
+    for (size_t index = 0; index < 50; ++index) {
+        if (index != 10) {
+            storage.free(index);
+        }
+    }
+    const size_t size = storage.size();
+    const size_t capacity = storage.capacity();
+
+    // Work is bounded per call.
+    REQUIRE(storage.compact(1) == 1U);
+    REQUIRE(storage.size() == size);
+
+    // The continuation blocks of the vector, its block directory and the
+    // free space map move in front of the vector head, which stays where it
+    // is.
+    REQUIRE(storage.compact(1000) == numVectorBlocks - 1 + 1 /* directory */);
+    REQUIRE(storage.compact(1000) == 0U);
+    REQUIRE(storage.size() == size);
+    REQUIRE(storage.capacity() == 51U);
+    REQUIRE(storage.capacity() < capacity);
+    REQUIRE(storage.numFreeBlocks() == 51U - size);
+
+    REQUIRE(vector.size() == 2000U);
+    for (uint64_t i = 0; i < 2000; ++i) {
+        REQUIRE(vector[i] == i);
+    }
+    for (uint64_t blockId : storage.freeBlockIds()) {
+        REQUIRE(blockId < 50U);
+    }
+
+    vector.push_back(2000);
+    REQUIRE(vector[2000] == 2000U);
+}
+
+TEST_CASE("Compact moves the tail of a VectorView", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    storage.createN(20);
+    VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(storage.create());
+    for (uint64_t i = 0; i < 1305; ++i) {
+        vector.push_back(i);
+    }
+    REQUIRE(vector.numBlocks() == 12U);
+    for (size_t index = 0; index < 20; ++index) {
+        storage.free(index);
+    }
+
+    // The last blocks of the storage are the tail and the block before it.
+    REQUIRE(storage.compact(2) == 2U);
+
+    size_t numElements = 0;
+    for (const Segment<const uint64_t>& segment : vector.csegments()) {
+        numElements += segment.size;
+    }
+    REQUIRE(numElements == 1305U);
+
+    vector.push_back(1305);
+    REQUIRE(vector.size() == 1306U);
+    for (uint64_t i = 0; i < 1306; ++i) {
+        REQUIRE(vector[i] == i);
+    }
+}
+
+TEST_CASE("Create spans of Blocks", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<256> storage(std::move(memory));
+    storage.createN(5);
+
+    // Rounded up to 4 blocks starting at a multiple of 4, block 5 to 7 are
+    // left free and block 12 becomes the free space map.
+    Block<256> span = storage.createSpan(3);
+    REQUIRE(span.id() == 8U);
+    REQUIRE(span.blockSize() == 4 * 256U);
+    REQUIRE(span.capacity() == 4 * 256 - Block<256>::MIN_BLOCK_SIZE);
+    REQUIRE(storage.spanLength(span) == 4U);
+    REQUIRE(storage.size() == 10U);
+    REQUIRE(storage.numFreeBlocks() == 3U);
+
+    std::vector<uint8_t> data(static_cast<size_t>(span.capacity()), 0xAB);
+    span.set(data.data(), data.size());
+    REQUIRE(storage.at(4).blockSize() == 256U);
+
+    REQUIRE_THROWS_AS(storage.createSpan(BlockStorage<256>::kMaxSpanLength + 1), std::length_error);
+
+    // The span is rebuilt as one block, its data is not mistaken for headers.
+    storage.rebuildFreeSpaceMap();
+    REQUIRE(storage.size() == 10U);
+    REQUIRE(storage.numFreeBlocks() == 3U);
+
+    storage.free(span);
+    REQUIRE(storage.size() == 6U);
+    REQUIRE(storage.numFreeBlocks() == 7U);
+
+    // Freed spans are reused by spans of the same alignment.
+    Block<256> reused = storage.createSpan(4);
+    REQUIRE(reused.id() == 8U);
+    Block<256> pair = storage.createSpan(2);
+    REQUIRE(pair.id() == 6U);
+}
+
+TEST_CASE("Compact spans of Blocks", "[BlockStorage]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<256> storage(std::move(memory));
+
+    // Puts the free space map at block 4.
+    storage.createN(4);
+    storage.free(3);
+    storage.create();
+
+    Block<256> first = storage.createSpan(4);
+    Block<256> second = storage.createSpan(4);
+    REQUIRE(first.id() == 8U);
+    REQUIRE(second.id() == 12U);
+
+    std::vector<uint8_t> data(static_cast<size_t>(second.capacity()));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i);
+    }
+    second.set(data.data(), data.size());
+    second.setTag(BlockTag::RecordContinuation);
+    storage.free(first);
+
+    std::vector<std::pair<uint64_t, uint64_t> > moves;
+    REQUIRE(storage.compact(10, [&moves](Block<256> block, uint64_t oldBlockId) {
+        moves.emplace_back(block.id(), oldBlockId);
+    }) == 1U);
+
+    // The span moved as a whole into the aligned free run it left behind.
+    REQUIRE(moves.size() == 1U);
+    REQUIRE(moves[0].first == 8U);
+    REQUIRE(moves[0].second == 12U);
+    REQUIRE(storage.capacity() == 12U);
+
+    Block<256> moved = storage.at(8);
+    REQUIRE(storage.spanLength(moved) == 4U);
+    REQUIRE(std::vector<uint8_t>(moved.data(), moved.data() + moved.size()) == data);
+}
+
+TEST_CASE("Lock-free Block allocation", "[BlockStorage]") {
+    BlockStorage<1028> storage(std::make_unique<ReservedMemory>(1 << 20), BlockLayout::Packed, BlockAllocation::LockFree);
+    REQUIRE(storage.allocation() == BlockAllocation::LockFree);
+    REQUIRE_THROWS_AS(storage.create(), std::length_error);
+
+    storage.reserve(64);
+    for (uint64_t i = 0; i < 10; ++i) {
+        REQUIRE(storage.create().id() == i);
+    }
+    REQUIRE(storage.size() == 10U);
+
+    // Freed blocks come back last in, first out.
+    storage.free(3);
+    storage.free(7);
+    REQUIRE(storage.isFree(3));
+    REQUIRE(storage.numFreeBlocks() == 2U);
+    REQUIRE(storage.freeBlockIds() == std::vector<uint64_t>({3, 7}));
+    REQUIRE(storage.create().id() == 7U);
+    REQUIRE(storage.create().id() == 3U);
+    REQUIRE(storage.create().id() == 10U);
+
+    // A span skips to its alignment, the skipped blocks become free.
+    Block<1028> span = storage.createSpan(4);
+    REQUIRE(span.id() == 12U);
+    REQUIRE(storage.spanLength(span) == 4U);
+    REQUIRE(storage.freeBlockIds() == std::vector<uint64_t>({11}));
+    storage.free(span);
+    REQUIRE(storage.numFreeBlocks() == 5U);
+    REQUIRE(storage.size() == 11U);
+
+    std::vector<Block<1028> > extent = storage.createExtent(3);
+    REQUIRE(extent[0].id() == 16U);
+    REQUIRE(extent[2].id() == 18U);
+    REQUIRE(storage.compact(10) == 0U);
+}
+
+TEST_CASE("Lock-free Block allocation from many threads", "[BlockStorage]") {
+    const size_t numBlocks = 4096;
+    BlockStorage<1028> storage(std::make_unique<ReservedMemory>(16 << 20), BlockLayout::Packed, BlockAllocation::LockFree);
+    storage.reserve(numBlocks);
+
+    // Every block has at most one owner at a time, a block handed out twice
+    // trips the exchange below.
+    std::vector<std::atomic<int> > owners(numBlocks);
+    for (std::atomic<int>& owner : owners) {
+        owner = -1;
+    }
+
+    const int numThreads = 8;
+    const size_t maxHeld = 256;
+    std::atomic<size_t> numDoubleAllocations(0);
+    std::atomic<size_t> numHeld(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 random(static_cast<unsigned>(t));
+            std::vector<uint64_t> held;
+            for (size_t i = 0; i < 20000; ++i) {
+                if (held.size() < maxHeld && (held.empty() || random() % 2 == 0)) {
+                    uint64_t blockId = storage.create().id();
+                    int expected = -1;
+                    if (!owners[blockId].compare_exchange_strong(expected, t)) {
+                        ++numDoubleAllocations;
+                    }
+                    held.push_back(blockId);
+                } else {
+                    size_t index = random() % held.size();
+                    uint64_t blockId = held[index];
+                    held[index] = held.back();
+                    held.pop_back();
+                    owners[blockId] = -1;
+                    storage.free(blockId);
+                }
+            }
+            numHeld += held.size();
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(numDoubleAllocations == 0U);
+    REQUIRE(storage.size() == numHeld);
+    REQUIRE(storage.size() + storage.numFreeBlocks() <= numThreads * maxHeld);
+    for (uint64_t blockId : storage.freeBlockIds()) {
+        REQUIRE(owners[blockId] == -1);
+    }
+}
@@ -0,0 +1,549 @@
+#pragma once
+
+#include "IoEngine.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+template <size_t PageSize>
+class BufferPool;
+
+// Whether the file of a BufferPool goes through the kernel page cache.
+// Direct opens it with O_DIRECT, so pages are only cached once, in the pool.
+enum class FileCaching
+{
+   PageCache,
+   Direct
+};
+
+// Keeps a page pinned in the BufferPool for as long as it is alive. The data
+// pointer is only valid while the handle is.
+template <size_t PageSize>
+class PageHandle
+{
+public:
+   PageHandle()
+      : m_pool(nullptr),
+        m_pageId(0),
+        m_data(nullptr),
+        m_dirty(false)
+   {}
+
+   PageHandle(BufferPool<PageSize>* pool, uint64_t pageId, uint8_t* data)
+      : m_pool(pool),
+        m_pageId(pageId),
+        m_data(data),
+        m_dirty(false)
+   {}
+
+   PageHandle(const PageHandle&) = delete;
+   PageHandle& operator=(const PageHandle&) = delete;
+
+   PageHandle(PageHandle&& other)
+      : m_pool(other.m_pool),
+        m_pageId(other.m_pageId),
+        m_data(other.m_data),
+        m_dirty(other.m_dirty)
+   {
+      other.m_pool = nullptr;
+   }
+
+   PageHandle& operator=(PageHandle&& other)
+   {
+      if (this != &other) {
+         release();
+         m_pool = other.m_pool;
+         m_pageId = other.m_pageId;
+         m_data = other.m_data;
+         m_dirty = other.m_dirty;
+         other.m_pool = nullptr;
+      }
+      return *this;
+   }
+
+   ~PageHandle()
+   {
+      release();
+   }
+
+   uint64_t id() const
+   {
+      return m_pageId;
+   }
+
+   uint8_t* data()
+   {
+      return m_data;
+   }
+
+   const uint8_t* data() const
+   {
+      return m_data;
+   }
+
+   // The page is written back to the file before its frame is reused.
+   void markDirty()
+   {
+      m_dirty = true;
+   }
+
+   void release()
+   {
+      if (m_pool == nullptr) return;
+
+      m_pool->unpin(m_pageId, m_dirty);
+      m_pool = nullptr;
+   }
+
+private:
+   BufferPool<PageSize>* m_pool;
+   uint64_t m_pageId;
+   uint8_t* m_data;
+   bool m_dirty;
+};
+
+// Fixed size cache of the pages of a file. Pages are read with pread into one
+// of numFrames frames and written back with pwrite when a dirty page is
+// evicted or flush() is called, so the memory used stays bounded no matter how
+// large the file gets. Frames are reused in CLOCK (second chance) order and a
+// pinned page is never evicted.
+//
+// A page of PageSize bytes usually holds exactly one block. A BlockStorage
+// constructed from a pool keeps all its blocks in the file of the pool and
+// reads them through it, see BlockStorage::kPageSize for the page size it
+// needs.
+//
+// Single misses are read synchronously. prefetch(), the batch fetch() and
+// flush() go through an IoEngine instead, which keeps all the reads or writes
+// of the batch in flight at once (io_uring when available, a pread thread pool
+// otherwise).
+//
+// Frames are page aligned so the pool can also run on a file opened with
+// O_DIRECT. That needs PageSize to be a multiple of the device block size,
+// which the pool checks for 512 bytes; a BlockStorage<4096> created with
+// BlockLayout::Aligned keeps block i at page i + 1 of its file.
+template <size_t PageSize>
+class BufferPool
+{
+public:
+   struct Statistics
+   {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      uint64_t writebacks;
+      uint64_t prefetches; // pages read by prefetch(), not counted as misses
+
+      double hitRate() const
+      {
+         uint64_t accesses = hits + misses;
+         return accesses == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(accesses);
+      }
+   };
+
+   BufferPool(const std::string& path,
+              size_t numFrames,
+              FileCaching caching = FileCaching::PageCache,
+              std::unique_ptr<IoEngine> ioEngine = nullptr)
+      : m_mutex(),
+        m_path(path),
+        m_fd(-1),
+        m_caching(caching),
+        m_frames(numFrames),
+        m_buffer(nullptr, &std::free),
+        m_pageTable(),
+        m_clockHand(0),
+        m_statistics(),
+        m_ioEngine(std::move(ioEngine))
+   {
+      if (numFrames == 0) {
+         throw std::invalid_argument("BufferPool needs at least one frame");
+      }
+
+      if (caching == FileCaching::Direct && PageSize % kDirectIoAlignment != 0) {
+         throw std::invalid_argument("Direct I/O needs the page size to be a multiple of the device block size");
+      }
+
+      void* buffer = nullptr;
+      size_t alignment = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+      if (::posix_memalign(&buffer, alignment, numFrames * PageSize) != 0) {
+         throw std::bad_alloc();
+      }
+      m_buffer.reset(static_cast<uint8_t*>(buffer));
+
+      if (!m_ioEngine) {
+         m_ioEngine = makeIoEngine(std::min(numFrames, static_cast<size_t>(kDefaultQueueDepth)));
+      }
+
+      int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+      if (caching == FileCaching::Direct) {
+         flags |= O_DIRECT;
+      }
+
+      m_fd = ::open(path.c_str(), flags, 0644);
+      if (m_fd < 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to open " + path);
+      }
+   }
+
+   BufferPool(const BufferPool&) = delete;
+   BufferPool& operator=(const BufferPool&) = delete;
+
+   ~BufferPool()
+   {
+      try {
+         flush();
+      } catch (...) {
+         // Nothing sensible to do about a failed write back at this point.
+      }
+      ::close(m_fd);
+   }
+
+   // Pins the page and returns a handle that unpins it when destroyed. Pages
+   // past the end of the file read as zeros.
+   PageHandle<PageSize> fetch(uint64_t pageId)
+   {
+      return PageHandle<PageSize>(this, pageId, pin(pageId));
+   }
+
+   // Pins all the pages, reading the missing ones as one batch.
+   std::vector<PageHandle<PageSize> > fetch(const std::vector<uint64_t>& pageIds)
+   {
+      prefetch(pageIds);
+
+      std::vector<PageHandle<PageSize> > pages;
+      pages.reserve(pageIds.size());
+      for (uint64_t pageId : pageIds) {
+         pages.push_back(fetch(pageId));
+      }
+      return pages;
+   }
+
+   // Reads the pages that are not in the pool yet with all reads in flight at
+   // the same time. Prefetching is only a hint: pages that do not fit next to
+   // the pinned ones are skipped.
+   void prefetch(const std::vector<uint64_t>& pageIds)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      std::vector<IoRequest> writebacks;
+      std::vector<IoRequest> reads;
+      std::vector<size_t> frameIndexes;
+      std::vector<Frame> evicted;
+      for (uint64_t pageId : pageIds) {
+         if (m_pageTable.count(pageId) > 0) continue;
+
+         size_t frameIndex;
+         if (!tryFindVictim(frameIndex)) break;
+
+         Frame& frame = m_frames[frameIndex];
+         evicted.push_back(frame);
+         if (frame.valid) {
+            if (frame.dirty) {
+               writebacks.push_back(makeRequest(IoRequest::Kind::Write, frame.pageId, frameIndex));
+            }
+            m_pageTable.erase(frame.pageId);
+            m_statistics.evictions += 1;
+         }
+
+         // Pinned until the read completed so the frame is not picked twice.
+         frame.pageId = pageId;
+         frame.pinCount = 1;
+         frame.dirty = false;
+         frame.referenced = true;
+         frame.valid = true;
+         m_pageTable[pageId] = frameIndex;
+
+         reads.push_back(makeRequest(IoRequest::Kind::Read, pageId, frameIndex));
+         frameIndexes.push_back(frameIndex);
+      }
+
+      // The evicted pages have to be on disk before their frames are
+      // overwritten by the reads.
+      try {
+         submit(writebacks);
+      } catch (...) {
+         // Nothing was read yet, so the evicted pages are still intact in
+         // their frames and go back into the pool.
+         undoPrefetch(frameIndexes, &evicted);
+         throw;
+      }
+      m_statistics.writebacks += writebacks.size();
+
+      try {
+         submit(reads);
+      } catch (...) {
+         undoPrefetch(frameIndexes, nullptr);
+         throw;
+      }
+      for (size_t i = 0; i < reads.size(); ++i) {
+         size_t bytesRead = static_cast<size_t>(reads[i].result);
+         std::memset(frameData(frameIndexes[i]) + bytesRead, 0, PageSize - bytesRead);
+         m_frames[frameIndexes[i]].pinCount -= 1;
+      }
+      m_statistics.prefetches += reads.size();
+   }
+
+   uint8_t* pin(uint64_t pageId)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      auto found = m_pageTable.find(pageId);
+      if (found != m_pageTable.end()) {
+         Frame& frame = m_frames[found->second];
+         frame.pinCount += 1;
+         frame.referenced = true;
+         m_statistics.hits += 1;
+         return frameData(found->second);
+      }
+
+      m_statistics.misses += 1;
+      size_t frameIndex = findVictim();
+      Frame& frame = m_frames[frameIndex];
+      if (frame.valid) {
+         if (frame.dirty) {
+            writePage(frame.pageId, frameData(frameIndex));
+         }
+         m_pageTable.erase(frame.pageId);
+         frame.valid = false;
+         m_statistics.evictions += 1;
+      }
+
+      readPage(pageId, frameData(frameIndex));
+      frame.pageId = pageId;
+      frame.pinCount = 1;
+      frame.dirty = false;
+      frame.referenced = true;
+      frame.valid = true;
+      m_pageTable[pageId] = frameIndex;
+      return frameData(frameIndex);
+   }
+
+   void unpin(uint64_t pageId, bool dirty)
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      auto found = m_pageTable.find(pageId);
+      if (found == m_pageTable.end()) {
+         throw std::logic_error("Unpinning a page that is not in the BufferPool");
+      }
+
+      Frame& frame = m_frames[found->second];
+      assert(frame.pinCount > 0);
+      frame.pinCount -= 1;
+      frame.dirty = frame.dirty || dirty;
+   }
+
+   // Writes all dirty pages back to the file as one batch.
+   void flush()
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      std::vector<IoRequest> writebacks;
+      std::vector<size_t> frameIndexes;
+      for (size_t frameIndex = 0; frameIndex < m_frames.size(); ++frameIndex) {
+         Frame& frame = m_frames[frameIndex];
+         if (frame.valid && frame.dirty) {
+            writebacks.push_back(makeRequest(IoRequest::Kind::Write, frame.pageId, frameIndex));
+            frameIndexes.push_back(frameIndex);
+         }
+      }
+
+      // A failed batch keeps every page dirty so a later flush retries it.
+      submit(writebacks);
+      for (size_t frameIndex : frameIndexes) {
+         m_frames[frameIndex].dirty = false;
+      }
+      m_statistics.writebacks += writebacks.size();
+   }
+
+   // Number of pages in the file, pages that are only dirty in the pool and
+   // have never been written back are not counted.
+   uint64_t numPages()
+   {
+      struct stat fileStatus;
+      if (::fstat(m_fd, &fileStatus) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to stat " + m_path);
+      }
+      return (static_cast<uint64_t>(fileStatus.st_size) + PageSize - 1) / PageSize;
+   }
+
+   size_t numFrames() const
+   {
+      return m_frames.size();
+   }
+
+   FileCaching caching() const
+   {
+      return m_caching;
+   }
+
+   Statistics statistics()
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      return m_statistics;
+   }
+
+   void resetStatistics()
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_statistics = Statistics();
+   }
+
+private:
+   struct Frame
+   {
+      Frame()
+         : pageId(0),
+           pinCount(0),
+           dirty(false),
+           referenced(false),
+           valid(false)
+      {}
+
+      uint64_t pageId;
+      uint32_t pinCount;
+      bool dirty;
+      bool referenced;
+      bool valid;
+   };
+
+   std::mutex m_mutex;
+   std::string m_path;
+   int m_fd;
+   FileCaching m_caching;
+   std::vector<Frame> m_frames;
+   std::unique_ptr<uint8_t, decltype(&std::free)> m_buffer;
+   std::unordered_map<uint64_t, size_t> m_pageTable;
+   size_t m_clockHand;
+   Statistics m_statistics;
+   std::unique_ptr<IoEngine> m_ioEngine;
+
+   static const size_t kDefaultQueueDepth = 32;
+   static const size_t kDirectIoAlignment = 512;
+
+   uint8_t* frameData(size_t frameIndex)
+   {
+      return m_buffer.get() + (frameIndex * PageSize);
+   }
+
+   size_t findVictim()
+   {
+      size_t frameIndex;
+      if (!tryFindVictim(frameIndex)) {
+         throw std::runtime_error("All BufferPool frames are pinned");
+      }
+      return frameIndex;
+   }
+
+   bool tryFindVictim(size_t& victim)
+   {
+      // Every frame gets its reference bit cleared on the first pass, so two
+      // full turns are enough to find an unpinned frame if there is one.
+      for (size_t step = 0; step < 2 * m_frames.size(); ++step) {
+         size_t frameIndex = m_clockHand;
+         m_clockHand = (m_clockHand + 1) % m_frames.size();
+
+         Frame& frame = m_frames[frameIndex];
+         if (frame.valid) {
+            if (frame.pinCount > 0) continue;
+            if (frame.referenced) {
+               frame.referenced = false;
+               continue;
+            }
+         }
+
+         victim = frameIndex;
+         return true;
+      }
+
+      return false;
+   }
+
+   // Takes the frames of a failed prefetch out of the pool again. With
+   // evicted the pages they held before are put back as they were.
+   void undoPrefetch(const std::vector<size_t>& frameIndexes, const std::vector<Frame>* evicted)
+   {
+      for (size_t i = 0; i < frameIndexes.size(); ++i) {
+         Frame& frame = m_frames[frameIndexes[i]];
+         m_pageTable.erase(frame.pageId);
+         frame = Frame();
+         if (evicted != nullptr && (*evicted)[i].valid) {
+            frame = (*evicted)[i];
+            m_pageTable[frame.pageId] = frameIndexes[i];
+            m_statistics.evictions -= 1;
+         }
+      }
+   }
+
+   IoRequest makeRequest(IoRequest::Kind kind, uint64_t pageId, size_t frameIndex)
+   {
+      IoRequest request;
+      request.kind = kind;
+      request.fd = m_fd;
+      request.buffer = frameData(frameIndex);
+      request.size = PageSize;
+      request.offset = pageId * PageSize;
+      request.result = 0;
+      return request;
+   }
+
+   void submit(std::vector<IoRequest>& requests)
+   {
+      if (requests.empty()) return;
+
+      m_ioEngine->submit(requests.data(), requests.size());
+      for (const IoRequest& request : requests) {
+         if (request.result < 0) {
+            throw std::system_error(static_cast<int>(-request.result), std::generic_category(),
+                                    (request.kind == IoRequest::Kind::Read ? "Failed to read " : "Failed to write ") + m_path);
+         }
+      }
+   }
+
+   void readPage(uint64_t pageId, uint8_t* data)
+   {
+      size_t bytesRead = 0;
+      while (bytesRead < PageSize) {
+         ssize_t result = ::pread(m_fd, data + bytesRead, PageSize - bytesRead, static_cast<off_t>(pageId * PageSize + bytesRead));
+         if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "Failed to read " + m_path);
+         }
+         if (result == 0) break;
+         bytesRead += static_cast<size_t>(result);
+      }
+
+      std::memset(data + bytesRead, 0, PageSize - bytesRead);
+   }
+
+   void writePage(uint64_t pageId, const uint8_t* data)
+   {
+      size_t bytesWritten = 0;
+      while (bytesWritten < PageSize) {
+         ssize_t result = ::pwrite(m_fd, data + bytesWritten, PageSize - bytesWritten, static_cast<off_t>(pageId * PageSize + bytesWritten));
+         if (result < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "Failed to write " + m_path);
+         }
+         bytesWritten += static_cast<size_t>(result);
+      }
+
+      m_statistics.writebacks += 1;
+   }
+};
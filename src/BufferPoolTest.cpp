@@ -0,0 +1,371 @@
+#include <catch.hpp>
+
+#include "BlockStorage.h"
+#include "BufferPool.h"
+#include "MappedFileMemory.h"
+#include "RecordStorage.h"
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+static std::string temporaryPoolPath()
+{
+   char path[] = "/tmp/BufferPoolTest.XXXXXX";
+   int fd = mkstemp(path);
+   REQUIRE(fd >= 0);
+   close(fd);
+   return path;
+}
+
+// Runs requests synchronously and fails all of them while failing is set.
+class FlakyIoEngine : public IoEngine
+{
+public:
+   FlakyIoEngine()
+      : failing(false)
+   {}
+
+   virtual void submit(IoRequest* requests, size_t count) override
+   {
+      for (size_t i = 0; i < count; ++i) {
+         IoRequest& request = requests[i];
+         if (failing) {
+            request.result = -EIO;
+         } else if (request.kind == IoRequest::Kind::Read) {
+            request.result = pread(request.fd, request.buffer, request.size, static_cast<off_t>(request.offset));
+         } else {
+            request.result = pwrite(request.fd, request.buffer, request.size, static_cast<off_t>(request.offset));
+         }
+      }
+   }
+
+   virtual size_t queueDepth() const override
+   {
+      return 1;
+   }
+
+   bool failing;
+};
+
+TEST_CASE("Fetch pages through BufferPool", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    {
+        BufferPool<1028> pool(path, 4);
+        REQUIRE(pool.numFrames() == 4U);
+        REQUIRE(pool.numPages() == 0U);
+
+        for (uint64_t pageId = 0; pageId < 100; ++pageId) {
+            PageHandle<1028> page = pool.fetch(pageId);
+            REQUIRE(page.data()[0] == 0);
+            std::memset(page.data(), static_cast<int>(pageId), 1028);
+            page.markDirty();
+        }
+
+        BufferPool<1028>::Statistics statistics = pool.statistics();
+        REQUIRE(statistics.misses == 100U);
+        REQUIRE(statistics.hits == 0U);
+        REQUIRE(statistics.evictions == 96U);
+        REQUIRE(statistics.writebacks == 96U);
+
+        for (uint64_t pageId = 0; pageId < 100; ++pageId) {
+            PageHandle<1028> page = pool.fetch(pageId);
+            REQUIRE(page.data()[0] == static_cast<uint8_t>(pageId));
+            REQUIRE(page.data()[1027] == static_cast<uint8_t>(pageId));
+        }
+    }
+
+    {
+        BufferPool<1028> pool(path, 2);
+        REQUIRE(pool.numPages() == 100U);
+        PageHandle<1028> page = pool.fetch(42);
+        REQUIRE(page.data()[500] == 42);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("BufferPool keeps recently used pages", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    {
+        BufferPool<1028> pool(path, 8);
+        for (size_t round = 0; round < 10; ++round) {
+            for (uint64_t pageId = 0; pageId < 8; ++pageId) {
+                pool.fetch(pageId);
+            }
+        }
+
+        BufferPool<1028>::Statistics statistics = pool.statistics();
+        REQUIRE(statistics.misses == 8U);
+        REQUIRE(statistics.hits == 72U);
+        REQUIRE(statistics.evictions == 0U);
+        REQUIRE(statistics.hitRate() == Approx(0.9));
+
+        pool.resetStatistics();
+        REQUIRE(pool.statistics().hits == 0U);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("BufferPool does not evict pinned pages", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    {
+        BufferPool<1028> pool(path, 2);
+        PageHandle<1028> first = pool.fetch(0);
+        PageHandle<1028> second = pool.fetch(1);
+        REQUIRE_THROWS_AS(pool.fetch(2), std::runtime_error);
+
+        second.release();
+        PageHandle<1028> third = pool.fetch(2);
+        REQUIRE(third.id() == 2U);
+        REQUIRE(first.id() == 0U);
+        REQUIRE(pool.statistics().evictions == 1U);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Prefetch pages into BufferPool", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    {
+        BufferPool<1028> pool(path, 16);
+        for (uint64_t pageId = 0; pageId < 64; ++pageId) {
+            PageHandle<1028> page = pool.fetch(pageId);
+            std::memset(page.data(), static_cast<int>(pageId), 1028);
+            page.markDirty();
+        }
+        pool.flush();
+        pool.resetStatistics();
+
+        std::vector<uint64_t> pageIds;
+        for (uint64_t pageId = 32; pageId < 40; ++pageId) {
+            pageIds.push_back(pageId);
+        }
+
+        std::vector<PageHandle<1028> > pages = pool.fetch(pageIds);
+        REQUIRE(pages.size() == pageIds.size());
+        for (size_t i = 0; i < pages.size(); ++i) {
+            REQUIRE(pages[i].id() == pageIds[i]);
+            REQUIRE(pages[i].data()[100] == static_cast<uint8_t>(pageIds[i]));
+        }
+
+        BufferPool<1028>::Statistics statistics = pool.statistics();
+        REQUIRE(statistics.prefetches == pageIds.size());
+        REQUIRE(statistics.hits == pageIds.size());
+        REQUIRE(statistics.misses == 0U);
+
+        // Only the unpinned frames can take prefetched pages.
+        std::vector<uint64_t> tooManyPageIds;
+        for (uint64_t pageId = 0; pageId < 32; ++pageId) {
+            tooManyPageIds.push_back(pageId);
+        }
+        pool.prefetch(tooManyPageIds);
+        REQUIRE(pool.statistics().prefetches == pageIds.size() + 8U);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("BufferPool survives failed batch I/O", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    {
+        std::unique_ptr<FlakyIoEngine> ioEngine = std::make_unique<FlakyIoEngine>();
+        FlakyIoEngine* flaky = ioEngine.get();
+        BufferPool<1028> pool(path, 4, FileCaching::PageCache, std::move(ioEngine));
+        for (uint64_t pageId = 0; pageId < 4; ++pageId) {
+            PageHandle<1028> page = pool.fetch(pageId);
+            std::memset(page.data(), static_cast<int>(pageId + 1), 1028);
+            page.markDirty();
+        }
+
+        // The write back of the evicted pages fails, they stay in the pool.
+        flaky->failing = true;
+        pool.resetStatistics();
+        REQUIRE_THROWS_AS(pool.prefetch({10, 11}), std::system_error);
+        for (uint64_t pageId = 0; pageId < 4; ++pageId) {
+            PageHandle<1028> page = pool.fetch(pageId);
+            REQUIRE(page.data()[0] == static_cast<uint8_t>(pageId + 1));
+        }
+        REQUIRE(pool.statistics().hits == 4U);
+        REQUIRE(pool.statistics().evictions == 0U);
+
+        // A failed flush keeps the pages dirty for the next one.
+        REQUIRE_THROWS_AS(pool.flush(), std::system_error);
+        flaky->failing = false;
+        pool.flush();
+        REQUIRE(pool.statistics().writebacks == 4U);
+        REQUIRE(pool.numPages() == 4U);
+
+        // Pages whose read failed are not left behind in the pool.
+        flaky->failing = true;
+        REQUIRE_THROWS_AS(pool.prefetch({2, 3, 4, 5}), std::system_error);
+        flaky->failing = false;
+        PageHandle<1028> page = pool.fetch(4);
+        REQUIRE(page.data()[0] == 0);
+        REQUIRE(pool.fetch(2).data()[0] == 3);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Read aligned BlockStorage through direct I/O BufferPool", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    {
+        BlockStorage<4096> storage(std::make_unique<MappedFileMemory>(path), BlockLayout::Aligned);
+        for (size_t index = 0; index < 10; ++index) {
+            Block<4096> block = storage.create();
+            std::memset(block.data(), static_cast<int>(index), block.capacity());
+        }
+        REQUIRE(storage.blockOffset(3) == 4 * 4096U);
+    }
+
+    std::unique_ptr<BufferPool<4096> > pool;
+    try {
+        pool.reset(new BufferPool<4096>(path, 4, FileCaching::Direct));
+    } catch (const std::system_error& error) {
+        // Some file systems (older tmpfs) do not support O_DIRECT at all.
+        REQUIRE(error.code().value() == EINVAL);
+        WARN("O_DIRECT is not supported for " << path);
+    }
+
+    if (pool) {
+        REQUIRE(pool->caching() == FileCaching::Direct);
+        for (uint64_t blockId = 0; blockId < 10; ++blockId) {
+            PageHandle<4096> page = pool->fetch(blockId + 1);
+            REQUIRE(*reinterpret_cast<const uint64_t*>(page.data()) == blockId);
+            REQUIRE(page.data()[4000] == static_cast<uint8_t>(blockId));
+            page.data()[4000] = 0xEE;
+            page.markDirty();
+        }
+        pool->flush();
+        pool.reset();
+
+        BlockStorage<4096> storage(std::make_unique<MappedFileMemory>(path));
+        REQUIRE(storage.layout() == BlockLayout::Aligned);
+        REQUIRE(storage.size() == 10U);
+        REQUIRE(storage.at(7).data()[4000 - Block<4096>::MIN_BLOCK_SIZE] == 0xEE);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Direct I/O BufferPool needs aligned pages", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    REQUIRE_THROWS_AS(BufferPool<1028>(path, 4, FileCaching::Direct), std::invalid_argument);
+    unlink(path.c_str());
+}
+
+TEST_CASE("Keep a RecordStorage in a BufferPool", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    std::vector<RecordId> recordIds;
+    {
+        std::unique_ptr<BlockStorage<4096> > blocks =
+            std::make_unique<BlockStorage<4096> >(std::make_unique<BufferPool<4096> >(path, 16));
+        BufferPool<4096>& pool = *blocks->bufferPool();
+        RecordStorage<4096> storage(std::move(blocks));
+
+        // Every operation takes the lock on its own, its pages stay pinned
+        // until it unlocks.
+        for (size_t i = 0; i < 200; ++i) {
+            std::vector<uint8_t> data(i * 50, static_cast<uint8_t>(i));
+            std::lock_guard<RecordStorage<4096> > lock(storage);
+            recordIds.push_back(storage.add(data.data(), data.size()));
+        }
+        REQUIRE(pool.statistics().evictions > 0U);
+        REQUIRE(pool.numPages() > pool.numFrames());
+
+        // Reading does not write anything back.
+        {
+            std::lock_guard<RecordStorage<4096> > lock(storage);
+            pool.flush();
+        }
+        pool.resetStatistics();
+        for (size_t i = 0; i < recordIds.size(); ++i) {
+            std::shared_lock<RecordStorage<4096> > lock(storage);
+            REQUIRE(storage.get(recordIds[i]) == std::vector<uint8_t>(i * 50, static_cast<uint8_t>(i)));
+        }
+        REQUIRE(pool.statistics().misses > 0U);
+        REQUIRE(pool.statistics().writebacks == 0U);
+
+        // Blocks are only pinned under the lock.
+        REQUIRE_THROWS_AS(storage.get(recordIds[0]), std::logic_error);
+    }
+
+    // Records survive in the file, read through a pool of a few frames.
+    {
+        std::unique_ptr<BlockStorage<4096> > blocks =
+            std::make_unique<BlockStorage<4096> >(std::make_unique<BufferPool<4096> >(path, 8));
+        REQUIRE(blocks->layout() == BlockLayout::Aligned);
+        RecordStorage<4096> storage(std::move(blocks));
+
+        {
+            std::shared_lock<RecordStorage<4096> > lock(storage);
+            REQUIRE(storage.size() == recordIds.size());
+        }
+        for (size_t i = 0; i < recordIds.size(); ++i) {
+            std::shared_lock<RecordStorage<4096> > lock(storage);
+            REQUIRE(storage.get(recordIds[i]) == std::vector<uint8_t>(i * 50, static_cast<uint8_t>(i)));
+        }
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Read chains from a BufferPool in batches", "[BufferPool]") {
+    std::string path = temporaryPoolPath();
+    const std::vector<uint8_t> data(40 * 4000, 7);
+    RecordId recordId = 0;
+    uint64_t vectorId = 0;
+    {
+        std::unique_ptr<BlockStorage<4096> > blocks =
+            std::make_unique<BlockStorage<4096> >(std::make_unique<BufferPool<4096> >(path, 64));
+        BlockStorage<4096>& blockStorage = *blocks;
+        RecordStorage<4096> storage(std::move(blocks));
+        {
+            std::lock_guard<RecordStorage<4096> > lock(storage);
+            recordId = storage.add(data.data(), data.size());
+        }
+        {
+            std::lock_guard<RecordStorage<4096> > lock(storage);
+            VectorView<uint64_t, 4096> vector = VectorView<uint64_t, 4096>::createVectorView(blockStorage.create());
+            for (uint64_t i = 0; i < 20000; ++i) {
+                vector.push_back(i);
+            }
+            vectorId = vector.id();
+        }
+    }
+
+    std::unique_ptr<BlockStorage<4096> > blocks =
+        std::make_unique<BlockStorage<4096> >(std::make_unique<BufferPool<4096> >(path, 64));
+    BlockStorage<4096>& blockStorage = *blocks;
+    BufferPool<4096>& pool = *blocks->bufferPool();
+    RecordStorage<4096> storage(std::move(blocks));
+
+    // The directory of the vector lists all its blocks, only the head and the
+    // directory are read on their own.
+    {
+        std::shared_lock<RecordStorage<4096> > lock(storage);
+        pool.resetStatistics();
+        VectorView<uint64_t, 4096> vector(blockStorage.at(vectorId));
+        uint64_t expected = 0;
+        for (const Segment<uint64_t>& segment : vector.segments()) {
+            for (uint64_t value : segment) {
+                REQUIRE(value == expected);
+                ++expected;
+            }
+        }
+        REQUIRE(expected == 20000U);
+        REQUIRE(pool.statistics().misses == 2U);
+        REQUIRE(pool.statistics().prefetches == vector.numBlocks() - 1);
+    }
+    // The record lies on consecutive blocks, read ahead of the chain after
+    // its first block.
+    {
+        std::shared_lock<RecordStorage<4096> > lock(storage);
+        pool.resetStatistics();
+        REQUIRE(storage.get(recordId) == data);
+        REQUIRE(pool.statistics().misses == 1U);
+        REQUIRE(pool.statistics().prefetches >= 40U);
+    }
+
+    unlink(path.c_str());
+}
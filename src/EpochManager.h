@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+// Epoch based reclamation for readers that walk blocks without the lock.
+//
+// A reader pins the current epoch for as long as it may hold on to block ids
+// it read. Blocks freed meanwhile are only retired, tagged with the epoch
+// they were retired in, and handed back once every pinned reader has moved
+// past that epoch. The global epoch advances when all pinned readers have
+// seen it, so a reader that stays pinned holds back reclamation but never
+// blocks writers.
+//
+// Readers are tracked in a fixed number of slots in the memory of the
+// process, pin() waits for a free slot when all of them are taken.
+class EpochManager
+{
+public:
+   static const size_t kMaxReaders = 128;
+
+   // Keeps the epoch pinned until it goes away.
+   class Guard
+   {
+   public:
+      // Pins nothing.
+      Guard()
+         : m_epochs(nullptr),
+           m_slot(0)
+      {
+      }
+
+      Guard(Guard&& other)
+         : m_epochs(other.m_epochs),
+           m_slot(other.m_slot)
+      {
+         other.m_epochs = nullptr;
+      }
+
+      Guard(const Guard&) = delete;
+      Guard& operator=(const Guard&) = delete;
+
+      Guard& operator=(Guard&& other)
+      {
+         if (this != &other) {
+            unpin();
+            m_epochs = other.m_epochs;
+            m_slot = other.m_slot;
+            other.m_epochs = nullptr;
+         }
+         return *this;
+      }
+
+      ~Guard()
+      {
+         unpin();
+      }
+
+   private:
+      friend class EpochManager;
+
+      Guard(EpochManager* epochs, size_t slot)
+         : m_epochs(epochs),
+           m_slot(slot)
+      {
+      }
+
+      EpochManager* m_epochs;
+      size_t m_slot;
+
+      void unpin()
+      {
+         if (m_epochs) {
+            m_epochs->m_slots[m_slot].epoch.store(kIdle, std::memory_order_release);
+            m_epochs = nullptr;
+         }
+      }
+   };
+
+   EpochManager()
+      : m_epoch(1)
+   {
+      for (Slot& slot : m_slots) {
+         slot.epoch.store(kIdle, std::memory_order_relaxed);
+      }
+   }
+
+   EpochManager(const EpochManager&) = delete;
+   EpochManager& operator=(const EpochManager&) = delete;
+
+   Guard pin()
+   {
+      size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % kMaxReaders;
+      uint64_t epoch = m_epoch.load();
+      while (true) {
+         uint64_t idle = kIdle;
+         if (m_slots[slot].epoch.compare_exchange_strong(idle, epoch)) break;
+
+         slot = (slot + 1) % kMaxReaders;
+         if (slot == 0) {
+            std::this_thread::yield();
+         }
+      }
+
+      // The epoch may have advanced before the slot was published, the reader
+      // then has to announce the newer one.
+      uint64_t current = m_epoch.load();
+      while (current != epoch) {
+         epoch = current;
+         m_slots[slot].epoch.store(epoch);
+         current = m_epoch.load();
+      }
+
+      return Guard(this, slot);
+   }
+
+   uint64_t epoch() const
+   {
+      return m_epoch.load();
+   }
+
+   // Advances the global epoch when every pinned reader has seen the current
+   // one. Returns whether it advanced.
+   bool tryAdvance()
+   {
+      uint64_t epoch = m_epoch.load();
+      for (const Slot& slot : m_slots) {
+         uint64_t pinned = slot.epoch.load();
+         if (pinned != kIdle && pinned != epoch) return false;
+      }
+      return m_epoch.compare_exchange_strong(epoch, epoch + 1);
+   }
+
+   // Everything retired in an epoch before this one is out of reach of all
+   // readers.
+   uint64_t safeEpoch() const
+   {
+      uint64_t safe = m_epoch.load();
+      for (const Slot& slot : m_slots) {
+         uint64_t pinned = slot.epoch.load();
+         if (pinned != kIdle && pinned < safe) {
+            safe = pinned;
+         }
+      }
+      return safe;
+   }
+
+private:
+   static const uint64_t kIdle = 0;
+
+   // Padded so readers pinning in neighbouring slots do not share a cache
+   // line.
+   struct Slot
+   {
+      std::atomic<uint64_t> epoch;
+      uint8_t padding[56];
+   };
+
+   std::atomic<uint64_t> m_epoch;
+   Slot m_slots[kMaxReaders];
+};
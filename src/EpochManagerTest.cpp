@@ -0,0 +1,160 @@
+#include <catch.hpp>
+
+#include "BlockStorage.h"
+#include "EpochManager.h"
+#include "RecordStorage.h"
+#include "ReservedMemory.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Pinned readers hold back the epoch", "[EpochManager]") {
+    EpochManager epochs;
+    const uint64_t epoch = epochs.epoch();
+    REQUIRE(epochs.safeEpoch() == epoch);
+
+    {
+        EpochManager::Guard guard = epochs.pin();
+        REQUIRE(epochs.tryAdvance());
+        REQUIRE(epochs.epoch() == epoch + 1);
+        // The reader still announces the old epoch.
+        REQUIRE(!epochs.tryAdvance());
+        REQUIRE(epochs.safeEpoch() == epoch);
+
+        EpochManager::Guard other = epochs.pin();
+        REQUIRE(epochs.safeEpoch() == epoch);
+    }
+
+    REQUIRE(epochs.safeEpoch() == epoch + 1);
+    REQUIRE(epochs.tryAdvance());
+    REQUIRE(epochs.safeEpoch() == epoch + 2);
+}
+
+TEST_CASE("Retire Blocks until no reader can reach them", "[EpochManager]") {
+    EpochManager epochs;
+    BlockStorage<1028> storage(std::make_unique<FakeSharedMemory>(0U));
+    storage.setEpochManager(&epochs);
+    for (size_t i = 0; i < 4; ++i) {
+        storage.create();
+    }
+
+    {
+        EpochManager::Guard guard = epochs.pin();
+        storage.free(1);
+        REQUIRE(storage.numRetiredBlocks() == 1U);
+        REQUIRE(!storage.isFree(1));
+        REQUIRE(storage.size() == 4U);
+
+        REQUIRE(storage.reclaimRetiredBlocks() == 0U);
+        REQUIRE(storage.create().id() == 4U);
+    }
+
+    REQUIRE(storage.reclaimRetiredBlocks() == 1U);
+    REQUIRE(storage.numRetiredBlocks() == 0U);
+    REQUIRE(storage.isFree(1));
+    REQUIRE(storage.create().id() == 1U);
+
+    // Freeing a batch reclaims without being asked.
+    std::vector<Block<1028> > blocks = storage.createN(100);
+    for (Block<1028>& block : blocks) {
+        storage.free(block);
+    }
+    REQUIRE(storage.numRetiredBlocks() < 64U);
+
+    // Unsetting the manager frees the rest.
+    storage.setEpochManager(nullptr);
+    REQUIRE(storage.numRetiredBlocks() == 0U);
+    REQUIRE(storage.size() == 5U + 1U /* free space map */);
+}
+
+TEST_CASE("Optimistic reads while Records are erased under epochs", "[EpochManager]") {
+    EpochManager epochs;
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<ReservedMemory>(64 << 20));
+    blockStorage->setEpochManager(&epochs);
+    BlockStorage<1028>& blocks = *blockStorage;
+    RecordStorage<1028> storage(std::move(blockStorage));
+
+    const size_t numRecords = 100;
+    std::vector<uint8_t> record(3000, 42);
+    std::vector<RecordId> recordIds;
+    for (size_t i = 0; i < numRecords; ++i) {
+        recordIds.push_back(storage.add(record.data(), record.size()));
+    }
+
+    // Where the data of every record lies, the memory never moves.
+    std::vector<std::vector<iovec> > segments;
+    for (RecordId recordId : recordIds) {
+        segments.push_back(storage.pin(recordId).segments());
+    }
+    auto holdsRecord = [&segments, &record](size_t i) {
+        for (const iovec& segment : segments[i]) {
+            const uint8_t* data = static_cast<const uint8_t*>(segment.iov_base);
+            if (std::vector<uint8_t>(data, data + segment.iov_len) != std::vector<uint8_t>(segment.iov_len, 42)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // Set before a record is erased.
+    std::unique_ptr<std::atomic<bool>[]> erasing(new std::atomic<bool>[numRecords]());
+    std::atomic<bool> done(false);
+    std::thread writer([&]() {
+        std::vector<uint8_t> other(3000, 7);
+        for (size_t i = 0; i < numRecords; ++i) {
+            erasing[i] = true;
+            {
+                std::lock_guard<RecordStorage<1028> > lock(storage);
+                storage.erase(recordIds[i]);
+                // Reused right away unless a reader still holds them.
+                blocks.reclaimRetiredBlocks();
+                storage.add(other.data(), other.size());
+            }
+            std::this_thread::yield();
+        }
+        done = true;
+    });
+
+    // Readers go after exactly the records being erased. A record that was
+    // not being erased yet when the reader pinned the epoch keeps its blocks
+    // until the reader unpins, erased meanwhile or not.
+    std::atomic<size_t> numReused(0);
+    std::atomic<size_t> numChecked(0);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 2; ++t) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                for (size_t i = 0; i < numRecords; ++i) {
+                    EpochManager::Guard guard = epochs.pin();
+                    if (erasing[i]) continue;
+
+                    if (storage.getOptimistic(recordIds[i]) != record) {
+                        ++numReused;
+                    }
+                    std::this_thread::yield();
+                    if (!holdsRecord(i)) {
+                        ++numReused;
+                    }
+                    ++numChecked;
+                }
+            }
+        });
+    }
+    writer.join();
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    REQUIRE(numChecked > 0U);
+    REQUIRE(numReused == 0U);
+
+    // Without readers the blocks of erased records did get reused.
+    blocks.setEpochManager(nullptr);
+    size_t numOverwritten = 0;
+    for (size_t i = 0; i < numRecords; ++i) {
+        if (!holdsRecord(i)) {
+            ++numOverwritten;
+        }
+    }
+    REQUIRE(numOverwritten > 0U);
+}
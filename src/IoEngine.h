@@ -0,0 +1,455 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define BLOCKSTORAGE_HAVE_IO_URING 1
+#endif
+#endif
+
+// One read or write of a contiguous range of a file. result holds the number
+// of bytes transferred or a negative errno once the request completed.
+struct IoRequest
+{
+   enum class Kind
+   {
+      Read,
+      Write
+   };
+
+   Kind kind;
+   int fd;
+   void* buffer;
+   size_t size;
+   uint64_t offset;
+   int64_t result;
+};
+
+// Executes batches of IoRequests, keeping up to queueDepth() of them in flight
+// at the same time. submit() returns once every request of the batch has
+// completed.
+class IoEngine
+{
+public:
+   virtual ~IoEngine() {};
+
+   virtual void submit(IoRequest* requests, size_t count) = 0;
+   virtual size_t queueDepth() const = 0;
+};
+
+// Runs the requests with plain pread/pwrite on a pool of threads. This is the
+// fallback when io_uring is not available.
+class ThreadPoolIoEngine : public IoEngine
+{
+public:
+   explicit ThreadPoolIoEngine(size_t numThreads)
+      : m_mutex(),
+        m_workAvailable(),
+        m_workDone(),
+        m_requests(nullptr),
+        m_count(0),
+        m_next(0),
+        m_completed(0),
+        m_active(0),
+        m_generation(0),
+        m_stopping(false),
+        m_threads()
+   {
+      if (numThreads == 0) numThreads = 1;
+
+      for (size_t i = 0; i < numThreads; ++i) {
+         m_threads.emplace_back([this]() { run(); });
+      }
+   }
+
+   ThreadPoolIoEngine(const ThreadPoolIoEngine&) = delete;
+   ThreadPoolIoEngine& operator=(const ThreadPoolIoEngine&) = delete;
+
+   virtual ~ThreadPoolIoEngine()
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_stopping = true;
+      }
+      m_workAvailable.notify_all();
+      for (std::thread& thread : m_threads) {
+         thread.join();
+      }
+   }
+
+   virtual void submit(IoRequest* requests, size_t count) override
+   {
+      if (count == 0) return;
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_requests = requests;
+      m_count = count;
+      m_next.store(0);
+      m_completed = 0;
+      m_generation += 1;
+      m_workAvailable.notify_all();
+
+      // Waiting for the active workers as well makes sure none of them still
+      // holds on to this batch when the next one starts.
+      m_workDone.wait(lock, [this]() { return m_completed == m_count && m_active == 0; });
+      m_requests = nullptr;
+      m_count = 0;
+   }
+
+   virtual size_t queueDepth() const override
+   {
+      return m_threads.size();
+   }
+
+private:
+   std::mutex m_mutex;
+   std::condition_variable m_workAvailable;
+   std::condition_variable m_workDone;
+   IoRequest* m_requests;
+   size_t m_count;
+   std::atomic<size_t> m_next;
+   size_t m_completed;
+   size_t m_active;
+   uint64_t m_generation;
+   bool m_stopping;
+   std::vector<std::thread> m_threads;
+
+   void run()
+   {
+      uint64_t seenGeneration = 0;
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (true) {
+         m_workAvailable.wait(lock, [&]() { return m_stopping || (m_generation != seenGeneration && m_requests != nullptr); });
+         if (m_stopping) return;
+         seenGeneration = m_generation;
+         m_active += 1;
+
+         IoRequest* requests = m_requests;
+         size_t count = m_count;
+         lock.unlock();
+
+         size_t done = 0;
+         size_t index;
+         while ((index = m_next.fetch_add(1)) < count) {
+            execute(requests[index]);
+            ++done;
+         }
+
+         lock.lock();
+         m_completed += done;
+         m_active -= 1;
+         if (m_completed == m_count && m_active == 0) {
+            m_workDone.notify_all();
+         }
+      }
+   }
+
+   static void execute(IoRequest& request)
+   {
+      uint8_t* buffer = static_cast<uint8_t*>(request.buffer);
+      size_t transferred = 0;
+      while (transferred < request.size) {
+         ssize_t result = request.kind == IoRequest::Kind::Read
+            ? ::pread(request.fd, buffer + transferred, request.size - transferred, static_cast<off_t>(request.offset + transferred))
+            : ::pwrite(request.fd, buffer + transferred, request.size - transferred, static_cast<off_t>(request.offset + transferred));
+         if (result < 0) {
+            if (errno == EINTR) continue;
+            request.result = -errno;
+            return;
+         }
+         if (result == 0) break;
+         transferred += static_cast<size_t>(result);
+      }
+      request.result = static_cast<int64_t>(transferred);
+   }
+};
+
+#ifdef BLOCKSTORAGE_HAVE_IO_URING
+// Submits the requests through an io_uring instance so a whole batch is in
+// flight with a single system call. Talks to the kernel directly, liburing is
+// not needed.
+class IoUringEngine : public IoEngine
+{
+public:
+   explicit IoUringEngine(unsigned entries)
+      : m_ringFd(-1),
+        m_entries(0),
+        m_ring(nullptr),
+        m_ringSize(0),
+        m_completionRing(nullptr),
+        m_completionRingSize(0),
+        m_submissionEntries(nullptr),
+        m_submissionEntriesSize(0),
+        m_iovecs(),
+        m_generation(0)
+   {
+      io_uring_params parameters;
+      std::memset(&parameters, 0, sizeof(parameters));
+      m_ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &parameters));
+      if (m_ringFd < 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to set up io_uring");
+      }
+
+      try {
+         mapRings(parameters);
+      } catch (...) {
+         unmapRings();
+         ::close(m_ringFd);
+         throw;
+      }
+
+      m_entries = parameters.sq_entries;
+   }
+
+   IoUringEngine(const IoUringEngine&) = delete;
+   IoUringEngine& operator=(const IoUringEngine&) = delete;
+
+   virtual ~IoUringEngine()
+   {
+      unmapRings();
+      ::close(m_ringFd);
+   }
+
+   virtual void submit(IoRequest* requests, size_t count) override
+   {
+      // The kernel may read the iovec of a request until it completes, so each
+      // request gets its own for the whole batch.
+      if (m_iovecs.size() < count) {
+         m_iovecs.resize(count);
+      }
+
+      m_generation += 1;
+      size_t submitted = 0;
+      size_t completed = 0;
+      size_t inFlight = 0;
+      unsigned pending = 0;
+      while (completed < count) {
+         while (submitted < count && inFlight < m_entries) {
+            queue(requests[submitted], submitted);
+            ++submitted;
+            ++inFlight;
+            ++pending;
+         }
+
+         long consumed = ::syscall(__NR_io_uring_enter, m_ringFd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+         if (consumed < 0) {
+            if (errno == EINTR) continue;
+            const int error = errno;
+            abandon(requests, count, completed, inFlight);
+            throw std::system_error(error, std::generic_category(), "Failed to submit to io_uring");
+         }
+         pending -= static_cast<unsigned>(consumed);
+         reap(requests, count, completed, inFlight);
+      }
+
+      // A short transfer that is not the end of the file is finished with
+      // plain system calls, it is rare enough not to be worth another round
+      // trip through the ring.
+      for (size_t i = 0; i < count; ++i) {
+         finishShortTransfer(requests[i]);
+      }
+   }
+
+   virtual size_t queueDepth() const override
+   {
+      return m_entries;
+   }
+
+private:
+   int m_ringFd;
+   unsigned m_entries;
+
+   void* m_ring;
+   size_t m_ringSize;
+   void* m_completionRing;
+   size_t m_completionRingSize;
+   io_uring_sqe* m_submissionEntries;
+   size_t m_submissionEntriesSize;
+
+   unsigned* m_submissionHead;
+   unsigned* m_submissionTail;
+   unsigned* m_submissionMask;
+   unsigned* m_submissionArray;
+   unsigned* m_completionHead;
+   unsigned* m_completionTail;
+   unsigned* m_completionMask;
+   io_uring_cqe* m_completions;
+
+   std::vector<iovec> m_iovecs;
+   // Counts the batches, the low 32 bits go into the upper half of the
+   // user_data of every entry so completions of an abandoned batch are told
+   // apart from the ones of the current batch.
+   uint64_t m_generation;
+
+   static const unsigned kIndexBits = 32;
+
+   // Takes the completions of the current batch off the ring. Completions
+   // left over from an earlier batch are dropped.
+   void reap(IoRequest* requests, size_t count, size_t& completed, size_t& inFlight)
+   {
+      unsigned head = *m_completionHead;
+      while (head != __atomic_load_n(m_completionTail, __ATOMIC_ACQUIRE)) {
+         const io_uring_cqe& completion = m_completions[head & *m_completionMask];
+         const uint64_t index = completion.user_data & ((uint64_t(1) << kIndexBits) - 1);
+         if ((completion.user_data >> kIndexBits) == (m_generation & 0xFFFFFFFF) && index < count) {
+            requests[index].result = completion.res;
+            ++completed;
+            --inFlight;
+         }
+         ++head;
+      }
+      __atomic_store_n(m_completionHead, head, __ATOMIC_RELEASE);
+   }
+
+   // Called when io_uring_enter failed. Entries the kernel has not consumed
+   // yet are taken back out of the submission ring. The ones it did consume
+   // may still read or write the buffers of the batch, so they are waited for
+   // before the caller gets the buffers back.
+   void abandon(IoRequest* requests, size_t count, size_t& completed, size_t& inFlight)
+   {
+      const unsigned tail = *m_submissionTail;
+      const unsigned unconsumed = tail - __atomic_load_n(m_submissionHead, __ATOMIC_ACQUIRE);
+      __atomic_store_n(m_submissionTail, tail - unconsumed, __ATOMIC_RELEASE);
+      inFlight -= unconsumed;
+
+      while (inFlight > 0) {
+         long result = ::syscall(__NR_io_uring_enter, m_ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+         // Should waiting fail as well, the generation keeps the late
+         // completions out of the next batch.
+         if (result < 0 && errno != EINTR) return;
+         reap(requests, count, completed, inFlight);
+      }
+   }
+
+   void mapRings(const io_uring_params& parameters)
+   {
+      m_ringSize = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+      m_completionRingSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof(io_uring_cqe);
+      bool singleMapping = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (singleMapping) {
+         m_ringSize = std::max(m_ringSize, m_completionRingSize);
+      }
+
+      m_ring = mapRing(m_ringSize, IORING_OFF_SQ_RING);
+      if (singleMapping) {
+         m_completionRing = m_ring;
+         m_completionRingSize = 0;
+      } else {
+         m_completionRing = mapRing(m_completionRingSize, IORING_OFF_CQ_RING);
+      }
+
+      m_submissionEntriesSize = parameters.sq_entries * sizeof(io_uring_sqe);
+      m_submissionEntries = static_cast<io_uring_sqe*>(mapRing(m_submissionEntriesSize, IORING_OFF_SQES));
+
+      uint8_t* ring = static_cast<uint8_t*>(m_ring);
+      m_submissionHead = reinterpret_cast<unsigned*>(ring + parameters.sq_off.head);
+      m_submissionTail = reinterpret_cast<unsigned*>(ring + parameters.sq_off.tail);
+      m_submissionMask = reinterpret_cast<unsigned*>(ring + parameters.sq_off.ring_mask);
+      m_submissionArray = reinterpret_cast<unsigned*>(ring + parameters.sq_off.array);
+
+      uint8_t* completionRing = static_cast<uint8_t*>(m_completionRing);
+      m_completionHead = reinterpret_cast<unsigned*>(completionRing + parameters.cq_off.head);
+      m_completionTail = reinterpret_cast<unsigned*>(completionRing + parameters.cq_off.tail);
+      m_completionMask = reinterpret_cast<unsigned*>(completionRing + parameters.cq_off.ring_mask);
+      m_completions = reinterpret_cast<io_uring_cqe*>(completionRing + parameters.cq_off.cqes);
+   }
+
+   void* mapRing(size_t size, uint64_t offset)
+   {
+      void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, static_cast<off_t>(offset));
+      if (address == MAP_FAILED) {
+         throw std::system_error(errno, std::generic_category(), "Failed to map io_uring");
+      }
+      return address;
+   }
+
+   void unmapRings()
+   {
+      if (m_submissionEntries != nullptr) {
+         ::munmap(m_submissionEntries, m_submissionEntriesSize);
+      }
+      if (m_completionRing != nullptr && m_completionRing != m_ring) {
+         ::munmap(m_completionRing, m_completionRingSize);
+      }
+      if (m_ring != nullptr) {
+         ::munmap(m_ring, m_ringSize);
+      }
+   }
+
+   void queue(IoRequest& request, size_t index)
+   {
+      unsigned tail = *m_submissionTail;
+      unsigned slot = tail & *m_submissionMask;
+
+      iovec& vector = m_iovecs[index];
+      vector.iov_base = request.buffer;
+      vector.iov_len = request.size;
+
+      io_uring_sqe& entry = m_submissionEntries[slot];
+      std::memset(&entry, 0, sizeof(entry));
+      entry.opcode = request.kind == IoRequest::Kind::Read ? IORING_OP_READV : IORING_OP_WRITEV;
+      entry.fd = request.fd;
+      entry.addr = reinterpret_cast<uint64_t>(&vector);
+      entry.len = 1;
+      entry.off = request.offset;
+      entry.user_data = ((m_generation & 0xFFFFFFFF) << kIndexBits) | index;
+
+      m_submissionArray[slot] = slot;
+      __atomic_store_n(m_submissionTail, tail + 1, __ATOMIC_RELEASE);
+   }
+
+   static void finishShortTransfer(IoRequest& request)
+   {
+      if (request.result < 0) return;
+
+      uint8_t* buffer = static_cast<uint8_t*>(request.buffer);
+      size_t transferred = static_cast<size_t>(request.result);
+      while (transferred < request.size) {
+         ssize_t result = request.kind == IoRequest::Kind::Read
+            ? ::pread(request.fd, buffer + transferred, request.size - transferred, static_cast<off_t>(request.offset + transferred))
+            : ::pwrite(request.fd, buffer + transferred, request.size - transferred, static_cast<off_t>(request.offset + transferred));
+         if (result < 0) {
+            if (errno == EINTR) continue;
+            request.result = -errno;
+            return;
+         }
+         if (result == 0) break;
+         transferred += static_cast<size_t>(result);
+      }
+      request.result = static_cast<int64_t>(transferred);
+   }
+};
+#endif
+
+// Returns an io_uring engine when the kernel supports it and a pread thread
+// pool otherwise.
+inline std::unique_ptr<IoEngine> makeIoEngine(size_t queueDepth)
+{
+   if (queueDepth == 0) queueDepth = 1;
+
+#ifdef BLOCKSTORAGE_HAVE_IO_URING
+   try {
+      return std::unique_ptr<IoEngine>(new IoUringEngine(static_cast<unsigned>(queueDepth)));
+   } catch (const std::system_error&) {
+      // io_uring is missing or not allowed, fall through to the thread pool.
+   }
+#endif
+
+   return std::unique_ptr<IoEngine>(new ThreadPoolIoEngine(queueDepth));
+}
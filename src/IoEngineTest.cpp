@@ -0,0 +1,63 @@
+#include <catch.hpp>
+
+#include "IoEngine.h"
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+static void writeAndReadBack(IoEngine& engine)
+{
+   char path[] = "/tmp/IoEngineTest.XXXXXX";
+   int fd = mkstemp(path);
+   REQUIRE(fd >= 0);
+
+   const size_t pageSize = 4096;
+   const size_t numPages = 100;
+   std::vector<uint8_t> written(pageSize * numPages);
+   for (size_t i = 0; i < written.size(); ++i) {
+      written[i] = static_cast<uint8_t>(i / pageSize + i);
+   }
+
+   std::vector<IoRequest> requests(numPages);
+   for (size_t page = 0; page < numPages; ++page) {
+      requests[page] = IoRequest{IoRequest::Kind::Write, fd, written.data() + page * pageSize, pageSize, page * pageSize, 0};
+   }
+   engine.submit(requests.data(), requests.size());
+   for (const IoRequest& request : requests) {
+      REQUIRE(request.result == static_cast<int64_t>(pageSize));
+   }
+
+   // Reading in reverse order and one page past the end of the file.
+   std::vector<uint8_t> read(pageSize * (numPages + 1), 0xFF);
+   requests.resize(numPages + 1);
+   for (size_t page = 0; page <= numPages; ++page) {
+      size_t filePage = numPages - page;
+      requests[page] = IoRequest{IoRequest::Kind::Read, fd, read.data() + filePage * pageSize, pageSize, filePage * pageSize, 0};
+   }
+   engine.submit(requests.data(), requests.size());
+
+   REQUIRE(requests[0].result == 0);
+   for (size_t page = 1; page <= numPages; ++page) {
+      REQUIRE(requests[page].result == static_cast<int64_t>(pageSize));
+   }
+   REQUIRE(std::equal(written.begin(), written.end(), read.begin()));
+
+   close(fd);
+   unlink(path);
+}
+
+TEST_CASE("Submit batches to ThreadPoolIoEngine", "[IoEngine]") {
+    ThreadPoolIoEngine engine(4);
+    REQUIRE(engine.queueDepth() == 4U);
+    writeAndReadBack(engine);
+    writeAndReadBack(engine);
+}
+
+TEST_CASE("Submit batches to default IoEngine", "[IoEngine]") {
+    std::unique_ptr<IoEngine> engine = makeIoEngine(8);
+    REQUIRE(engine->queueDepth() >= 8U);
+    writeAndReadBack(*engine);
+    writeAndReadBack(*engine);
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+enum class LatchMode
+{
+   Shared,
+   Exclusive
+};
+
+// Striped latches keyed by block id, so writers of disjoint records do not
+// serialize on the lock of the ISharedMemory. A block id maps to one of a
+// fixed number of stripes, blocks sharing a stripe share its latch.
+//
+// Latch ordering, to stay free of deadlocks:
+//  1. The storage lock comes first. Structural changes (creating, freeing or
+//     moving blocks, growing or compacting the memory) hold it exclusively
+//     and need no latches: nobody else holds the lock, shared or not, so
+//     nobody holds a latch either. Erasing, replacing, appending to or
+//     resizing a record are structural changes. Everything else holds the
+//     lock shared, which keeps the chains of records and VectorViews from
+//     changing underneath.
+//  2. Stripes are taken in ascending stripe index, all the stripes of an
+//     operation at once through a LatchGuard. A chain is walked under the
+//     shared storage lock first to collect its block ids, then latched.
+//  3. Exclusive latches are taken all or nothing: a writer that finds one of
+//     its stripes taken gives back the ones it has and waits for that stripe
+//     alone. Writers never wait while they hold a latch, so a reader may
+//     latch one record after the other, as pins of the same thread do,
+//     without deadlocking with them.
+//
+// The latches live in the memory of the process, other processes sharing the
+// storage only see the storage lock.
+class LatchTable
+{
+public:
+   static const size_t kDefaultNumStripes = 64;
+
+   explicit LatchTable(size_t numStripes = kDefaultNumStripes)
+      : m_numStripes(roundUpToPowerOfTwo(std::max<size_t>(1, numStripes))),
+        m_stripes(new Stripe[m_numStripes])
+   {
+   }
+
+   LatchTable(const LatchTable&) = delete;
+   LatchTable& operator=(const LatchTable&) = delete;
+
+   size_t numStripes() const
+   {
+      return m_numStripes;
+   }
+
+   // Ids of neighbouring blocks are spread over the stripes, so the blocks of
+   // one extent rarely share a latch with each other.
+   size_t stripeOf(uint64_t blockId) const
+   {
+      // TODO: numeric_cast
+      return static_cast<size_t>((blockId * 0x9E3779B97F4A7C15ULL) >> 32) & (m_numStripes - 1);
+   }
+
+   void lockStripe(size_t stripe, LatchMode mode)
+   {
+      Stripe& s = m_stripes[stripe];
+      bool acquired = mode == LatchMode::Exclusive ? s.mutex.try_lock() : s.mutex.try_lock_shared();
+      if (!acquired) {
+         s.numContended.fetch_add(1, std::memory_order_relaxed);
+         if (mode == LatchMode::Exclusive) {
+            s.mutex.lock();
+         } else {
+            s.mutex.lock_shared();
+         }
+      }
+      s.numAcquisitions.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   bool tryLockStripe(size_t stripe, LatchMode mode)
+   {
+      Stripe& s = m_stripes[stripe];
+      bool acquired = mode == LatchMode::Exclusive ? s.mutex.try_lock() : s.mutex.try_lock_shared();
+      if (acquired) {
+         s.numAcquisitions.fetch_add(1, std::memory_order_relaxed);
+      }
+      return acquired;
+   }
+
+   // Waits until nobody holds the latch of the stripe, without taking it.
+   void waitForStripe(size_t stripe)
+   {
+      Stripe& s = m_stripes[stripe];
+      s.numContended.fetch_add(1, std::memory_order_relaxed);
+      s.mutex.lock();
+      s.mutex.unlock();
+   }
+
+   void unlockStripe(size_t stripe, LatchMode mode)
+   {
+      if (mode == LatchMode::Exclusive) {
+         m_stripes[stripe].mutex.unlock();
+      } else {
+         m_stripes[stripe].mutex.unlock_shared();
+      }
+   }
+
+   // Number of times the latch of the stripe was taken.
+   uint64_t numAcquisitions(size_t stripe) const
+   {
+      return m_stripes[stripe].numAcquisitions.load(std::memory_order_relaxed);
+   }
+
+   // Number of times taking the latch of the stripe had to wait.
+   uint64_t numContended(size_t stripe) const
+   {
+      return m_stripes[stripe].numContended.load(std::memory_order_relaxed);
+   }
+
+   uint64_t totalContended() const
+   {
+      uint64_t total = 0;
+      for (size_t stripe = 0; stripe < m_numStripes; ++stripe) {
+         total += numContended(stripe);
+      }
+      return total;
+   }
+
+   void resetCounters()
+   {
+      for (size_t stripe = 0; stripe < m_numStripes; ++stripe) {
+         m_stripes[stripe].numAcquisitions.store(0, std::memory_order_relaxed);
+         m_stripes[stripe].numContended.store(0, std::memory_order_relaxed);
+      }
+   }
+
+private:
+   // Aligned so neighbouring stripes do not share a cache line.
+   struct alignas(64) Stripe
+   {
+      std::shared_timed_mutex mutex;
+      std::atomic<uint64_t> numAcquisitions{0};
+      std::atomic<uint64_t> numContended{0};
+   };
+
+   size_t m_numStripes;
+   std::unique_ptr<Stripe[]> m_stripes;
+
+   static size_t roundUpToPowerOfTwo(size_t value)
+   {
+      size_t result = 1;
+      while (result < value) {
+         result <<= 1;
+      }
+      return result;
+   }
+};
+
+// Holds the latches of a set of blocks, taken in ascending stripe order and
+// released when the guard goes away.
+class LatchGuard
+{
+public:
+   LatchGuard(LatchTable& latches, const std::vector<uint64_t>& blockIds, LatchMode mode)
+      : m_latches(&latches),
+        m_mode(mode),
+        m_stripes()
+   {
+      m_stripes.reserve(blockIds.size());
+      for (uint64_t blockId : blockIds) {
+         m_stripes.push_back(latches.stripeOf(blockId));
+      }
+      std::sort(m_stripes.begin(), m_stripes.end());
+      m_stripes.erase(std::unique(m_stripes.begin(), m_stripes.end()), m_stripes.end());
+
+      if (mode == LatchMode::Shared || m_stripes.size() == 1) {
+         for (size_t stripe : m_stripes) {
+            latches.lockStripe(stripe, mode);
+         }
+         return;
+      }
+
+      // All or nothing, see the latch ordering of LatchTable.
+      while (true) {
+         size_t numLocked = 0;
+         while (numLocked < m_stripes.size() && latches.tryLockStripe(m_stripes[numLocked], mode)) {
+            ++numLocked;
+         }
+         if (numLocked == m_stripes.size()) return;
+
+         for (size_t i = numLocked; i > 0; --i) {
+            latches.unlockStripe(m_stripes[i - 1], mode);
+         }
+         latches.waitForStripe(m_stripes[numLocked]);
+      }
+   }
+
+   LatchGuard(LatchGuard&& other)
+      : m_latches(other.m_latches),
+        m_mode(other.m_mode),
+        m_stripes(std::move(other.m_stripes))
+   {
+      other.m_stripes.clear();
+   }
+
+   LatchGuard(const LatchGuard&) = delete;
+   LatchGuard& operator=(const LatchGuard&) = delete;
+   LatchGuard& operator=(LatchGuard&&) = delete;
+
+   ~LatchGuard()
+   {
+      for (auto it = m_stripes.rbegin(); it != m_stripes.rend(); ++it) {
+         m_latches->unlockStripe(*it, m_mode);
+      }
+   }
+
+   // Stripes held, in the order they were taken.
+   const std::vector<size_t>& stripes() const
+   {
+      return m_stripes;
+   }
+
+private:
+   LatchTable* m_latches;
+   LatchMode m_mode;
+   std::vector<size_t> m_stripes;
+};
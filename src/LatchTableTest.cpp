@@ -0,0 +1,112 @@
+#include <catch.hpp>
+
+#include "BlockStorage.h"
+#include "LatchTable.h"
+#include "RecordStorage.h"
+#include "ReservedMemory.h"
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("LatchGuard takes stripes in ascending order", "[LatchTable]") {
+    LatchTable latches(10);
+    REQUIRE(latches.numStripes() == 16U);
+
+    std::vector<uint64_t> blockIds = {900, 3, 42, 3, 77, 1000};
+    {
+        LatchGuard guard(latches, blockIds, LatchMode::Exclusive);
+        const std::vector<size_t>& stripes = guard.stripes();
+        REQUIRE(std::is_sorted(stripes.begin(), stripes.end()));
+        REQUIRE(std::adjacent_find(stripes.begin(), stripes.end()) == stripes.end());
+        for (uint64_t blockId : blockIds) {
+            REQUIRE(std::find(stripes.begin(), stripes.end(), latches.stripeOf(blockId)) != stripes.end());
+        }
+    }
+
+    // Released again, so taking them once more does not contend.
+    LatchGuard guard(latches, blockIds, LatchMode::Shared);
+    LatchGuard other(latches, blockIds, LatchMode::Shared);
+    REQUIRE(latches.totalContended() == 0U);
+}
+
+TEST_CASE("LatchTable counts contention per stripe", "[LatchTable]") {
+    LatchTable latches(4);
+    const size_t stripe = latches.stripeOf(7);
+
+    std::atomic<bool> started(false);
+    std::thread waiter;
+    {
+        LatchGuard guard(latches, {7}, LatchMode::Exclusive);
+        waiter = std::thread([&latches, &started]() {
+            started = true;
+            LatchGuard guard(latches, {7}, LatchMode::Shared);
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        while (latches.numContended(stripe) == 0) {
+            std::this_thread::yield();
+        }
+    }
+    waiter.join();
+
+    REQUIRE(latches.numContended(stripe) == 1U);
+    REQUIRE(latches.numAcquisitions(stripe) == 2U);
+    latches.resetCounters();
+    REQUIRE(latches.numAcquisitions(stripe) == 0U);
+}
+
+TEST_CASE("Update disjoint Records in parallel under latches", "[LatchTable]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(std::make_unique<ReservedMemory>(64 << 20)),
+        RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    const size_t numThreads = 4;
+    std::vector<std::vector<RecordId> > recordIds(numThreads);
+    for (size_t t = 0; t < numThreads; ++t) {
+        for (size_t i = 0; i < 50; ++i) {
+            std::vector<uint8_t> data(i % 2 == 0 ? 8 : 3000, 0);
+            recordIds[t].push_back(storage.add(data.data(), data.size()));
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&storage, &recordIds, t]() {
+            for (size_t round = 1; round <= 100; ++round) {
+                for (RecordId recordId : recordIds[t]) {
+                    std::shared_lock<RecordStorage<1028> > lock(storage);
+                    LatchGuard latch = storage.latch(recordId, LatchMode::Exclusive);
+                    // Records of other threads may share the page, the latch
+                    // keeps the read-modify-write whole.
+                    std::vector<uint8_t> data = storage.get(recordId);
+                    for (uint8_t& byte : data) {
+                        byte = static_cast<uint8_t>(byte + 1);
+                    }
+                    storage.update(recordId, 0, data.data(), data.size());
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t t = 0; t < numThreads; ++t) {
+        for (size_t i = 0; i < recordIds[t].size(); ++i) {
+            std::vector<uint8_t> data = storage.get(recordIds[t][i]);
+            REQUIRE(data == std::vector<uint8_t>(i % 2 == 0 ? 8 : 3000, 100));
+        }
+    }
+
+    // Updating only part of a record spanning several blocks.
+    std::vector<uint8_t> patch(1500, 7);
+    storage.update(recordIds[0][1], 1000, patch.data(), patch.size());
+    std::vector<uint8_t> data = storage.get(recordIds[0][1]);
+    REQUIRE(data[999] == 100);
+    REQUIRE(data[1000] == 7);
+    REQUIRE(data[2499] == 7);
+    REQUIRE(data[2500] == 100);
+}
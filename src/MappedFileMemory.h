@@ -0,0 +1,232 @@
+#pragma once
+
+#include "BlockStorage.h"
+
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ISharedMemory backed by a memory mapped file. The mapping is shared with the
+// file, so a BlockStorage created on top of it survives the process and can be
+// reopened later through the "existing header" path of the BlockStorage
+// constructor.
+//
+// When a reserved size is given the mapping lives inside a range of address
+// space reserved up front and grows in place, so the base address never
+// changes the same way it does for ReservedMemory. Without it growing the file
+// remaps it and may move the base address.
+class MappedFileMemory : public ISharedMemory
+{
+public:
+   explicit MappedFileMemory(const std::string& path, size_t reservedSizeInBytes = 0)
+      : m_mutex(),
+        m_path(path),
+        m_fd(-1),
+        m_reservation(nullptr),
+        m_reservedSize(reservedSizeInBytes),
+        m_address(nullptr),
+        m_size(0)
+   {
+      m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (m_fd < 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to open " + path);
+      }
+
+      struct stat fileStatus;
+      if (::fstat(m_fd, &fileStatus) != 0) {
+         int error = errno;
+         ::close(m_fd);
+         throw std::system_error(error, std::generic_category(), "Failed to stat " + path);
+      }
+
+      if (m_reservedSize > 0) {
+         void* reservation = ::mmap(nullptr, m_reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+         if (reservation == MAP_FAILED) {
+            int error = errno;
+            ::close(m_fd);
+            throw std::system_error(error, std::generic_category(), "Failed to reserve address space for " + path);
+         }
+         m_reservation = reservation;
+      }
+
+      try {
+         map(static_cast<size_t>(fileStatus.st_size));
+      } catch (...) {
+         if (m_reservation != nullptr) {
+            ::munmap(m_reservation, m_reservedSize);
+         }
+         ::close(m_fd);
+         throw;
+      }
+   }
+
+   MappedFileMemory(const MappedFileMemory&) = delete;
+   MappedFileMemory& operator=(const MappedFileMemory&) = delete;
+
+   virtual ~MappedFileMemory()
+   {
+      if (m_reservation != nullptr) {
+         ::munmap(m_reservation, m_reservedSize);
+      } else {
+         unmap();
+      }
+      ::close(m_fd);
+   }
+
+   virtual void lock() override
+   {
+      m_mutex.lock();
+   }
+
+   virtual void unlock() override
+   {
+      m_mutex.unlock();
+   }
+
+   virtual void lock_shared() override
+   {
+      m_mutex.lock_shared();
+   }
+
+   virtual void unlock_shared() override
+   {
+      m_mutex.unlock_shared();
+   }
+
+   virtual void* get() override
+   {
+      return m_address;
+   }
+
+   virtual size_t size() override
+   {
+      return m_size;
+   }
+
+   virtual void realloc(size_t requestedSize) override
+   {
+      if (requestedSize <= size()) return;
+
+      if (m_reservation != nullptr && requestedSize > m_reservedSize) {
+         throw std::length_error("Requested size exceeds the reserved address space of " + m_path);
+      }
+
+      if (::ftruncate(m_fd, static_cast<off_t>(requestedSize)) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to grow " + m_path);
+      }
+
+      if (m_reservation == nullptr) {
+         unmap();
+      }
+      map(requestedSize);
+   }
+
+   // Shrinks the file to requestedSize. Inside a reservation the pages beyond
+   // it are turned back into reserved address space.
+   virtual void truncate(size_t requestedSize) override
+   {
+      if (requestedSize >= size()) return;
+
+      if (m_reservation != nullptr) {
+         size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+         size_t mappedSize = ((requestedSize + pageSize - 1) / pageSize) * pageSize;
+         size_t oldMappedSize = ((m_size + pageSize - 1) / pageSize) * pageSize;
+         if (mappedSize < oldMappedSize) {
+            void* address = ::mmap(static_cast<uint8_t*>(m_reservation) + mappedSize, oldMappedSize - mappedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            if (address == MAP_FAILED) {
+               throw std::system_error(errno, std::generic_category(), "Failed to unmap the end of " + m_path);
+            }
+         }
+      } else {
+         unmap();
+      }
+
+      if (::ftruncate(m_fd, static_cast<off_t>(requestedSize)) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to shrink " + m_path);
+      }
+
+      if (m_reservation != nullptr) {
+         m_size = requestedSize;
+         if (m_size == 0) {
+            m_address = nullptr;
+         }
+      } else {
+         map(requestedSize);
+      }
+   }
+
+   // Punches a hole into the file, which frees the disk blocks and drops the
+   // pages from the page cache and the mapping. File systems without hole
+   // punching keep the pages.
+   virtual void release(size_t offset, size_t size) override
+   {
+      if (::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size)) != 0) {
+         if (errno == EOPNOTSUPP) return;
+         throw std::system_error(errno, std::generic_category(), "Failed to punch a hole into " + m_path);
+      }
+   }
+
+   // Flushes dirty pages of the mapping back to the file. Without calling this
+   // the kernel writes them back on its own schedule.
+   void sync()
+   {
+      if (m_address == nullptr) return;
+
+      if (::msync(m_address, m_size, MS_SYNC) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to sync " + m_path);
+      }
+   }
+
+   const std::string& path() const
+   {
+      return m_path;
+   }
+
+private:
+   mutable std::shared_timed_mutex m_mutex;
+   std::string m_path;
+   int m_fd;
+   void* m_reservation;
+   size_t m_reservedSize;
+   void* m_address;
+   size_t m_size;
+
+   void map(size_t size)
+   {
+      // mmap does not allow empty mappings, an empty file is simply not mapped
+      // until the first realloc.
+      if (size == 0) return;
+
+      if (m_reservation != nullptr && size > m_reservedSize) {
+         throw std::length_error(m_path + " is larger than the reserved address space");
+      }
+
+      // Inside a reservation the new mapping replaces the old one at the same
+      // address, pages already mapped keep their place.
+      void* address = m_reservation != nullptr
+         ? ::mmap(m_reservation, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_fd, 0)
+         : ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+      if (address == MAP_FAILED) {
+         throw std::system_error(errno, std::generic_category(), "Failed to map " + m_path);
+      }
+
+      m_address = address;
+      m_size = size;
+   }
+
+   void unmap()
+   {
+      if (m_address == nullptr) return;
+
+      ::munmap(m_address, m_size);
+      m_address = nullptr;
+      m_size = 0;
+   }
+};
@@ -0,0 +1,159 @@
+#include <catch.hpp>
+
+#include "BlockStorage.h"
+#include "MappedFileMemory.h"
+#include "RecordStorage.h"
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::string temporaryFilePath()
+{
+   char path[] = "/tmp/BlockStorageTest.XXXXXX";
+   int fd = mkstemp(path);
+   REQUIRE(fd >= 0);
+   close(fd);
+   unlink(path);
+   return path;
+}
+
+TEST_CASE("Create MappedFileMemory", "[MappedFileMemory]") {
+    std::string path = temporaryFilePath();
+    {
+        MappedFileMemory memory(path);
+        REQUIRE(memory.size() == 0U);
+        REQUIRE(memory.get() == nullptr);
+
+        memory.realloc(100);
+        REQUIRE(memory.size() == 100U);
+        REQUIRE(memory.get() != nullptr);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Reopen BlockStorage from MappedFileMemory", "[MappedFileMemory]") {
+    std::string path = temporaryFilePath();
+    std::string testString = "TestString0";
+    {
+        BlockStorage<1028> storage(std::make_unique<MappedFileMemory>(path));
+        for (size_t index = 0; index < 10; ++index) {
+            storage.create();
+        }
+        Block<1028> block = storage.at(5);
+        block.set(reinterpret_cast<const uint8_t*>(testString.c_str()), testString.size() + 1);
+    }
+
+    {
+        BlockStorage<1028> storage(std::make_unique<MappedFileMemory>(path));
+        REQUIRE(storage.size() == 10U);
+
+        Block<1028> block = storage.at(5);
+        REQUIRE(block.id() == 5U);
+        REQUIRE(block.size() == testString.size() + 1);
+        REQUIRE(std::string(reinterpret_cast<const char*>(block.data())) == testString);
+    }
+
+    REQUIRE_THROWS(BlockStorage<2048>(std::make_unique<MappedFileMemory>(path)));
+    unlink(path.c_str());
+}
+
+TEST_CASE("Reopen RecordStorage from MappedFileMemory", "[MappedFileMemory]") {
+    std::string path = temporaryFilePath();
+    std::vector<RecordId> recordIds;
+    {
+        RecordStorage<1028> storage(
+            std::make_unique<BlockStorage<1028> >(
+                std::make_unique<MappedFileMemory>(path)));
+
+        for (size_t i = 0; i < 20; ++i) {
+            std::string testString = "TestString" + std::to_string(i);
+            recordIds.push_back(storage.add(
+                reinterpret_cast<const uint8_t*>(testString.c_str()),
+                sizeof(char) * (testString.size() + 1 /* null terminator */)));
+        }
+    }
+
+    {
+        RecordStorage<1028> storage(
+            std::make_unique<BlockStorage<1028> >(
+                std::make_unique<MappedFileMemory>(path)));
+        REQUIRE(storage.size() == recordIds.size());
+
+        for (size_t i = 0; i < recordIds.size(); ++i) {
+            std::vector<uint8_t> data = storage.get(recordIds[i]);
+            REQUIRE(std::string(reinterpret_cast<const char*>(data.data())) == "TestString" + std::to_string(i));
+        }
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Grow MappedFileMemory in place", "[MappedFileMemory]") {
+    std::string path = temporaryFilePath();
+    {
+        MappedFileMemory memory(path, 1 << 20);
+        memory.realloc(100);
+        void* address = memory.get();
+        static_cast<uint8_t*>(address)[10] = 42;
+
+        memory.realloc(1 << 20);
+        REQUIRE(memory.get() == address);
+        REQUIRE(static_cast<uint8_t*>(memory.get())[10] == 42);
+
+        REQUIRE_THROWS_AS(memory.realloc((1 << 20) + 1), std::length_error);
+    }
+    unlink(path.c_str());
+}
+
+TEST_CASE("Truncate MappedFileMemory", "[MappedFileMemory]") {
+    std::string path = temporaryFilePath();
+    for (size_t reservedSize : {size_t(0), size_t(1 << 20)}) {
+        {
+            MappedFileMemory memory(path, reservedSize);
+            memory.realloc(1 << 16);
+            static_cast<uint8_t*>(memory.get())[10] = 42;
+
+            memory.truncate(100);
+            REQUIRE(memory.size() == 100U);
+            REQUIRE(static_cast<uint8_t*>(memory.get())[10] == 42);
+
+            struct stat fileStatus;
+            REQUIRE(stat(path.c_str(), &fileStatus) == 0);
+            REQUIRE(fileStatus.st_size == 100);
+
+            memory.realloc(1 << 16);
+            REQUIRE(static_cast<uint8_t*>(memory.get())[10] == 42);
+            REQUIRE(static_cast<uint8_t*>(memory.get())[(1 << 16) - 1] == 0);
+        }
+        unlink(path.c_str());
+    }
+}
+
+TEST_CASE("Punch holes for freed Blocks in MappedFileMemory", "[MappedFileMemory]") {
+    std::string path = temporaryFilePath();
+    {
+        BlockStorage<4096> storage(std::make_unique<MappedFileMemory>(path), BlockLayout::Aligned);
+        storage.setReleaseFreedPages(true);
+
+        std::vector<uint8_t> data(4096 - Block<4096>::MIN_BLOCK_SIZE, 0xAB);
+        std::vector<Block<4096> > blocks = storage.createN(1000);
+        for (Block<4096>& block : blocks) {
+            block.set(data.data(), data.size());
+        }
+
+        struct stat before;
+        REQUIRE(stat(path.c_str(), &before) == 0);
+
+        for (Block<4096>& block : blocks) {
+            storage.free(block);
+        }
+
+        struct stat after;
+        REQUIRE(stat(path.c_str(), &after) == 0);
+        // Hole punching is not supported everywhere, it must not grow though.
+        REQUIRE(after.st_blocks <= before.st_blocks);
+    }
+    unlink(path.c_str());
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "BlockStorage.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ISharedMemory backed by a POSIX shared memory object (shm_open). Several
+// processes can open the same name and share one BlockStorage.
+//
+// The segment starts with a control page that holds a robust, process shared
+// mutex and the current size of the data area. The control page is mapped on
+// its own so the mutex never moves while a process holds it, which the kernel
+// needs for robust mutex recovery. The data area is mapped separately and
+// remapped by lock() whenever another process has grown the segment.
+class PosixSharedMemory : public ISharedMemory
+{
+public:
+   explicit PosixSharedMemory(const std::string& name)
+      : m_name(name),
+        m_fd(-1),
+        m_control(nullptr),
+        m_address(nullptr),
+        m_size(0)
+   {
+      bool created = true;
+      m_fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (m_fd < 0 && errno == EEXIST) {
+         created = false;
+         m_fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0644);
+      }
+
+      if (m_fd < 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to open shared memory " + name);
+      }
+
+      try {
+         if (created) {
+            initializeControl();
+         } else {
+            attachControl();
+         }
+         remap();
+      } catch (...) {
+         if (m_control != nullptr) {
+            ::munmap(m_control, controlSize());
+         }
+         ::close(m_fd);
+         throw;
+      }
+   }
+
+   PosixSharedMemory(const PosixSharedMemory&) = delete;
+   PosixSharedMemory& operator=(const PosixSharedMemory&) = delete;
+
+   virtual ~PosixSharedMemory()
+   {
+      unmap();
+      ::munmap(m_control, controlSize());
+      ::close(m_fd);
+   }
+
+   // Removes the name of the shared memory object. Processes that still have
+   // it open keep working on the existing segment.
+   static void remove(const std::string& name)
+   {
+      ::shm_unlink(name.c_str());
+   }
+
+   virtual void lock() override
+   {
+      int result = ::pthread_mutex_lock(&m_control->mutex);
+      if (result == EOWNERDEAD) {
+         // The previous owner died while holding the lock. The mutex is
+         // recovered so the other processes can go on, the number of times
+         // this happened is kept in the segment for anyone interested.
+         ::pthread_mutex_consistent(&m_control->mutex);
+         m_control->numOwnerDeaths += 1;
+      } else if (result != 0) {
+         throw std::system_error(result, std::generic_category(), "Failed to lock shared memory " + m_name);
+      }
+
+      if (m_control->size != m_size) {
+         try {
+            remap();
+         } catch (...) {
+            // Holding on to the mutex would block every other process.
+            ::pthread_mutex_unlock(&m_control->mutex);
+            throw;
+         }
+      }
+   }
+
+   virtual void unlock() override
+   {
+      ::pthread_mutex_unlock(&m_control->mutex);
+   }
+
+   virtual void* get() override
+   {
+      return m_address;
+   }
+
+   virtual size_t size() override
+   {
+      return m_size;
+   }
+
+   // Must be called while holding the lock so no other process grows the
+   // segment at the same time.
+   virtual void realloc(size_t requestedSize) override
+   {
+      if (requestedSize <= size()) return;
+
+      if (::ftruncate(m_fd, static_cast<off_t>(controlSize() + requestedSize)) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to grow shared memory " + m_name);
+      }
+
+      m_control->size = requestedSize;
+      remap();
+   }
+
+   // Must be called while holding the lock. Other processes remap the smaller
+   // segment the next time they lock it.
+   virtual void truncate(size_t requestedSize) override
+   {
+      if (requestedSize >= size()) return;
+
+      unmap();
+      if (::ftruncate(m_fd, static_cast<off_t>(controlSize() + requestedSize)) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to shrink shared memory " + m_name);
+      }
+
+      m_control->size = requestedSize;
+      remap();
+   }
+
+   // Shared memory lives in tmpfs, punching a hole frees the pages for every
+   // process mapping the segment.
+   virtual void release(size_t offset, size_t size) override
+   {
+      if (::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(controlSize() + offset), static_cast<off_t>(size)) != 0) {
+         if (errno == EOPNOTSUPP) return;
+         throw std::system_error(errno, std::generic_category(), "Failed to release pages of shared memory " + m_name);
+      }
+   }
+
+   // Number of times a process died while holding the lock of this segment.
+   uint64_t numOwnerDeaths() const
+   {
+      return m_control->numOwnerDeaths;
+   }
+
+   const std::string& name() const
+   {
+      return m_name;
+   }
+
+private:
+   static const uint64_t kMagicNumber = 0x5348424c4f434b53; // "SHBLOCKS"
+
+   struct Control
+   {
+      std::atomic<uint64_t> magicNumber;
+      uint64_t size;
+      uint64_t numOwnerDeaths;
+      pthread_mutex_t mutex;
+   };
+
+   std::string m_name;
+   int m_fd;
+   Control* m_control;
+   void* m_address;
+   size_t m_size;
+
+   static size_t controlSize()
+   {
+      // The data area has to start on a page boundary to be mapped separately.
+      size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+      return ((sizeof(Control) + pageSize - 1) / pageSize) * pageSize;
+   }
+
+   void mapControl()
+   {
+      void* address = ::mmap(nullptr, controlSize(), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+      if (address == MAP_FAILED) {
+         throw std::system_error(errno, std::generic_category(), "Failed to map shared memory " + m_name);
+      }
+      m_control = static_cast<Control*>(address);
+   }
+
+   void initializeControl()
+   {
+      if (::ftruncate(m_fd, static_cast<off_t>(controlSize())) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to size shared memory " + m_name);
+      }
+      mapControl();
+
+      m_control->size = 0;
+      m_control->numOwnerDeaths = 0;
+
+      pthread_mutexattr_t attributes;
+      ::pthread_mutexattr_init(&attributes);
+      ::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+      ::pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+      int result = ::pthread_mutex_init(&m_control->mutex, &attributes);
+      ::pthread_mutexattr_destroy(&attributes);
+      if (result != 0) {
+         throw std::system_error(result, std::generic_category(), "Failed to create lock for shared memory " + m_name);
+      }
+
+      // Publishing the magic number last tells other processes the control
+      // page is ready to be used.
+      m_control->magicNumber.store(kMagicNumber, std::memory_order_release);
+   }
+
+   void attachControl()
+   {
+      // The creating process might still be initializing the segment.
+      const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+      while (true) {
+         struct stat segmentStatus;
+         if (::fstat(m_fd, &segmentStatus) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Failed to stat shared memory " + m_name);
+         }
+
+         if (static_cast<size_t>(segmentStatus.st_size) >= controlSize()) {
+            if (m_control == nullptr) {
+               mapControl();
+            }
+            if (m_control->magicNumber.load(std::memory_order_acquire) == kMagicNumber) {
+               return;
+            }
+         }
+
+         if (std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("Shared memory " + m_name + " was never initialized");
+         }
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+   }
+
+   void remap()
+   {
+      unmap();
+
+      // TODO: numeric_cast
+      size_t size = static_cast<size_t>(m_control->size);
+      if (size == 0) return;
+
+      void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, static_cast<off_t>(controlSize()));
+      if (address == MAP_FAILED) {
+         throw std::system_error(errno, std::generic_category(), "Failed to map shared memory " + m_name);
+      }
+
+      m_address = address;
+      m_size = size;
+   }
+
+   void unmap()
+   {
+      if (m_address == nullptr) return;
+
+      ::munmap(m_address, m_size);
+      m_address = nullptr;
+      m_size = 0;
+   }
+};
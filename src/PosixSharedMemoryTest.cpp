@@ -0,0 +1,210 @@
+#include <catch.hpp>
+
+#include "BlockStorage.h"
+#include "PosixSharedMemory.h"
+#include "RecordStorage.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::string sharedMemoryName()
+{
+   return "/BlockStorageTest." + std::to_string(getpid());
+}
+
+TEST_CASE("Share BlockStorage between PosixSharedMemory instances", "[PosixSharedMemory]") {
+    std::string name = sharedMemoryName();
+    PosixSharedMemory::remove(name);
+
+    BlockStorage<1028> writer(std::make_unique<PosixSharedMemory>(name));
+    BlockStorage<1028> reader(std::make_unique<PosixSharedMemory>(name));
+
+    std::string testString = "TestString0";
+    {
+        std::lock_guard<BlockStorage<1028> > lock(writer);
+        for (size_t index = 0; index < 100; ++index) {
+            writer.create();
+        }
+        writer.at(99).set(reinterpret_cast<const uint8_t*>(testString.c_str()), testString.size() + 1);
+    }
+
+    {
+        // Taking the lock picks up the segment grown by the writer.
+        std::lock_guard<BlockStorage<1028> > lock(reader);
+        REQUIRE(reader.size() == 100U);
+        REQUIRE(reader.at(99).id() == 99U);
+        REQUIRE(std::string(reinterpret_cast<const char*>(reader.at(99).data())) == testString);
+    }
+
+    PosixSharedMemory::remove(name);
+}
+
+TEST_CASE("Recover PosixSharedMemory lock from dead owner", "[PosixSharedMemory]") {
+    std::string name = sharedMemoryName();
+    PosixSharedMemory::remove(name);
+
+    PosixSharedMemory memory(name);
+    REQUIRE(memory.numOwnerDeaths() == 0U);
+
+    pid_t child = fork();
+    REQUIRE(child >= 0);
+    if (child == 0) {
+        PosixSharedMemory childMemory(name);
+        childMemory.lock();
+        childMemory.realloc(4096);
+        // Exit without unlocking.
+        _exit(0);
+    }
+
+    int status = 0;
+    REQUIRE(waitpid(child, &status, 0) == child);
+
+    memory.lock();
+    REQUIRE(memory.numOwnerDeaths() == 1U);
+    REQUIRE(memory.size() == 4096U);
+    memory.unlock();
+
+    memory.lock();
+    memory.unlock();
+    REQUIRE(memory.numOwnerDeaths() == 1U);
+
+    PosixSharedMemory::remove(name);
+}
+
+TEST_CASE("Nest pins of RecordStorage on PosixSharedMemory", "[PosixSharedMemory]") {
+    std::string name = sharedMemoryName();
+    PosixSharedMemory::remove(name);
+
+    {
+        RecordStorage<1028> storage(std::make_unique<BlockStorage<1028> >(std::make_unique<PosixSharedMemory>(name)));
+        std::vector<uint8_t> first(3000, 1);
+        std::vector<uint8_t> second(10, 2);
+        RecordId firstId = storage.add(first.data(), first.size());
+        RecordId secondId = storage.add(second.data(), second.size());
+        RecordStorage<1028>::Snapshot snapshot = storage.snapshot();
+
+        // The shared lock of PosixSharedMemory is exclusive, pins and snapshot
+        // reads of the same thread must not take it again.
+        {
+            RecordStorage<1028>::PinnedRecord pinned = storage.pin(firstId);
+            RecordStorage<1028>::PinnedRecord other = storage.pin(secondId);
+            RecordStorage<1028>::PinnedRecord again = storage.pin(firstId);
+            REQUIRE(pinned.size() == first.size());
+            REQUIRE(other.size() == second.size());
+            REQUIRE(again.size() == first.size());
+
+            std::vector<uint8_t> data;
+            REQUIRE(snapshot.get(secondId, data));
+            REQUIRE(data == second);
+        }
+
+        // Everything is released, a writer gets the lock.
+        storage.erase(secondId);
+        std::vector<uint8_t> data;
+        REQUIRE(snapshot.get(secondId, data));
+        REQUIRE(data == second);
+    }
+
+    PosixSharedMemory::remove(name);
+}
+
+TEST_CASE("Allocate lock-free from several processes", "[PosixSharedMemory]") {
+    const size_t numChildren = 4;
+    const size_t numRounds = 2000;
+    const uint64_t kMark = 0x4b52414d4b434f4c; // "LOCKMARK"
+    std::string name = sharedMemoryName();
+    PosixSharedMemory::remove(name);
+
+    BlockStorage<1028> storage(std::make_unique<PosixSharedMemory>(name), BlockLayout::Packed, BlockAllocation::LockFree);
+    {
+        // The capacity is reserved before any other process attaches, they
+        // map all of it when they open the segment.
+        std::lock_guard<BlockStorage<1028> > lock(storage);
+        storage.reserve(numChildren * numRounds);
+        REQUIRE_THROWS_AS(storage.reserve(2 * numChildren * numRounds), std::logic_error);
+    }
+
+    std::vector<pid_t> children;
+    for (uint64_t child = 0; child < numChildren; ++child) {
+        pid_t pid = fork();
+        REQUIRE(pid >= 0);
+        if (pid == 0) {
+            bool ok = true;
+            try {
+                BlockStorage<1028> childStorage(std::make_unique<PosixSharedMemory>(name), BlockLayout::Packed, BlockAllocation::LockFree);
+                // Keeps every other block and frees the rest, so the
+                // processes race on both the free stack and the bump pointer.
+                std::vector<uint64_t> held;
+                for (uint64_t round = 0; round < numRounds; ++round) {
+                    Block<1028> block = childStorage.create();
+                    uint64_t* data = reinterpret_cast<uint64_t*>(block.data());
+                    data[0] = kMark;
+                    data[1] = child;
+                    data[2] = round;
+                    held.push_back(block.id());
+                    if (round % 2 == 1) {
+                        childStorage.free(held[held.size() - 2]);
+                        held.erase(held.end() - 2);
+                    }
+                }
+                for (uint64_t blockId : held) {
+                    const uint64_t* data = reinterpret_cast<const uint64_t*>(childStorage.at(blockId).data());
+                    ok = ok && data[0] == kMark && data[1] == child;
+                }
+            } catch (...) {
+                ok = false;
+            }
+            _exit(ok ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+
+    for (pid_t pid : children) {
+        int status = 0;
+        REQUIRE(waitpid(pid, &status, 0) == pid);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+    }
+
+    // A block handed out twice leaves one process short of its marks.
+    std::vector<size_t> numHeld(numChildren, 0);
+    for (uint64_t blockId = 0; blockId < numChildren * numRounds; ++blockId) {
+        if (storage.isFree(blockId)) continue;
+        const uint64_t* data = reinterpret_cast<const uint64_t*>(storage.at(blockId).data());
+        if (data[0] != kMark) continue;
+        REQUIRE(data[1] < numChildren);
+        numHeld[data[1]] += 1;
+    }
+    REQUIRE(numHeld == std::vector<size_t>(numChildren, numRounds / 2));
+    REQUIRE(storage.size() == numChildren * numRounds / 2);
+
+    PosixSharedMemory::remove(name);
+}
+
+TEST_CASE("Map a lock-free capacity reserved after attaching", "[PosixSharedMemory]") {
+    std::string name = sharedMemoryName();
+    PosixSharedMemory::remove(name);
+
+    BlockStorage<1028> owner(std::make_unique<PosixSharedMemory>(name), BlockLayout::Packed, BlockAllocation::LockFree);
+    BlockStorage<1028> early(std::make_unique<PosixSharedMemory>(name), BlockLayout::Packed, BlockAllocation::LockFree);
+    {
+        std::lock_guard<BlockStorage<1028> > lock(owner);
+        owner.reserve(16);
+    }
+    REQUIRE(owner.create().id() == 0U);
+
+    // The early storage has not mapped the capacity yet, taking the lock once
+    // remaps the segment.
+    REQUIRE_THROWS_AS(early.create(), std::logic_error);
+    REQUIRE_THROWS_AS(early.free(0), std::logic_error);
+    early.lock();
+    early.unlock();
+    REQUIRE(early.create().id() == 1U);
+    early.free(0);
+    REQUIRE(owner.size() == 1U);
+
+    PosixSharedMemory::remove(name);
+}
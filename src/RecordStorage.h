@@ -2,8 +2,15 @@
 
 #include <algorithm>
 #include "BlockStorage.h"
+#include "LatchTable.h"
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
 #include <cstddef>
+#include <sys/uio.h>
 
 #include <iostream>
 
@@ -199,149 +206,1502 @@ static const RecordId kInvalidRecordId = 0;
 // 
 // };
 
+// How RecordStorage places the data of a record.
+//
+// Chained stores every record in a chain of single blocks. SizeClasses stores
+// a record in the smallest span (see BlockStorage::createSpan) it fits in, so
+// the block size can be small without long chains for large records. Records
+// larger than the longest span are chained from spans.
+enum class RecordAllocation
+{
+   Chained,
+   SizeClasses
+};
+
+// Whether RecordStorage packs small records together.
+//
+// SlottedPages stores records up to a quarter of a block in slotted pages: a
+// slot directory at the start of a block and the records packed from its end.
+// The RecordId of such a record holds the slot in its upper 16 bits and the
+// block id of the page in the lower 48 bits. A packed record that outgrows its
+// page moves into a chain of blocks and its slot forwards to the chain, so
+// the RecordId stays the same.
+enum class RecordPacking
+{
+   None,
+   SlottedPages
+};
+
+// Reads the bytes of an array of iovecs front to back. Reading past the
+// end of the last iovec is up to the caller to avoid.
+class GatherReader
+{
+public:
+   explicit GatherReader(const iovec* iov)
+      : m_iov(iov),
+        m_offset(0)
+   {
+   }
+
+   void skip(size_t size)
+   {
+      while (size > 0) {
+         const size_t chunkSize = std::min(size, m_iov->iov_len - m_offset);
+         size -= chunkSize;
+         m_offset += chunkSize;
+         if (m_offset == m_iov->iov_len) {
+            ++m_iov;
+            m_offset = 0;
+         }
+      }
+   }
+
+   void read(uint8_t* destination, size_t size)
+   {
+      while (size > 0) {
+         const size_t chunkSize = std::min(size, m_iov->iov_len - m_offset);
+         std::memcpy(destination, static_cast<const uint8_t*>(m_iov->iov_base) + m_offset, chunkSize);
+         destination += chunkSize;
+         size -= chunkSize;
+         m_offset += chunkSize;
+         if (m_offset == m_iov->iov_len) {
+            ++m_iov;
+            m_offset = 0;
+         }
+      }
+   }
+
+private:
+   const iovec* m_iov;
+   size_t m_offset;
+};
+
 template <size_t BlockSize>
 class RecordStorage
 {
 public:
-   RecordStorage(std::unique_ptr<BlockStorage<BlockSize> > storage)
-      : m_storage(std::move(storage))
+   // The allocation and packing are only used when the storage is created, an
+   // existing storage keeps the ones it was created with.
+   RecordStorage(
+      std::unique_ptr<BlockStorage<BlockSize> > storage,
+      RecordAllocation allocation = RecordAllocation::Chained,
+      RecordPacking packing = RecordPacking::None)
+      : m_storage(std::move(storage)),
+        m_latches(),
+        m_versionMutex(),
+        m_commitVersion(0),
+        m_snapshots(),
+        m_versions(),
+        m_lifetimes(),
+        m_pageFreeBytes(),
+        m_pagesByFreeBytes()
+   {
+      {
+         std::lock_guard<BlockStorage<BlockSize> > lock(*m_storage);
+
+         if (m_storage->size() == 0) {
+            Block<BlockSize> headerBlock = m_storage->create();
+            assert(headerBlock.id() == HEADER_BLOCK);
+
+            // Setting header
+            Header* header = getHeader();
+            header->size = 0;
+            header->numContiguousRecords = 0;
+            header->allocation = static_cast<uint64_t>(allocation);
+            header->packing = static_cast<uint64_t>(packing);
+            header->firstPageId = kInvalidRecordId;
+            header->numPages = 0;
+         }
+      }
+   }
+
+   // Open snapshots have to be closed before, the versions kept for them are
+   // freed here.
+   ~RecordStorage()
+   {
+      std::lock_guard<BlockStorage<BlockSize> > lock(*m_storage);
+      std::lock_guard<std::mutex> versionLock(m_versionMutex);
+      m_snapshots.clear();
+      collectVersions();
+   }
+
+   void lock()
+   {
+      m_storage->lock();
+   }
+
+   void unlock()
+   {
+      m_storage->unlock();
+   }
+
+   // Readers may hold the lock shared, e.g. with std::shared_lock, while they
+   // only call get() and the other const operations.
+   void lock_shared()
+   {
+      m_storage->lock_shared();
+   }
+
+   void unlock_shared()
+   {
+      m_storage->unlock_shared();
+   }
+
+   std::vector<uint8_t> get(RecordId recordId)
+   {
+      recordId = locate(recordId);
+      if (isSlotted(recordId)) {
+         const uint8_t* data = nullptr;
+         size_t size = 0;
+         getSlotted(recordId, data, size);
+         return std::vector<uint8_t>(data, data + size);
+      }
+
+      std::vector<uint8_t> data;
+      data.reserve(recordSize(recordId));
+      forEachBlock(recordId, [&data](const Block<BlockSize>& block) {
+         data.insert(data.end(), recordData(block), recordData(block) + recordDataSize(block));
+      });
+
+      return data;
+   }
+
+   // Copies the record into buffer when it fits into capacity bytes and
+   // returns its size either way, so a too small buffer can be grown and the
+   // read retried.
+   size_t get(RecordId recordId, uint8_t* buffer, size_t capacity)
+   {
+      recordId = locate(recordId);
+      if (isSlotted(recordId)) {
+         const uint8_t* data = nullptr;
+         size_t size = 0;
+         getSlotted(recordId, data, size);
+         if (size <= capacity) {
+            std::memcpy(buffer, data, size);
+         }
+         return size;
+      }
+
+      const size_t size = recordSize(recordId);
+      if (size <= capacity) {
+         forEachBlock(recordId, [&buffer](const Block<BlockSize>& block) {
+            // TODO: numeric_cast
+            std::memcpy(buffer, recordData(block), static_cast<size_t>(recordDataSize(block)));
+            buffer += recordDataSize(block);
+         });
+      }
+      return size;
+   }
+
+   // Size of the record, only the block headers are read.
+   size_t recordSize(RecordId recordId)
+   {
+      recordId = locate(recordId);
+      if (isSlotted(recordId)) {
+         const uint8_t* data = nullptr;
+         size_t size = 0;
+         getSlotted(recordId, data, size);
+         return size;
+      }
+
+      uint64_t size = 0;
+      forEachBlock(recordId, [&size](const Block<BlockSize>& block) {
+         size += recordDataSize(block);
+      });
+      // TODO: numeric_cast
+      return static_cast<size_t>(size);
+   }
+
+private:
+   // Holds the storage lock shared, and the first block of a record latched
+   // shared once latch() is called, for reading. All the ReadGuards of a
+   // thread share one hold of the lock and of every latch, see ReadHold.
+   class ReadGuard
+   {
+   public:
+      explicit ReadGuard(RecordStorage* records)
+         : m_records(records),
+           m_stripe(kNoStripe)
+      {
+         m_records->holdShared();
+      }
+
+      ReadGuard(ReadGuard&& other)
+         : m_records(other.m_records),
+           m_stripe(other.m_stripe)
+      {
+         other.m_records = nullptr;
+      }
+
+      ReadGuard(const ReadGuard&) = delete;
+      ReadGuard& operator=(const ReadGuard&) = delete;
+      ReadGuard& operator=(ReadGuard&&) = delete;
+
+      ~ReadGuard()
+      {
+         if (m_records == nullptr) return;
+
+         if (m_stripe != kNoStripe) {
+            m_records->unlatchShared(m_stripe);
+         }
+         m_records->releaseShared();
+      }
+
+      void latch(uint64_t blockId)
+      {
+         assert(m_stripe == kNoStripe);
+         m_stripe = m_records->latchShared(blockId);
+      }
+
+   private:
+      static const size_t kNoStripe = SIZE_MAX;
+
+      RecordStorage* m_records;
+      size_t m_stripe;
+   };
+
+public:
+   // The data of a record where it lies in the storage, one iovec per block,
+   // ready for writev() or sendmsg(). It holds the storage lock shared and
+   // the record latched shared for as long as it lives, so the data neither
+   // moves nor changes underneath. Writers wait for it, so the thread holding
+   // it must not write to the storage itself. It has to be released on the
+   // thread that pinned the record.
+   class PinnedRecord
+   {
+   public:
+      PinnedRecord(PinnedRecord&& other) = default;
+
+      PinnedRecord(const PinnedRecord&) = delete;
+      PinnedRecord& operator=(const PinnedRecord&) = delete;
+      PinnedRecord& operator=(PinnedRecord&&) = delete;
+
+      const std::vector<iovec>& segments() const
+      {
+         return m_segments;
+      }
+
+      const iovec* iov() const
+      {
+         return m_segments.data();
+      }
+
+      int iovcnt() const
+      {
+         // TODO: numeric_cast
+         return static_cast<int>(m_segments.size());
+      }
+
+      // Total size of the segments.
+      size_t size() const
+      {
+         return m_size;
+      }
+
+   private:
+      friend class RecordStorage;
+
+      explicit PinnedRecord(ReadGuard guard)
+         : m_guard(std::move(guard)),
+           m_segments(),
+           m_size(0)
+      {
+      }
+
+      ReadGuard m_guard;
+      std::vector<iovec> m_segments;
+      size_t m_size;
+
+      void addSegment(const uint8_t* data, size_t size)
+      {
+         if (size == 0) return;
+         m_segments.push_back(iovec{const_cast<uint8_t*>(data), size});
+         m_size += size;
+      }
+   };
+
+   // Pins the record for reading it in place, see PinnedRecord. Takes the
+   // lock shared, the caller must not hold the lock already, except through
+   // other pins or snapshot reads of the same thread: those share one hold of
+   // the lock and the latches instead of taking them again.
+   PinnedRecord pin(RecordId recordId)
+   {
+      ReadGuard guard(this);
+      recordId = locate(recordId);
+      // The exclusive latch of a record always covers its first block, or its
+      // page, so latching that one shared keeps update() out.
+      guard.latch(isSlotted(recordId) ? pageIdOf(recordId) : recordId);
+      PinnedRecord pinned(std::move(guard));
+      if (isSlotted(recordId)) {
+         const uint8_t* data = nullptr;
+         size_t size = 0;
+         getSlotted(recordId, data, size);
+         pinned.addSegment(data, size);
+         return pinned;
+      }
+
+      forEachBlock(recordId, [&pinned](const Block<BlockSize>& block) {
+         // TODO: numeric_cast
+         pinned.addSegment(recordData(block), static_cast<size_t>(recordDataSize(block)));
+      });
+      return pinned;
+   }
+
+   // Reads the record without taking the lock. The version of its first
+   // block, or of its page when it is packed, is checked after the copy and
+   // the read is retried when a writer changed the record in between. After
+   // kMaxOptimisticRetries attempts it falls back to the shared lock.
+   //
+   // Writers still have to hold the lock. The backing memory must not move,
+   // so the storage has to sit on an address stable backend like
+   // ReservedMemory, not on a BufferPool, and compact() must not run next to optimistic readers
+   // since it unmaps the end of the storage. With an EpochManager set on the
+   // BlockStorage the read pins an epoch, so blocks erased meanwhile are not
+   // reused before it is done.
+   std::vector<uint8_t> getOptimistic(RecordId recordId)
+   {
+      EpochManager::Guard pinned;
+      if (EpochManager* epochs = m_storage->epochManager()) {
+         pinned = epochs->pin();
+      }
+
+      std::vector<uint8_t> data;
+      for (size_t attempt = 0; attempt < kMaxOptimisticRetries; ++attempt) {
+         if (tryGetOptimistic(recordId, data)) return data;
+      }
+
+      std::shared_lock<RecordStorage> lock(*this);
+      return get(recordId);
+   }
+
+   // One attempt of getOptimistic(), false when the record changed while it
+   // was read. Everything read is bounds checked first, so a torn read never
+   // leaves the storage.
+   bool tryGetOptimistic(RecordId recordId, std::vector<uint8_t>& data)
+   {
+      data.clear();
+
+      const uint64_t headId = isSlotted(recordId) ? pageIdOf(recordId) : recordId;
+      if (headId == HEADER_BLOCK || !isReadable(headId)) return false;
+      // TODO: numeric_cast
+      Block<BlockSize> head = m_storage->at(static_cast<size_t>(headId));
+      const uint32_t version = head.version();
+      if (version & 1) return false;
+
+      if (isSlotted(recordId)) {
+         const PageFormat* page = reinterpret_cast<const PageFormat*>(head.data());
+         const uint64_t slotIndex = slotOf(recordId);
+         const size_t maxSlots = (pageCapacity() - offsetof(PageFormat, slots)) / sizeof(Slot);
+         if (slotIndex >= maxSlots || slotIndex >= page->numSlots) return false;
+         const Slot slot = page->slots[slotIndex];
+         if (isForwardSlot(slot)) {
+            // The forward never changes while the record exists, the chain is
+            // read on its own once the page was read consistently.
+            const RecordId chainId = forwardIdOf(slot);
+            return head.validate(version) && tryGetOptimistic(chainId, data);
+         }
+         if (slot.offset == 0 || slot.offset > pageCapacity() || slot.size > pageCapacity() - slot.offset) return false;
+
+         const uint8_t* address = reinterpret_cast<const uint8_t*>(page) + slot.offset;
+         data.assign(address, address + slot.size);
+         return head.validate(version);
+      }
+
+      Block<BlockSize> block = head;
+      for (uint64_t numBlocks = 0; ; ++numBlocks) {
+         if (!isReadable(block) || recordDataSize(block) > recordCapacity(block)) return false;
+         // TODO: numeric_cast
+         data.insert(data.end(), recordData(block), recordData(block) + static_cast<size_t>(recordDataSize(block)));
+         if (!hasNextBlockId(block)) break;
+
+         const uint64_t blockId = nextBlockId(block);
+         // A chain longer than the storage means it was read while it changed.
+         if (numBlocks >= m_storage->capacity() || blockId == HEADER_BLOCK || !isReadable(blockId)) return false;
+         // TODO: numeric_cast
+         block = m_storage->at(static_cast<size_t>(blockId));
+      }
+      return head.validate(version);
+   }
+
+   // Latches the blocks of the record, the page for a packed one. Callers
+   // hold the lock shared while they hold the latch, see LatchTable for the
+   // ordering. Updates of records in different stripes then run in parallel:
+   //
+   //    std::shared_lock<RecordStorage<BlockSize> > lock(storage);
+   //    LatchGuard latch = storage.latch(recordId, LatchMode::Exclusive);
+   //    storage.update(recordId, offset, data, size);
+   LatchGuard latch(RecordId recordId, LatchMode mode)
+   {
+      recordId = locate(recordId);
+      std::vector<uint64_t> blockIds;
+      if (isSlotted(recordId)) {
+         blockIds.push_back(pageIdOf(recordId));
+      } else {
+         for (const Block<BlockSize>& block : findBlocks(recordId)) {
+            blockIds.push_back(block.id());
+         }
+      }
+      return LatchGuard(m_latches, blockIds, mode);
+   }
+
+   LatchTable& latches()
+   {
+      return m_latches;
+   }
+
+   // Overwrites size bytes of the record at offset, the record keeps its size
+   // and blocks. Needs either the lock or the lock shared and the exclusive
+   // latch of the record. Snapshots opened before keep seeing the old data.
+   void update(RecordId recordId, size_t offset, const uint8_t* data, size_t size)
+   {
+      commitUpdate(recordId);
+
+      recordId = locate(recordId);
+      if (isSlotted(recordId)) {
+         // TODO: numeric_cast
+         Block<BlockSize> pageBlock = m_storage->at(static_cast<size_t>(pageIdOf(recordId)));
+         PageFormat* page = getPageFormat(pageIdOf(recordId));
+         const Slot& slot = page->slots[slotOf(recordId)];
+         assert(offset + size <= slot.size);
+
+         pageBlock.beginWrite();
+         std::memcpy(reinterpret_cast<uint8_t*>(page) + slot.offset + offset, data, size);
+         pageBlock.endWrite();
+         return;
+      }
+
+      std::vector<Block<BlockSize> > blocks = findBlocks(recordId);
+      blocks[0].beginWrite();
+      for (Block<BlockSize>& block : blocks) {
+         if (size == 0) break;
+
+         // TODO: numeric_cast
+         const size_t blockDataSize = static_cast<size_t>(recordDataSize(block));
+         if (offset >= blockDataSize) {
+            offset -= blockDataSize;
+            continue;
+         }
+
+         const size_t chunkSize = std::min(blockDataSize - offset, size);
+         std::memcpy(recordData(block) + offset, data, chunkSize);
+         data += chunkSize;
+         size -= chunkSize;
+         offset = 0;
+      }
+      assert(size == 0);
+      blocks[0].endWrite();
+   }
+
+   RecordId add(const uint8_t* data, size_t size)
+   {
+      // std::cout << "add(data, size=" << size << ")" << std::endl;
+      iovec iov{const_cast<uint8_t*>(data), size};
+      return add(&iov, 1);
+   }
+
+   // Adds a record made of the iovecs one after the other, copying them
+   // straight into the blocks of the record.
+   RecordId add(const iovec* iov, int iovcnt)
+   {
+      size_t size = 0;
+      for (int i = 0; i < iovcnt; ++i) {
+         size += iov[i].iov_len;
+      }
+
+      bool contiguous = false;
+      GatherReader reader(iov);
+      RecordId recordId = insert(reader, size, contiguous);
+
+      Header* header = getHeader();
+      header->size += 1;
+      if (contiguous) {
+         header->numContiguousRecords += 1;
+      }
+
+      commit(recordId, CommitKind::Add);
+      return recordId;
+   }
+
+   // Frees the blocks of the record, so callers hold the lock. That keeps
+   // out every holder of a latch, none is taken, see LatchTable.
+   void erase(RecordId recordId)
+   {
+      // std::cout << "erase(recordId=" << recordId << ")" << std::endl;
+      commit(recordId, CommitKind::Erase);
+
+      Header* header = getHeader();
+      header->size -= 1;
+      if (remove(recordId)) {
+         header->numContiguousRecords -= 1;
+      }
+   }
+
+   // Replaces the data of the record, the record keeps its id. Snapshots
+   // opened before keep seeing the old data. A packed record that no longer
+   // fits into its page moves into a chain of blocks, see RecordPacking.
+   void replace(RecordId recordId, const uint8_t* data, size_t size)
+   {
+      commit(recordId, CommitKind::Replace);
+      if (isSlotted(locate(recordId))) {
+         if (size > maxSlottedRecordSize() || size > slottedSpaceFor(recordId)) {
+            forwardSlotted(recordId, data, size);
+         } else {
+            replaceSlotted(recordId, data, size);
+         }
+         return;
+      }
+
+      bool wasContiguous = false;
+      bool contiguous = replaceChained(locate(recordId), data, size, wasContiguous);
+      updateContiguousCount(wasContiguous, contiguous);
+   }
+
+   // Appends to the record, the record keeps its id. The free space of the
+   // last block is filled in place and the rest goes into new blocks linked
+   // behind it, the blocks in front are not written. Snapshots opened before
+   // keep seeing the old data. A packed record is replaced as a whole and
+   // moves out of its page once it no longer fits.
+   void append(RecordId recordId, const uint8_t* data, size_t size)
+   {
+      if (isSlotted(locate(recordId))) {
+         std::vector<uint8_t> record = get(recordId);
+         record.insert(record.end(), data, data + size);
+         replace(recordId, record.data(), record.size());
+         return;
+      }
+
+      commit(recordId, CommitKind::Replace);
+      iovec iov{const_cast<uint8_t*>(data), size};
+      GatherReader reader(&iov);
+      bool wasContiguous = false;
+      bool contiguous = appendChained(locate(recordId), reader, size, wasContiguous);
+      updateContiguousCount(wasContiguous, contiguous);
+   }
+
+   // Cuts the record to size bytes or grows it with zeros, the record keeps
+   // its id. Only the blocks at the end of the record change: shrinking frees
+   // the blocks behind the new end, growing works like append(). Snapshots
+   // opened before keep seeing the old data. Callers hold the lock and, like
+   // erase(), take no latch.
+   void resize(RecordId recordId, size_t size)
+   {
+      const size_t oldSize = recordSize(recordId);
+      if (size > oldSize) {
+         std::vector<uint8_t> zeros(size - oldSize, 0);
+         append(recordId, zeros.data(), zeros.size());
+         return;
+      }
+      if (size == oldSize) return;
+
+      if (isSlotted(locate(recordId))) {
+         std::vector<uint8_t> record = get(recordId);
+         replace(recordId, record.data(), size);
+         return;
+      }
+
+      commit(recordId, CommitKind::Replace);
+      bool wasContiguous = false;
+      bool contiguous = truncateChained(locate(recordId), size, wasContiguous);
+      updateContiguousCount(wasContiguous, contiguous);
+   }
+
+   // Streams a new record into the storage. Bytes written go straight into
+   // the blocks of the record, which are created as it grows. The record
+   // only becomes visible with close(), which returns its id; a writer that
+   // goes away without close() frees what it wrote.
+   //
+   // Callers hold the lock around every write() and close(), like for add(),
+   // and around dropping a writer that was not closed.
+   // Streamed records are never packed into slotted pages, and with
+   // RecordAllocation::SizeClasses every span is twice as long as the one
+   // before, up to the longest span.
+   class RecordWriter
+   {
+   public:
+      RecordWriter(RecordWriter&& other)
+         : m_records(other.m_records),
+           m_firstBlockId(other.m_firstBlockId),
+           m_lastBlockId(other.m_lastBlockId),
+           m_size(other.m_size),
+           m_contiguous(other.m_contiguous)
+      {
+         other.m_records = nullptr;
+      }
+
+      RecordWriter(const RecordWriter&) = delete;
+      RecordWriter& operator=(const RecordWriter&) = delete;
+      RecordWriter& operator=(RecordWriter&&) = delete;
+
+      ~RecordWriter()
+      {
+         if (m_records && m_firstBlockId != kInvalidRecordId) {
+            m_records->freeChain(m_firstBlockId);
+         }
+      }
+
+      void write(const uint8_t* data, size_t size)
+      {
+         iovec iov{const_cast<uint8_t*>(data), size};
+         GatherReader reader(&iov);
+         write(reader, size);
+      }
+
+      void write(const iovec* iov, int iovcnt)
+      {
+         GatherReader reader(iov);
+         for (int i = 0; i < iovcnt; ++i) {
+            write(reader, iov[i].iov_len);
+         }
+      }
+
+      // Bytes written so far.
+      size_t size() const
+      {
+         return m_size;
+      }
+
+      // Publishes the record and returns its id, the writer is done with it.
+      RecordId close()
+      {
+         assert(m_records);
+         if (m_firstBlockId == kInvalidRecordId) {
+            appendBlock();
+         }
+
+         RecordStorage* records = m_records;
+         const RecordId recordId = m_firstBlockId;
+         m_records = nullptr;
+
+         // Tagged only now, so compaction leaves the blocks alone while they
+         // are written.
+         records->forEachBlock(recordId, [recordId](Block<BlockSize>& block) {
+            if (block.id() != recordId) {
+               block.setTag(BlockTag::RecordContinuation);
+            }
+         });
+
+         Header* header = records->getHeader();
+         header->size += 1;
+         if (m_contiguous) {
+            header->numContiguousRecords += 1;
+         }
+         records->commit(recordId, CommitKind::Add);
+         return recordId;
+      }
+
+   private:
+      friend class RecordStorage;
+
+      explicit RecordWriter(RecordStorage* records)
+         : m_records(records),
+           m_firstBlockId(kInvalidRecordId),
+           m_lastBlockId(kInvalidRecordId),
+           m_size(0),
+           m_contiguous(true)
+      {
+      }
+
+      RecordStorage* m_records;
+      uint64_t m_firstBlockId;
+      uint64_t m_lastBlockId;
+      size_t m_size;
+      bool m_contiguous;
+
+      void write(GatherReader& reader, size_t size)
+      {
+         assert(m_records);
+         while (size > 0) {
+            if (m_firstBlockId == kInvalidRecordId || isFull(lastBlock())) {
+               appendBlock();
+            }
+
+            Block<BlockSize> block = lastBlock();
+            // TODO: numeric_cast
+            const size_t chunkSize = std::min(size, static_cast<size_t>(recordCapacity(block) - recordDataSize(block)));
+            block.beginWrite();
+            reader.read(recordData(block) + recordDataSize(block), chunkSize);
+            getRecordFormat(block)->size += chunkSize;
+            block.setSize(offsetof(RecordFormat, data) + recordDataSize(block));
+            block.endWrite();
+
+            size -= chunkSize;
+            m_size += chunkSize;
+         }
+      }
+
+      Block<BlockSize> lastBlock()
+      {
+         // TODO: numeric_cast
+         return m_records->m_storage->at(static_cast<size_t>(m_lastBlockId));
+      }
+
+      static bool isFull(const Block<BlockSize>& block)
+      {
+         return recordDataSize(block) == recordCapacity(block);
+      }
+
+      void appendBlock()
+      {
+         BlockStorage<BlockSize>& storage = *m_records->m_storage;
+         const bool isFirst = m_firstBlockId == kInvalidRecordId;
+         Block<BlockSize> block = isFirst || m_records->allocation() == RecordAllocation::Chained
+            ? storage.create()
+            : storage.createSpan(std::min(2 * storage.spanLength(lastBlock()), BlockStorage<BlockSize>::kMaxSpanLength));
+         initializeRecordFormat(block);
+         block.setSize(offsetof(RecordFormat, data));
+
+         if (isFirst) {
+            m_firstBlockId = block.id();
+         } else {
+            Block<BlockSize> last = lastBlock();
+            m_contiguous = m_contiguous && block.id() == last.id() + storage.spanLength(last);
+            setPrevBlockId(block, last.id());
+            setNextBlockId(last, block.id());
+         }
+         m_lastBlockId = block.id();
+      }
+   };
+
+   RecordWriter writer()
+   {
+      return RecordWriter(this);
+   }
+
+   // A consistent point in time view of the storage. Reads through a snapshot
+   // see every record as it was when the snapshot was opened, writers keep
+   // going meanwhile: replace(), update() and erase() copy the data a snapshot
+   // may still see into a record of its own, or into memory for update(),
+   // first. The copies go away once no snapshot
+   // needs them anymore.
+   //
+   // Snapshots and the versions they see are kept by this RecordStorage, so
+   // only writers going through it are versioned.
+   class Snapshot
+   {
+   public:
+      Snapshot(Snapshot&& other)
+         : m_records(other.m_records),
+           m_version(other.m_version)
+      {
+         other.m_records = nullptr;
+      }
+
+      Snapshot(const Snapshot&) = delete;
+      Snapshot& operator=(const Snapshot&) = delete;
+      Snapshot& operator=(Snapshot&&) = delete;
+
+      ~Snapshot()
+      {
+         if (m_records) {
+            m_records->closeSnapshot(m_version);
+         }
+      }
+
+      // Number of commits the snapshot sees.
+      uint64_t version() const
+      {
+         return m_version;
+      }
+
+      // Reads the record as of the snapshot, false when it did not exist then.
+      // Takes the lock shared for the read only, not for the life of the
+      // snapshot. Like pin() it reuses the hold of the lock of pins the
+      // thread has open.
+      bool get(RecordId recordId, std::vector<uint8_t>& data) const
+      {
+         return m_records->getVersion(m_version, recordId, data);
+      }
+
+   private:
+      friend class RecordStorage;
+
+      Snapshot(RecordStorage* records, uint64_t version)
+         : m_records(records),
+           m_version(version)
+      {
+      }
+
+      RecordStorage* m_records;
+      uint64_t m_version;
+   };
+
+   Snapshot snapshot()
+   {
+      std::lock_guard<std::mutex> lock(m_versionMutex);
+      m_snapshots.insert(m_commitVersion);
+      return Snapshot(this, m_commitVersion);
+   }
+
+   // Number of old record versions kept for snapshots.
+   size_t numVersions()
+   {
+      std::lock_guard<std::mutex> lock(m_versionMutex);
+      size_t numVersions = 0;
+      for (const auto& versions : m_versions) {
+         numVersions += versions.second.size();
+      }
+      return numVersions;
+   }
+
+   size_t size()
+   {
+       // TODO: numeric_cast
+       return static_cast<size_t>(getHeader()->size);
+   }
+
+   // Moves up to maxMoves blocks from the end of the storage into free blocks
+   // and shrinks the storage, see BlockStorage::compact(). Only continuation
+   // blocks of records move, record ids stay the same.
+   size_t compact(size_t maxMoves)
+   {
+      return m_storage->compact(maxMoves, [this](Block<BlockSize> block, uint64_t oldBlockId) {
+         // TODO: numeric_cast
+         Block<BlockSize> prevBlock = m_storage->at(static_cast<size_t>(prevBlockId(block)));
+         Block<BlockSize> head = prevBlock;
+         while (hasPrevBlockId(head)) {
+            head = m_storage->at(static_cast<size_t>(prevBlockId(head)));
+         }
+
+         head.beginWrite();
+         setNextBlockId(prevBlock, block.id());
+         if (hasNextBlockId(block)) {
+            Block<BlockSize> nextBlock = m_storage->at(static_cast<size_t>(nextBlockId(block)));
+            setPrevBlockId(nextBlock, block.id());
+         }
+         head.endWrite();
+
+         // Moving the block may split or join the extent of its record.
+         std::vector<Block<BlockSize> > blocks = findBlocks(head.id());
+         bool isContiguousNow = isContiguous(blocks);
+         bool wasContiguous = true;
+         for (size_t i = 1; i < blocks.size(); ++i) {
+            uint64_t prevId = blocks[i - 1].id() == block.id() ? oldBlockId : blocks[i - 1].id();
+            uint64_t blockId = blocks[i].id() == block.id() ? oldBlockId : blocks[i].id();
+            wasContiguous = wasContiguous && blockId == prevId + m_storage->spanLength(blocks[i - 1]);
+         }
+
+         if (wasContiguous && !isContiguousNow) {
+            getHeader()->numContiguousRecords -= 1;
+         } else if (!wasContiguous && isContiguousNow) {
+            getHeader()->numContiguousRecords += 1;
+         }
+      });
+   }
+
+   RecordAllocation allocation()
+   {
+      return static_cast<RecordAllocation>(getHeader()->allocation);
+   }
+
+   // Whether all blocks of the record have consecutive ids.
+   bool isContiguous(RecordId recordId)
+   {
+      recordId = locate(recordId);
+      if (isSlotted(recordId)) return true;
+
+      bool contiguous = true;
+      uint64_t nextId = recordId;
+      forEachBlock(recordId, [this, &contiguous, &nextId](const Block<BlockSize>& block) {
+         contiguous = contiguous && block.id() == nextId;
+         nextId = block.id() + m_storage->spanLength(block);
+      });
+      return contiguous;
+   }
+
+   RecordPacking packing()
+   {
+      return static_cast<RecordPacking>(getHeader()->packing);
+   }
+
+   // Largest record that goes into a slotted page.
+   static size_t maxSlottedRecordSize()
+   {
+      return (pageCapacity() - offsetof(PageFormat, slots)) / 4;
+   }
+
+   // Number of slotted pages, they are never given back.
+   uint64_t numPages()
+   {
+      return getHeader()->numPages;
+   }
+
+   // Fraction of the records that are stored in a single extent of
+   // consecutive blocks, 1 for an empty storage.
+   double contiguousFraction()
+   {
+      const Header* header = getHeader();
+      if (header->size == 0) return 1.0;
+
+      return static_cast<double>(header->numContiguousRecords) / static_cast<double>(header->size);
+   }
+
+   // TODO: just for testing
+   std::vector<uint64_t> getFreeBlockIds()
+   {
+      return m_storage->freeBlockIds();
+   }
+
+private:
+   static const uint64_t HEADER_BLOCK = 0;
+   std::unique_ptr<BlockStorage<BlockSize> > m_storage;
+   LatchTable m_latches;
+
+   // What the ReadGuards of one thread hold: the lock shared and some stripes
+   // latched shared, each taken once and counted. Taking the same shared lock
+   // twice in a thread is undefined for std::shared_timed_mutex, and deadlocks
+   // on PosixSharedMemory, whose shared lock is exclusive.
+   struct ReadHold
+   {
+      ReadHold()
+         : numHolds(0),
+           stripes()
+      {}
+
+      size_t numHolds;
+      std::unordered_map<size_t, size_t> stripes;
+   };
+
+   static std::unordered_map<const RecordStorage*, ReadHold>& readHolds()
+   {
+      static thread_local std::unordered_map<const RecordStorage*, ReadHold> holds;
+      return holds;
+   }
+
+   void holdShared()
+   {
+      ReadHold& hold = readHolds()[this];
+      if (hold.numHolds == 0) {
+         try {
+            lock_shared();
+         } catch (...) {
+            readHolds().erase(this);
+            throw;
+         }
+      }
+      hold.numHolds += 1;
+   }
+
+   void releaseShared()
+   {
+      auto hold = readHolds().find(this);
+      assert(hold != readHolds().end());
+      if (--hold->second.numHolds > 0) return;
+
+      readHolds().erase(hold);
+      unlock_shared();
+   }
+
+   size_t latchShared(uint64_t blockId)
+   {
+      const size_t stripe = m_latches.stripeOf(blockId);
+      size_t& numLatches = readHolds()[this].stripes[stripe];
+      if (numLatches == 0) {
+         m_latches.lockStripe(stripe, LatchMode::Shared);
+      }
+      numLatches += 1;
+      return stripe;
+   }
+
+   void unlatchShared(size_t stripe)
+   {
+      std::unordered_map<size_t, size_t>& stripes = readHolds()[this].stripes;
+      auto latched = stripes.find(stripe);
+      assert(latched != stripes.end());
+      if (--latched->second > 0) return;
+
+      stripes.erase(latched);
+      m_latches.unlockStripe(stripe, LatchMode::Shared);
+   }
+
+   enum class CommitKind
+   {
+      Add,
+      Replace,
+      Erase
+   };
+
+   static const uint64_t kNoVersion = UINT64_MAX;
+
+   // A version of a record is seen by the snapshots from begin up to, but not
+   // including, end.
+   struct Version
+   {
+      uint64_t begin;
+      uint64_t end;
+      RecordId copyId; // record holding the old data, kNoCopy when kept in data
+      std::vector<uint8_t> data;
+   };
+
+   static const RecordId kNoCopy = HEADER_BLOCK;
+
+   struct Lifetime
    {
-      {
-         std::lock_guard<BlockStorage<BlockSize> > lock(*m_storage);
+      uint64_t begin; // kNoVersion once erased
+      uint64_t end;   // kNoVersion while the record exists
+   };
 
-         if (m_storage->size() == 0) {
-            Block<BlockSize> headerBlock = m_storage->create();
-            assert(headerBlock.id() == HEADER_BLOCK);
+   // Guards the snapshot registry and the version maps below. Taken after the
+   // storage lock.
+   std::mutex m_versionMutex;
+   uint64_t m_commitVersion;
+   std::multiset<uint64_t> m_snapshots;
+   // Old versions of records and since when the current version of a record
+   // exists, only for records changed while snapshots were open.
+   std::map<RecordId, std::vector<Version> > m_versions;
+   std::map<RecordId, Lifetime> m_lifetimes;
 
-            // Setting header
-            Header* header = getHeader();
-            header->size = 0;
-            header->numFreeBlocks = 0;
-            header->freedBlocksBlockId = 0;
+#pragma pack(push, 8)
+   struct Header
+   {
+      uint64_t size;                 // 8 bytes
+      uint64_t numContiguousRecords; // 8 bytes
+      uint64_t allocation;           // 8 bytes
+      uint64_t packing;              // 8 bytes
+      uint64_t firstPageId;          // 8 bytes
+      uint64_t numPages;             // 8 bytes
+   };
+#pragma pack(pop)
+
+#pragma pack(push, 8)
+   struct Slot
+   {
+      uint32_t offset; // 4 bytes, 0 for an empty slot, kForwardMarker set when forwarded
+      uint32_t size;   // 4 bytes
+   };
+
+   struct PageFormat
+   {
+      uint64_t nextPageId; // 8 bytes
+      uint32_t numSlots;   // 4 bytes
+      uint32_t dataBegin;  // 4 bytes, offset of the first record byte
+      Slot slots[1];       // 8 bytes per slot
+   };
+#pragma pack(pop)
+
+   static const uint64_t kSlotShift = 48;
+   // A forwarded slot keeps the upper 16 bits of the id of the chain in the
+   // low bits of its offset and the lower 32 bits in its size. Offsets of
+   // records in a page never get this large.
+   static const uint32_t kForwardMarker = 0xFFFF0000;
+   static const size_t kMaxOptimisticRetries = 64;
+
+   // Free bytes of every slotted page and the pages ordered by them. Only a
+   // hint built from the page list, the page itself is checked before use.
+   std::map<uint64_t, size_t> m_pageFreeBytes;
+   std::set<std::pair<size_t, uint64_t> > m_pagesByFreeBytes;
+
+#pragma pack(push, 8)
+   struct RecordFormat
+   {
+      uint64_t nextBlockId; // 8 bytes
+      uint64_t prevBlockId; // 8 bytes
+      uint8_t isFree;       // 1 bytes
+                            // 7 bytes (padding)
+      uint64_t size;        // 8 bytes
+      uint8_t data[1];      // 1 byte
+                            // 7 bytes (padding)
+   };
+#pragma pack(pop)
+
+   // Writes the record without touching the counters in the header, contiguous
+   // tells whether its blocks ended up next to each other. Unpacked records
+   // never take space from slotted pages.
+   RecordId insert(const uint8_t* data, size_t size, bool& contiguous, bool packed = true)
+   {
+      iovec iov{const_cast<uint8_t*>(data), size};
+      GatherReader reader(&iov);
+      return insert(reader, size, contiguous, packed);
+   }
+
+   // Every byte is copied once, straight into its block. A list of the blocks
+   // is only kept when they do not come as one run.
+   RecordId insert(GatherReader& reader, size_t size, bool& contiguous, bool packed = true)
+   {
+      if (packed && packing() == RecordPacking::SlottedPages && size <= maxSlottedRecordSize()) {
+         contiguous = true;
+         return addSlotted(reader, size);
+      }
+
+      if (allocation() == RecordAllocation::SizeClasses) {
+         return insertSpans(reader, size, contiguous);
+      }
+
+      // No matter what size (even when 0) a record takes at least one block.
+      const size_t capacityPerBlock = static_cast<size_t>(BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE - offsetof(RecordFormat, data));
+      const size_t numBlocks = std::max<size_t>(1, (size + capacityPerBlock - 1) / capacityPerBlock);
+      const uint64_t firstBlockId = m_storage->createRun(numBlocks);
+      std::vector<Block<BlockSize> > scattered;
+      if (firstBlockId == BlockStorage<BlockSize>::kNoRun) {
+         // No run is free, the record reuses the free blocks wherever they
+         // are rather than growing the storage.
+         scattered = m_storage->createN(numBlocks);
+      }
+      auto blockIdAt = [&scattered, firstBlockId](size_t i) {
+         return scattered.empty() ? firstBlockId + i : scattered[i].id();
+      };
+
+      contiguous = true;
+      for (size_t i = 0; i < numBlocks; ++i) {
+         // TODO: numeric_cast
+         Block<BlockSize> block = m_storage->at(static_cast<size_t>(blockIdAt(i)));
+         const size_t chunkSize = std::min(capacityPerBlock, size);
+         writeBlock(block, reader, chunkSize, i + 1 < numBlocks ? blockIdAt(i + 1) : kInvalidRecordId);
+         size -= chunkSize;
+         if (i > 0) {
+            block.setTag(BlockTag::RecordContinuation);
+            setPrevBlockId(block, blockIdAt(i - 1));
+            contiguous = contiguous && block.id() == blockIdAt(i - 1) + 1;
          }
       }
+      return blockIdAt(0);
    }
 
-   void lock()
+   // Longest spans first, the rest of the record goes into the smallest span
+   // it fits in. Each span is linked to the one before once it is written.
+   RecordId insertSpans(GatherReader& reader, size_t size, bool& contiguous)
    {
-      m_storage->lock();
+      const size_t maxSpanCapacity = spanRecordCapacity(BlockStorage<BlockSize>::kMaxSpanLength);
+      contiguous = true;
+      RecordId recordId = kInvalidRecordId;
+      uint64_t prevBlockId = kInvalidRecordId;
+      while (true) {
+         const bool isLast = size <= maxSpanCapacity;
+         Block<BlockSize> block = m_storage->createSpan(isLast ? spanLengthFor(size) : BlockStorage<BlockSize>::kMaxSpanLength);
+         const size_t chunkSize = std::min(size, maxSpanCapacity);
+         writeBlock(block, reader, chunkSize, kInvalidRecordId);
+         size -= chunkSize;
+
+         if (recordId == kInvalidRecordId) {
+            recordId = block.id();
+         } else {
+            // TODO: numeric_cast
+            Block<BlockSize> prevBlock = m_storage->at(static_cast<size_t>(prevBlockId));
+            contiguous = contiguous && block.id() == prevBlockId + m_storage->spanLength(prevBlock);
+            block.setTag(BlockTag::RecordContinuation);
+            setPrevBlockId(block, prevBlockId);
+            setNextBlockId(prevBlock, block.id());
+         }
+         prevBlockId = block.id();
+         if (isLast) return recordId;
+      }
    }
 
-   void unlock()
+   // Writes size bytes of the record into the block with a fresh
+   // RecordFormat in front, the way Block::set() would but without building
+   // the block in a buffer first.
+   void writeBlock(Block<BlockSize>& block, GatherReader& reader, size_t size, uint64_t nextBlockId)
    {
-      m_storage->unlock();
+      block.beginWrite();
+      initializeRecordFormat(block);
+      RecordFormat* record = getRecordFormat(block);
+      record->nextBlockId = nextBlockId;
+      record->size = size;
+      reader.read(record->data, size);
+      block.setSize(offsetof(RecordFormat, data) + size);
+      block.endWrite();
    }
 
-   std::vector<uint8_t> get(RecordId recordId)
+   // Fills the last block of the record and links a new chain with the rest
+   // of the data behind it. Optimistic readers see the version of the first
+   // block change around it. Returns whether the record is contiguous now.
+   bool appendChained(RecordId recordId, GatherReader& reader, size_t size, bool& wasContiguous)
    {
-      std::vector<uint8_t> data;
+      // TODO: numeric_cast
+      Block<BlockSize> head = m_storage->at(static_cast<size_t>(recordId));
+      uint64_t tailId = recordId;
+      uint64_t nextId = recordId;
+      wasContiguous = true;
+      forEachBlock(recordId, [this, &tailId, &nextId, &wasContiguous](const Block<BlockSize>& block) {
+         wasContiguous = wasContiguous && block.id() == nextId;
+         nextId = block.id() + m_storage->spanLength(block);
+         tailId = block.id();
+      });
+      Block<BlockSize> tail = m_storage->at(static_cast<size_t>(tailId));
 
-      std::vector<Block<BlockSize> > blocks = findBlocks(recordId);
-      for (Block<BlockSize>& block: blocks) {
-          data.insert(data.end(), recordData(block), recordData(block) + recordDataSize(block));
+      // TODO: numeric_cast
+      const size_t tailSize = std::min(size, static_cast<size_t>(recordCapacity(tail) - recordDataSize(tail)));
+      RecordId restId = kInvalidRecordId;
+      bool contiguous = wasContiguous;
+      if (size > tailSize) {
+         // The new blocks are written completely before they are linked in.
+         GatherReader restReader = reader;
+         restReader.skip(tailSize);
+         bool restContiguous = false;
+         restId = insert(restReader, size - tailSize, restContiguous, false);
+         contiguous = contiguous && restContiguous && restId == nextId;
       }
 
-      return data;
+      head.beginWrite();
+      reader.read(recordData(tail) + recordDataSize(tail), tailSize);
+      getRecordFormat(tail)->size += tailSize;
+      tail.setSize(offsetof(RecordFormat, data) + recordDataSize(tail));
+      if (restId != kInvalidRecordId) {
+         // TODO: numeric_cast
+         Block<BlockSize> rest = m_storage->at(static_cast<size_t>(restId));
+         rest.setTag(BlockTag::RecordContinuation);
+         setPrevBlockId(rest, tail.id());
+         setNextBlockId(tail, restId);
+      }
+      head.endWrite();
+      return contiguous;
    }
 
-   RecordId add(const uint8_t* data, size_t size)
+   // Cuts the record to size bytes and frees the blocks behind the new end,
+   // after the first block switched over. Returns whether the record is
+   // contiguous now.
+   bool truncateChained(RecordId recordId, size_t size, bool& wasContiguous)
    {
-      // std::cout << "add(data, size=" << size << ")" << std::endl;
-      std::vector<Block<BlockSize> > blocks = getFreeBlocks(size);
-
-      const uint8_t* dataAddress = data;
-      uint64_t remainingSize = static_cast<uint64_t>(size);
-      for (Block<BlockSize>& block : blocks) {
-         uint64_t maxCapacity = block.capacity() - offsetof(RecordFormat, data);
-         if (std::max(maxCapacity, remainingSize) == remainingSize) {
-            std::vector<uint8_t> recordData = toRecordFormat(dataAddress, maxCapacity);
-            block.set(recordData.data(), recordData.size());
-            dataAddress += maxCapacity;
+      // TODO: numeric_cast
+      Block<BlockSize> head = m_storage->at(static_cast<size_t>(recordId));
+      Block<BlockSize> last = head;
+      uint64_t remaining = size;
+      bool atEnd = false;
+      bool contiguous = true;
+      uint64_t nextId = recordId;
+      wasContiguous = true;
+      forEachBlock(recordId, [&](const Block<BlockSize>& block) {
+         wasContiguous = wasContiguous && block.id() == nextId;
+         nextId = block.id() + m_storage->spanLength(block);
+         if (atEnd) return;
+
+         // Still a block up to the new end.
+         contiguous = wasContiguous;
+         last = block;
+         if (remaining > recordDataSize(block)) {
+            remaining -= recordDataSize(block);
          } else {
-            std::vector<uint8_t> recordData = toRecordFormat(dataAddress, remainingSize);
-            block.set(recordData.data(), recordData.size());
-            dataAddress += remainingSize;
+            atEnd = true;
          }
-      }
+      });
 
-      Header* header = getHeader();
-      header->size += 1;
+      const uint64_t restId = nextBlockId(last);
+      head.beginWrite();
+      getRecordFormat(last)->size = remaining;
+      last.setSize(offsetof(RecordFormat, data) + remaining);
+      getRecordFormat(last)->nextBlockId = kInvalidRecordId;
+      head.endWrite();
 
-      // No matter what size (even when 0) there should be at least one
-      // block allocated.
-      assert(blocks.size() > 0U);
-      return blocks[0].id();
+      freeChain(restId);
+      return contiguous;
    }
 
-   void erase(RecordId recordId)
+   void updateContiguousCount(bool wasContiguous, bool contiguous)
    {
-      // std::cout << "erase(recordId=" << recordId << ")" << std::endl;
+      if (wasContiguous && !contiguous) {
+         getHeader()->numContiguousRecords -= 1;
+      } else if (!wasContiguous && contiguous) {
+         getHeader()->numContiguousRecords += 1;
+      }
+   }
+
+   // Frees the blocks of a chain that is not, or no longer, part of a record.
+   void freeChain(uint64_t blockId)
+   {
+      while (blockId != kInvalidRecordId) {
+         // TODO: numeric_cast
+         Block<BlockSize> block = m_storage->at(static_cast<size_t>(blockId));
+         blockId = nextBlockId(block);
+         setRecordFree(block, true);
+         m_storage->free(block);
+      }
+   }
+
+   // Frees the record without touching the counters in the header, returns
+   // whether it was contiguous.
+   bool remove(RecordId recordId)
+   {
+      if (isSlotted(recordId)) {
+         const RecordId chainId = locate(recordId);
+         eraseSlotted(recordId);
+         if (chainId == recordId) return true;
+         recordId = chainId;
+      }
 
       std::vector<Block<BlockSize> > blocks = findBlocks(recordId);
+      bool contiguous = isContiguous(blocks);
+      blocks[0].beginWrite();
       for (Block<BlockSize> & block : blocks) {
-         markAsFree(block);
+         setRecordFree(block, true);
+         m_storage->free(block);
       }
-
-      Header* header = getHeader();
-      header->size -= 1;
+      blocks[0].endWrite();
+      return contiguous;
    }
 
-   size_t size()
+   // Writes data across the blocks and links them into a chain.
+   void writeChain(std::vector<Block<BlockSize> >& blocks, const uint8_t* data, size_t size)
    {
-       // TODO: numeric_cast
-       return static_cast<size_t>(getHeader()->size);
+      iovec iov{const_cast<uint8_t*>(data), size};
+      GatherReader reader(&iov);
+      uint64_t remainingSize = static_cast<uint64_t>(size);
+      for (size_t i = 0; i < blocks.size(); ++i) {
+         Block<BlockSize>& block = blocks[i];
+         uint64_t chunkSize = std::min(recordCapacity(block), remainingSize);
+         // TODO: numeric_cast
+         writeBlock(block, reader, static_cast<size_t>(chunkSize), kInvalidRecordId);
+         remainingSize -= chunkSize;
+
+         if (i > 0) {
+            block.setTag(BlockTag::RecordContinuation);
+            setPrevBlockId(block, blocks[i - 1].id());
+            setNextBlockId(blocks[i - 1], block.id());
+         }
+      }
    }
 
-   // TODO: just for testing
-   std::vector<uint64_t> getFreeBlockIds()
+   // The first block stays, the rest of the data goes into new blocks which
+   // are written before the first block switches over to them. The old ones
+   // are only freed afterwards, so optimistic readers of the old chain fail
+   // validation instead of reading reused blocks.
+   bool replaceChained(RecordId recordId, const uint8_t* data, size_t size, bool& wasContiguous)
    {
-      // std::cout << "getFreeBlockIds()" << std::endl;
+      std::vector<Block<BlockSize> > oldBlocks = findBlocks(recordId);
+      wasContiguous = isContiguous(oldBlocks);
+      Block<BlockSize> head = oldBlocks[0];
 
-      std::vector<uint64_t> freeBlockIds;
-
-      Block<BlockSize> spaceTrackingBlock = getSpaceTrackingBlock();
-      uint64_t* blockIds = reinterpret_cast<uint64_t*>(recordData(spaceTrackingBlock));
       // TODO: numeric_cast
-      size_t size = static_cast<size_t>(recordDataSize(spaceTrackingBlock) / sizeof(uint64_t));
-      freeBlockIds.insert(freeBlockIds.end(), blockIds, blockIds + size);
-      while (hasNextBlockId(spaceTrackingBlock)) {
-         // TODO: numeric_cast
-         spaceTrackingBlock = m_storage->at(static_cast<size_t>(nextBlockId(spaceTrackingBlock)));
+      const size_t headSize = std::min(static_cast<size_t>(recordCapacity(head)), size);
+      std::vector<Block<BlockSize> > blocks;
+      if (size > headSize) {
+         blocks = getFreeBlocks(size - headSize);
+         writeChain(blocks, data + headSize, size - headSize);
+         blocks[0].setTag(BlockTag::RecordContinuation);
+         setPrevBlockId(blocks[0], head.id());
+      }
 
-         blockIds = reinterpret_cast<uint64_t*>(recordData(spaceTrackingBlock));
-         // TODO: numeric_cast
-         size = static_cast<size_t>(recordDataSize(spaceTrackingBlock) / sizeof(uint64_t));
-         freeBlockIds.insert(freeBlockIds.end(), blockIds, blockIds + size);
+      iovec iov{const_cast<uint8_t*>(data), headSize};
+      GatherReader reader(&iov);
+      writeBlock(head, reader, headSize, blocks.empty() ? kInvalidRecordId : blocks[0].id());
+
+      for (size_t i = 1; i < oldBlocks.size(); ++i) {
+         setRecordFree(oldBlocks[i], true);
+         m_storage->free(oldBlocks[i]);
       }
 
-      return freeBlockIds;
+      blocks.insert(blocks.begin(), head);
+      return isContiguous(blocks);
    }
 
-private:
-   static const uint64_t HEADER_BLOCK = 0;
-   std::unique_ptr<BlockStorage<BlockSize> > m_storage;
+   // Called by writers holding the lock for every change. Opens a new commit
+   // version and, while snapshots are open, keeps what they may still see.
+   void commit(RecordId recordId, CommitKind kind)
+   {
+      std::lock_guard<std::mutex> lock(m_versionMutex);
+      collectVersions();
+
+      const uint64_t version = ++m_commitVersion;
+      if (m_snapshots.empty()) return;
+
+      auto lifetime = m_lifetimes.find(recordId);
+      if (kind != CommitKind::Add) {
+         // Only worth a copy when an open snapshot sees the current data.
+         const uint64_t begin = lifetime != m_lifetimes.end() ? lifetime->second.begin : 0;
+         if (begin <= *m_snapshots.rbegin()) {
+            std::vector<uint8_t> data = get(recordId);
+            bool contiguous = false;
+            // Not packed, so the copy cannot take the space a replaced packed
+            // record was checked to fit into.
+            RecordId copyId = insert(data.data(), data.size(), contiguous, false);
+            m_versions[recordId].push_back(Version{begin, version, copyId, {}});
+         }
+      }
 
-#pragma pack(push, 8)
-   struct Header
+      m_lifetimes[recordId] = kind == CommitKind::Erase
+         ? Lifetime{kNoVersion, version}
+         : Lifetime{version, kNoVersion};
+   }
+
+   // Like commit() for update(), which may run with the lock only shared and
+   // the exclusive latch of the record. Nothing can be allocated in the
+   // storage then, so the old data is kept in memory until collectVersions()
+   // runs under the lock again.
+   void commitUpdate(RecordId recordId)
    {
-      uint64_t size;               // 8 bytes
-      uint64_t numFreeBlocks;      // 8 bytes
-      uint64_t freedBlocksBlockId; // 8 bytes
-   };
-#pragma pack(pop)
+      std::lock_guard<std::mutex> lock(m_versionMutex);
+      const uint64_t version = ++m_commitVersion;
+      if (m_snapshots.empty()) return;
+
+      auto lifetime = m_lifetimes.find(recordId);
+      const uint64_t begin = lifetime != m_lifetimes.end() ? lifetime->second.begin : 0;
+      if (begin <= *m_snapshots.rbegin()) {
+         m_versions[recordId].push_back(Version{begin, version, kNoCopy, get(recordId)});
+      }
+      m_lifetimes[recordId] = Lifetime{version, kNoVersion};
+   }
 
-#pragma pack(push, 8)
-   struct RecordFormat
+   // Drops the versions no open snapshot sees anymore. Needs the lock and
+   // m_versionMutex.
+   void collectVersions()
    {
-      uint64_t nextBlockId; // 8 bytes
-      uint64_t prevBlockId; // 8 bytes
-      uint8_t isFree;       // 1 bytes
-                            // 7 bytes (padding)
-      uint64_t size;        // 8 bytes
-      uint8_t data[1];      // 1 byte
-                            // 7 bytes (padding)
-   };
-#pragma pack(pop)
+      if (m_versions.empty() && m_lifetimes.empty()) return;
+
+      const uint64_t oldest = m_snapshots.empty() ? kNoVersion : *m_snapshots.begin();
+      for (auto it = m_versions.begin(); it != m_versions.end();) {
+         std::vector<Version>& versions = it->second;
+         auto unseen = std::remove_if(versions.begin(), versions.end(), [this, oldest](const Version& version) {
+            if (version.end > oldest && oldest != kNoVersion) return false;
+            if (version.copyId != kNoCopy) {
+               remove(version.copyId);
+            }
+            return true;
+         });
+         versions.erase(unseen, versions.end());
+         it = versions.empty() ? m_versions.erase(it) : std::next(it);
+      }
+
+      for (auto it = m_lifetimes.begin(); it != m_lifetimes.end();) {
+         const Lifetime& lifetime = it->second;
+         const bool seenByAll = oldest == kNoVersion ||
+            (lifetime.end == kNoVersion ? lifetime.begin <= oldest : lifetime.end <= oldest);
+         it = seenByAll ? m_lifetimes.erase(it) : std::next(it);
+      }
+   }
+
+   void closeSnapshot(uint64_t version)
+   {
+      std::lock_guard<std::mutex> lock(m_versionMutex);
+      m_snapshots.erase(m_snapshots.find(version));
+   }
+
+   bool getVersion(uint64_t snapshotVersion, RecordId recordId, std::vector<uint8_t>& data)
+   {
+      // Versions are only collected under the exclusive lock, the copy found
+      // below stays until the read is done. The shared latch keeps update()
+      // from changing the current data between the lookup and the read, see
+      // pin() for why the first block is enough.
+      ReadGuard guard(this);
+      const RecordId dataId = locate(recordId);
+      guard.latch(isSlotted(dataId) ? pageIdOf(dataId) : dataId);
+
+      RecordId sourceId = recordId;
+      {
+         std::lock_guard<std::mutex> versionLock(m_versionMutex);
+         auto versions = m_versions.find(recordId);
+         bool found = false;
+         if (versions != m_versions.end()) {
+            for (const Version& version : versions->second) {
+               if (version.begin <= snapshotVersion && snapshotVersion < version.end) {
+                  if (version.copyId == kNoCopy) {
+                     data = version.data;
+                     return true;
+                  }
+                  sourceId = version.copyId;
+                  found = true;
+                  break;
+               }
+            }
+         }
+
+         auto lifetime = m_lifetimes.find(recordId);
+         if (!found && lifetime != m_lifetimes.end() &&
+             !(lifetime->second.begin <= snapshotVersion && snapshotVersion < lifetime->second.end)) {
+            return false;
+         }
+      }
+
+      data = get(sourceId);
+      return true;
+   }
 
    // TODO: should probably pass in size to validate
    static void initializeHeader(uint8_t* data)
@@ -469,12 +1829,14 @@ private:
    std::vector<Block<BlockSize> > findBlocks(RecordId recordId)
    {
       std::vector<Block<BlockSize> > blocks;
+      Readahead readahead(*m_storage);
 
       // TODO: numeric_cast
       Block<BlockSize> block = m_storage->at(static_cast<size_t>(recordId));
       RecordFormat* recordHeader = reinterpret_cast<RecordFormat*>(block.data());
       blocks.push_back(block);
       while ((recordId = recordHeader->nextBlockId) != kInvalidRecordId) {
+         readahead.next(recordId);
          // TODO: numeric_cast
          Block<BlockSize> block = m_storage->at(static_cast<size_t>(recordId));
          recordHeader = reinterpret_cast<RecordFormat*>(block.data());
@@ -484,20 +1846,73 @@ private:
       return blocks;
    }
 
-   std::vector<uint8_t> toRecordFormat(const uint8_t* data, uint64_t size)
+   // Calls fn(block) for every block of the chained record in order, without
+   // collecting them like findBlocks() does.
+   template <typename Fn>
+   void forEachBlock(RecordId recordId, Fn fn)
    {
-      // TODO: numeric_cast
-      uint32_t dataSizeInBytes = static_cast<uint32_t>(offsetof(RecordFormat, data) + size);
+      Readahead readahead(*m_storage);
+      uint64_t blockId = recordId;
+      while (blockId != kInvalidRecordId) {
+         // TODO: numeric_cast
+         Block<BlockSize> block = m_storage->at(static_cast<size_t>(blockId));
+         blockId = nextBlockId(block);
+         if (blockId != kInvalidRecordId) {
+            readahead.next(blockId);
+         }
+         fn(block);
+      }
+   }
+
+   // Prefetches ahead of a walk along a chain on a pooled storage. The chain
+   // only tells the next block, but chains mostly lie on consecutive ids
+   // (see BlockStorage::createExtent()), so the blocks after the next one are
+   // read in the same batch. Each batch is twice as long as the one before,
+   // so a chain of n consecutive blocks takes O(log n) batches.
+   class Readahead
+   {
+   public:
+      explicit Readahead(BlockStorage<BlockSize>& storage)
+         : m_storage(storage),
+           m_enabled(storage.bufferPool() != nullptr),
+           m_length(kFirstReadahead),
+           m_begin(0),
+           m_end(0)
+      {}
+
+      // Called with the id of the next block before it is read.
+      void next(uint64_t blockId)
+      {
+         if (!m_enabled || (blockId >= m_begin && blockId < m_end)) return;
 
-      std::vector<uint8_t> result(dataSizeInBytes);
+         std::vector<uint64_t> blockIds;
+         for (size_t i = 0; i < m_length; ++i) {
+            blockIds.push_back(blockId + i);
+         }
+         m_storage.prefetch(blockIds);
 
-      RecordFormat* record = reinterpret_cast<RecordFormat*>(result.data());
-      record->nextBlockId = kInvalidRecordId;
-      record->size = size;
-      // TODO: numeric_cast
-      memcpy(record->data, data, static_cast<size_t>(size));
+         m_begin = blockId;
+         m_end = blockId + m_length;
+         m_length = 2 * m_length < kMaxReadahead ? 2 * m_length : kMaxReadahead;
+      }
+
+   private:
+      static const size_t kFirstReadahead = 4;
+      static const size_t kMaxReadahead = 256;
+
+      BlockStorage<BlockSize>& m_storage;
+      bool m_enabled;
+      size_t m_length;
+      uint64_t m_begin;
+      uint64_t m_end;
+   };
 
-      return result;
+   bool isContiguous(const std::vector<Block<BlockSize> >& blocks)
+   {
+      for (size_t i = 1; i < blocks.size(); ++i) {
+         if (blocks[i].id() != blocks[i - 1].id() + m_storage->spanLength(blocks[i - 1])) return false;
+      }
+      return true;
    }
 
    Header* getHeader()
@@ -506,109 +1921,311 @@ private:
       return reinterpret_cast<Header*>(headerBlock.data());
    }
 
-   Block<BlockSize> getSpaceTrackingBlock()
+   // Whether the block, including the rest of its span, lies inside the
+   // storage. Used by optimistic readers that may see a torn header.
+   bool isReadable(uint64_t blockId)
    {
-      // std::cout << "getSpaceTrackingBlock()" << std::endl;
+      return blockId < m_storage->capacity();
+   }
 
-      if (getHeader()->freedBlocksBlockId == 0) {
-         Block<BlockSize> block = m_storage->create();
-         initializeRecordFormat(block);
+   bool isReadable(const Block<BlockSize>& block)
+   {
+      return block.blockSize() >= BlockSize &&
+             recordCapacity(block) <= spanRecordCapacity(BlockStorage<BlockSize>::kMaxSpanLength) &&
+             block.id() + m_storage->spanLength(block) <= m_storage->capacity();
+   }
 
-         // std::cout << "Creating Space Tracking block: id=" << block.id() << std::endl;
-         getHeader()->freedBlocksBlockId = block.id();
-         // std::cout << "Returning Space Tracking block: id=" << getHeader()->freedBlocksBlockId << std::endl;
-         return block;
-      } else {
-         // std::cout << "Returning Space Tracking block: id=" << getHeader()->freedBlocksBlockId << std::endl;
-         // TODO: numeric_cast
-         return m_storage->at(static_cast<size_t>(getHeader()->freedBlocksBlockId));
-      }
+   static bool isSlotted(RecordId recordId)
+   {
+      return (recordId >> kSlotShift) != 0;
    }
 
-   void markAsFree(Block<BlockSize>& block)
+   static uint64_t pageIdOf(RecordId recordId)
    {
-      // std::cout << "markAsFree(block: id=" << block.id() << ")" << std::endl;
-      Block<BlockSize> spaceTrackingBlock = getSpaceTrackingBlock();
-      while (hasNextBlockId(spaceTrackingBlock)) {
-         // TODO: numeric_cast
-         spaceTrackingBlock = m_storage->at(static_cast<size_t>(nextBlockId(spaceTrackingBlock)));
+      return recordId & ((uint64_t(1) << kSlotShift) - 1);
+   }
+
+   static uint64_t slotOf(RecordId recordId)
+   {
+      return (recordId >> kSlotShift) - 1;
+   }
+
+   static RecordId toSlottedRecordId(uint64_t pageId, uint64_t slot)
+   {
+      return ((slot + 1) << kSlotShift) | pageId;
+   }
+
+   static size_t pageCapacity()
+   {
+      return static_cast<size_t>(BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE);
+   }
+
+   PageFormat* getPageFormat(uint64_t pageId)
+   {
+      // TODO: numeric_cast
+      Block<BlockSize> block = m_storage->at(static_cast<size_t>(pageId));
+      return reinterpret_cast<PageFormat*>(block.data());
+   }
+
+   static size_t freeBytes(const PageFormat* page)
+   {
+      return page->dataBegin - offsetof(PageFormat, slots) - page->numSlots * sizeof(Slot);
+   }
+
+   void getSlotted(RecordId recordId, const uint8_t*& data, size_t& size)
+   {
+      PageFormat* page = getPageFormat(pageIdOf(recordId));
+      assert(slotOf(recordId) < page->numSlots);
+      const Slot& slot = page->slots[slotOf(recordId)];
+      assert(slot.offset != 0 && !isForwardSlot(slot));
+
+      data = reinterpret_cast<const uint8_t*>(page) + slot.offset;
+      size = slot.size;
+   }
+
+   RecordId addSlotted(GatherReader& reader, size_t size)
+   {
+      // A new slot may be needed on top of the record itself.
+      uint64_t pageId = findPage(size + sizeof(Slot));
+      PageFormat* page = getPageFormat(pageId);
+      // TODO: numeric_cast
+      Block<BlockSize> pageBlock = m_storage->at(static_cast<size_t>(pageId));
+      pageBlock.beginWrite();
+
+      uint32_t slotIndex = 0;
+      while (slotIndex < page->numSlots && page->slots[slotIndex].offset != 0) {
+         ++slotIndex;
+      }
+      if (slotIndex == page->numSlots) {
+         page->numSlots += 1;
       }
 
       // TODO: numeric_cast
-      size_t neededSize = static_cast<size_t>(recordDataSize(spaceTrackingBlock) + sizeof(uint64_t));
-      if (neededSize > recordCapacity(spaceTrackingBlock)) {
-         Block<BlockSize> newSpaceTrackingBlock = m_storage->create();
-         initializeRecordFormat(newSpaceTrackingBlock);
-         setPrevBlockId(newSpaceTrackingBlock, spaceTrackingBlock.id());
+      page->dataBegin -= static_cast<uint32_t>(size);
+      reader.read(reinterpret_cast<uint8_t*>(page) + page->dataBegin, size);
+      page->slots[slotIndex].offset = page->dataBegin;
+      page->slots[slotIndex].size = static_cast<uint32_t>(size);
+      pageBlock.endWrite();
+
+      updatePageHint(pageId, freeBytes(page));
+      return toSlottedRecordId(pageId, slotIndex);
+   }
 
-         setNextBlockId(spaceTrackingBlock, newSpaceTrackingBlock.id());
+   // Removes the record and moves the records packed in front of it up to
+   // close the gap, so the free space of a page is always in one piece.
+   void eraseSlotted(RecordId recordId)
+   {
+      const uint64_t pageId = pageIdOf(recordId);
+      PageFormat* page = getPageFormat(pageId);
+      assert(slotOf(recordId) < page->numSlots);
+      Slot& slot = page->slots[slotOf(recordId)];
+      assert(slot.offset != 0);
 
-         uint64_t blockId = block.id();
-         recordDataAppend(newSpaceTrackingBlock, reinterpret_cast<uint8_t*>(&blockId), sizeof(uint64_t));
+      // Records packed in front of this one move, readers have to retry.
+      // TODO: numeric_cast
+      Block<BlockSize> pageBlock = m_storage->at(static_cast<size_t>(pageId));
+      pageBlock.beginWrite();
+      if (isForwardSlot(slot)) {
+         slot.offset = 0;
+         slot.size = 0;
       } else {
-         // std::cout << "Appending Free block: id=" << block.id() << std::endl;
-         // std::cout << "   Block size before: size=" << recordDataSize(spaceTrackingBlock) << std::endl;
-         uint64_t blockId = block.id();
-         recordDataAppend(spaceTrackingBlock, reinterpret_cast<uint8_t*>(&blockId), sizeof(uint64_t));
-         // std::cout << "   Block size after: size=" << recordDataSize(spaceTrackingBlock) << std::endl;
+         removeSlotData(page, slot);
       }
 
-      setRecordFree(block, true);
+      while (page->numSlots > 0 && page->slots[page->numSlots - 1].offset == 0) {
+         page->numSlots -= 1;
+      }
+      pageBlock.endWrite();
 
-      getHeader()->numFreeBlocks += 1;
+      updatePageHint(pageId, freeBytes(page));
    }
 
-   Block<BlockSize> popFreeBlock()
+   // Moves the records packed in front of the slot up over its data and
+   // empties the slot.
+   static void removeSlotData(PageFormat* page, Slot& slot)
    {
-      // std::cout << "popFreeBlock" << std::endl;
-      if (getHeader()->numFreeBlocks == 0) {
-         // TODO: throw exception
+      uint8_t* base = reinterpret_cast<uint8_t*>(page);
+      std::memmove(base + page->dataBegin + slot.size, base + page->dataBegin, slot.offset - page->dataBegin);
+      for (uint32_t i = 0; i < page->numSlots; ++i) {
+         if (page->slots[i].offset != 0 && page->slots[i].offset < slot.offset) {
+            page->slots[i].offset += slot.size;
+         }
       }
+      page->dataBegin += slot.size;
+      slot.offset = 0;
+      slot.size = 0;
+   }
 
-      Block<BlockSize> spaceTrackingBlock = getSpaceTrackingBlock();
-      while (hasNextBlockId(spaceTrackingBlock)) {
-         // TODO: numeric_cast
-         spaceTrackingBlock = m_storage->at(static_cast<size_t>(nextBlockId(spaceTrackingBlock)));
+   // Bytes the record could grow to without leaving its page.
+   size_t slottedSpaceFor(RecordId recordId)
+   {
+      PageFormat* page = getPageFormat(pageIdOf(recordId));
+      return freeBytes(page) + page->slots[slotOf(recordId)].size;
+   }
+
+   static bool isForwardSlot(const Slot& slot)
+   {
+      return (slot.offset & kForwardMarker) == kForwardMarker;
+   }
+
+   static RecordId forwardIdOf(const Slot& slot)
+   {
+      return (static_cast<uint64_t>(slot.offset & ~kForwardMarker) << 32) | slot.size;
+   }
+
+   // Id the data of the record is found under: the chain a packed record
+   // was forwarded to, the record id itself otherwise.
+   RecordId locate(RecordId recordId)
+   {
+      if (!isSlotted(recordId)) return recordId;
+
+      const PageFormat* page = getPageFormat(pageIdOf(recordId));
+      if (slotOf(recordId) >= page->numSlots) return recordId;
+      const Slot& slot = page->slots[slotOf(recordId)];
+      return isForwardSlot(slot) ? forwardIdOf(slot) : recordId;
+   }
+
+   // Moves the record out of its page into a chain of blocks written like an
+   // unpacked record and forwards the slot to it. The chain is complete
+   // before the slot switches over.
+   void forwardSlotted(RecordId recordId, const uint8_t* data, size_t size)
+   {
+      static_assert(BlockSize < kForwardMarker, "Offsets in a page must stay below kForwardMarker");
+
+      bool contiguous = false;
+      const RecordId chainId = insert(data, size, contiguous, false);
+
+      const uint64_t pageId = pageIdOf(recordId);
+      PageFormat* page = getPageFormat(pageId);
+      Slot& slot = page->slots[slotOf(recordId)];
+      // TODO: numeric_cast
+      Block<BlockSize> pageBlock = m_storage->at(static_cast<size_t>(pageId));
+      pageBlock.beginWrite();
+      removeSlotData(page, slot);
+      slot.offset = kForwardMarker | static_cast<uint32_t>(chainId >> 32);
+      slot.size = static_cast<uint32_t>(chainId);
+      pageBlock.endWrite();
+
+      updatePageHint(pageId, freeBytes(page));
+      updateContiguousCount(true, contiguous);
+   }
+
+   void replaceSlotted(RecordId recordId, const uint8_t* data, size_t size)
+   {
+      const uint64_t pageId = pageIdOf(recordId);
+      PageFormat* page = getPageFormat(pageId);
+      Slot& slot = page->slots[slotOf(recordId)];
+
+      // TODO: numeric_cast
+      Block<BlockSize> pageBlock = m_storage->at(static_cast<size_t>(pageId));
+      pageBlock.beginWrite();
+      removeSlotData(page, slot);
+      // TODO: numeric_cast
+      page->dataBegin -= static_cast<uint32_t>(size);
+      std::memcpy(reinterpret_cast<uint8_t*>(page) + page->dataBegin, data, size);
+      slot.offset = page->dataBegin;
+      slot.size = static_cast<uint32_t>(size);
+      pageBlock.endWrite();
+
+      updatePageHint(pageId, freeBytes(page));
+   }
+
+   // Returns a page with at least neededBytes free, the fullest one that fits.
+   uint64_t findPage(size_t neededBytes)
+   {
+      refreshPageHints();
+
+      auto it = m_pagesByFreeBytes.lower_bound(std::make_pair(neededBytes, uint64_t(0)));
+      while (it != m_pagesByFreeBytes.end()) {
+         uint64_t pageId = it->second;
+         size_t actualFreeBytes = freeBytes(getPageFormat(pageId));
+         if (actualFreeBytes >= neededBytes) return pageId;
+
+         // Another process filled the page.
+         updatePageHint(pageId, actualFreeBytes);
+         it = m_pagesByFreeBytes.lower_bound(std::make_pair(neededBytes, uint64_t(0)));
       }
 
-      uint64_t freeBlockId = kInvalidRecordId;
-      // std::cout << "   Block size before: size=" << recordDataSize(spaceTrackingBlock) << std::endl;
-      recordDataPop(spaceTrackingBlock, reinterpret_cast<uint8_t*>(&freeBlockId), sizeof(uint64_t));
-      // std::cout << "   Block size after: size=" << recordDataSize(spaceTrackingBlock) << std::endl;
+      Block<BlockSize> block = m_storage->create();
+      PageFormat* page = reinterpret_cast<PageFormat*>(block.data());
+      page->nextPageId = getHeader()->firstPageId;
+      page->numSlots = 0;
+      page->dataBegin = static_cast<uint32_t>(pageCapacity());
+      getHeader()->firstPageId = block.id();
+      getHeader()->numPages += 1;
 
-      // Check if that spaceTrackingBlock is empty. If so we should free it.
-      if (recordDataSize(spaceTrackingBlock) == 0) {
-         if (hasPrevBlockId(spaceTrackingBlock)) {
-            Block<BlockSize> prevSpaceTrackingBlock = m_storage->at(static_cast<size_t>(prevBlockId(spaceTrackingBlock)));
-            setNextBlockId(prevSpaceTrackingBlock, 0);
+      updatePageHint(block.id(), freeBytes(page));
+      return block.id();
+   }
 
-            markAsFree(spaceTrackingBlock);
-         }
+   void updatePageHint(uint64_t pageId, size_t freeBytes)
+   {
+      auto it = m_pageFreeBytes.find(pageId);
+      if (it != m_pageFreeBytes.end()) {
+         m_pagesByFreeBytes.erase(std::make_pair(it->second, pageId));
+         it->second = freeBytes;
+      } else {
+         m_pageFreeBytes.emplace(pageId, freeBytes);
       }
+      m_pagesByFreeBytes.emplace(freeBytes, pageId);
+   }
+
+   // Reads the page list again when pages were added by someone else.
+   void refreshPageHints()
+   {
+      if (m_pageFreeBytes.size() == getHeader()->numPages) return;
 
-      getHeader()->numFreeBlocks -= 1;
-      return m_storage->at(static_cast<size_t>(freeBlockId));
+      m_pageFreeBytes.clear();
+      m_pagesByFreeBytes.clear();
+      for (uint64_t pageId = getHeader()->firstPageId; pageId != kInvalidRecordId; pageId = getPageFormat(pageId)->nextPageId) {
+         updatePageHint(pageId, freeBytes(getPageFormat(pageId)));
+      }
    }
 
    std::vector<Block<BlockSize> > getFreeBlocks(size_t size)
    {
        // std::cout << "getFreeBlocks(size=" << size << ")" << std::endl;
-       std::vector<Block<BlockSize> > blocks;
+       if (allocation() == RecordAllocation::SizeClasses) {
+          return getFreeSpans(size);
+       }
 
-       size_t remainder = size % BlockSize == 0 ? 0 : 1;
-       size_t numBlocks = (size / BlockSize) + remainder;
+       // No matter what size (even when 0) a record takes at least one block.
+       const size_t capacityPerBlock = static_cast<size_t>(BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE - offsetof(RecordFormat, data));
+       size_t numBlocks = std::max<size_t>(1, (size + capacityPerBlock - 1) / capacityPerBlock);
+
+       return m_storage->createExtent(numBlocks);
+   }
 
-       blocks.reserve(numBlocks);
+   // Longest spans first, the rest of the record goes into the smallest span
+   // it fits in.
+   std::vector<Block<BlockSize> > getFreeSpans(size_t size)
+   {
+       std::vector<Block<BlockSize> > spans;
 
-       while (numBlocks > 0 && getHeader()->numFreeBlocks > 0) {
-          blocks.push_back(popFreeBlock());
-          --numBlocks;
+       const size_t maxSpanCapacity = spanRecordCapacity(BlockStorage<BlockSize>::kMaxSpanLength);
+       while (size > maxSpanCapacity) {
+          spans.push_back(m_storage->createSpan(BlockStorage<BlockSize>::kMaxSpanLength));
+          size -= maxSpanCapacity;
        }
 
-       for (size_t i = 0; i < numBlocks; ++i) {
-           blocks.push_back(m_storage->create());
+       spans.push_back(m_storage->createSpan(spanLengthFor(size)));
+
+       return spans;
+   }
+
+   // Length of the shortest span size bytes fit in.
+   size_t spanLengthFor(size_t size)
+   {
+       size_t length = 1;
+       while (spanRecordCapacity(length) < size) {
+          length *= 2;
        }
+       return length;
+   }
 
-       return blocks;
+   size_t spanRecordCapacity(size_t length)
+   {
+       // TODO: numeric_cast
+       return static_cast<size_t>((length - 1) * m_storage->blockStride() + BlockSize - Block<BlockSize>::MIN_BLOCK_SIZE - offsetof(RecordFormat, data));
    }
 };
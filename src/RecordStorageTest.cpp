@@ -2,9 +2,12 @@
 
 #include "BlockStorage.h"
 #include "RecordStorage.h"
+#include "ReservedMemory.h"
+#include <atomic>
 #include <iterator>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 TEST_CASE("Create/Delete RecordStorage", "[RecordStorage]") {
@@ -45,6 +48,25 @@ TEST_CASE("Get Record from RecordStorage", "[RecordStorage]") {
     REQUIRE(result == testString);
 }
 
+TEST_CASE("Get multi Block Record from RecordStorage", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(
+            std::make_unique<FakeSharedMemory>(0U)));
+
+    std::vector<uint8_t> data(10000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    RecordId recordId = storage.add(data.data(), data.size());
+    REQUIRE(storage.get(recordId) == data);
+
+    RecordId emptyRecordId = storage.add(nullptr, 0);
+    REQUIRE(emptyRecordId != kInvalidRecordId);
+    REQUIRE(storage.get(emptyRecordId).empty());
+    REQUIRE(storage.get(recordId) == data);
+}
+
 TEST_CASE("Erase Record from RecordStorage", "[RecordStorage]") {
     RecordStorage<1028> storage(
         std::make_unique<BlockStorage<1028> >(
@@ -91,6 +113,160 @@ TEST_CASE("Erase Record from RecordStorage", "[RecordStorage]") {
     REQUIRE(storage.size() == 2U);
 }
 
+TEST_CASE("Multi Block Records use contiguous Blocks", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(
+            std::make_unique<FakeSharedMemory>(0U)));
+    REQUIRE(storage.contiguousFraction() == 1.0);
+
+    std::vector<uint8_t> small(10, 1);
+    std::vector<uint8_t> large(3000, 2);
+
+    std::vector<RecordId> smallIds;
+    for (size_t i = 0; i < 10; ++i) {
+        smallIds.push_back(storage.add(small.data(), small.size()));
+    }
+
+    // Leaves single free blocks behind, no run is long enough for the
+    // record, so it is spread over them.
+    for (size_t i = 0; i < smallIds.size(); i += 2) {
+        storage.erase(smallIds[i]);
+    }
+
+    RecordId largeId = storage.add(large.data(), large.size());
+    REQUIRE(!storage.isContiguous(largeId));
+    REQUIRE(storage.get(largeId) == large);
+    REQUIRE(storage.contiguousFraction() == 5.0 / 6.0);
+
+    // With a long enough run free the record goes there.
+    storage.erase(largeId);
+    for (size_t i = 1; i < smallIds.size(); i += 2) {
+        storage.erase(smallIds[i]);
+    }
+    RecordId runId = storage.add(large.data(), large.size());
+    REQUIRE(storage.isContiguous(runId));
+    REQUIRE(storage.get(runId) == large);
+    REQUIRE(storage.contiguousFraction() == 1.0);
+}
+
+TEST_CASE("Multi Block Records reuse scattered free Blocks", "[RecordStorage]") {
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<1028>* blocks = blockStorage.get();
+    RecordStorage<1028> storage(std::move(blockStorage));
+
+    std::vector<uint8_t> small(10, 1);
+    std::vector<RecordId> smallIds;
+    for (size_t i = 0; i < 1000; ++i) {
+        smallIds.push_back(storage.add(small.data(), small.size()));
+    }
+    for (size_t i = 0; i < smallIds.size(); i += 2) {
+        storage.erase(smallIds[i]);
+    }
+    const size_t capacity = blocks->capacity();
+    const size_t numFreeBlocks = blocks->numFreeBlocks();
+    REQUIRE(numFreeBlocks == 500U);
+
+    // Two blocks each, none of them fits into a run but all fit into the
+    // free blocks, the storage does not grow.
+    std::vector<uint8_t> record(1500, 2);
+    std::vector<RecordId> recordIds;
+    for (size_t i = 0; i < 250; ++i) {
+        recordIds.push_back(storage.add(record.data(), record.size()));
+    }
+    REQUIRE(blocks->numFreeBlocks() == 0U);
+    REQUIRE(blocks->capacity() == capacity);
+    for (RecordId recordId : recordIds) {
+        REQUIRE(storage.get(recordId) == record);
+    }
+    REQUIRE(storage.contiguousFraction() == 500.0 / 750.0);
+}
+
+TEST_CASE("Compact RecordStorage", "[RecordStorage]") {
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<1028>* blocks = blockStorage.get();
+    RecordStorage<1028> storage(std::move(blockStorage));
+
+    std::vector<uint8_t> small(10, 1);
+    std::vector<RecordId> smallIds;
+    for (size_t i = 0; i < 20; ++i) {
+        smallIds.push_back(storage.add(small.data(), small.size()));
+    }
+
+    std::vector<uint8_t> large(5000);
+    for (size_t i = 0; i < large.size(); ++i) {
+        large[i] = static_cast<uint8_t>(i * 3);
+    }
+    RecordId firstLargeId = storage.add(large.data(), large.size());
+    RecordId secondLargeId = storage.add(large.data(), large.size());
+
+    for (RecordId recordId : smallIds) {
+        storage.erase(recordId);
+    }
+    storage.erase(firstLargeId);
+    const size_t capacity = blocks->capacity();
+
+    size_t numMoves = 0;
+    while (size_t moves = storage.compact(2)) {
+        REQUIRE(moves <= 2U);
+        numMoves += moves;
+    }
+    REQUIRE(numMoves > 0U);
+    REQUIRE(blocks->capacity() < capacity);
+
+    REQUIRE(storage.size() == 1U);
+    REQUIRE(storage.get(secondLargeId) == large);
+    // The continuation blocks moved away from the head of the record.
+    REQUIRE(!storage.isContiguous(secondLargeId));
+    REQUIRE(storage.contiguousFraction() == 0.0);
+
+    storage.erase(secondLargeId);
+    REQUIRE(storage.size() == 0U);
+    REQUIRE(storage.contiguousFraction() == 1.0);
+}
+
+TEST_CASE("Records in size classes", "[RecordStorage]") {
+    std::unique_ptr<BlockStorage<256> > blockStorage = std::make_unique<BlockStorage<256> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<256>* blocks = blockStorage.get();
+    RecordStorage<256> storage(std::move(blockStorage), RecordAllocation::SizeClasses);
+    REQUIRE(storage.allocation() == RecordAllocation::SizeClasses);
+
+    std::vector<uint8_t> small(20, 1);
+    RecordId smallId = storage.add(small.data(), small.size());
+    REQUIRE(blocks->spanLength(blocks->at(smallId)) == 1U);
+
+    std::vector<uint8_t> medium(3000, 2);
+    RecordId mediumId = storage.add(medium.data(), medium.size());
+    REQUIRE(blocks->spanLength(blocks->at(mediumId)) == 16U);
+    REQUIRE(storage.isContiguous(mediumId));
+
+    // Larger than the longest span, chained from a long span and a short one.
+    std::vector<uint8_t> large(100000);
+    for (size_t i = 0; i < large.size(); ++i) {
+        large[i] = static_cast<uint8_t>(i * 7);
+    }
+    RecordId largeId = storage.add(large.data(), large.size());
+    REQUIRE(blocks->spanLength(blocks->at(largeId)) == BlockStorage<256>::kMaxSpanLength);
+
+    REQUIRE(storage.get(smallId) == small);
+    REQUIRE(storage.get(mediumId) == medium);
+    REQUIRE(storage.get(largeId) == large);
+    REQUIRE(storage.size() == 3U);
+
+    const size_t numUsedBlocks = blocks->size();
+    storage.erase(mediumId);
+    REQUIRE(blocks->size() == numUsedBlocks - 16);
+    storage.erase(largeId);
+    REQUIRE(storage.get(smallId) == small);
+
+    // The freed spans are reused.
+    RecordId reusedId = storage.add(medium.data(), medium.size());
+    REQUIRE(reusedId == mediumId);
+    REQUIRE(storage.get(reusedId) == medium);
+}
+
 template <size_t N>
 static void addData(RecordStorage<N>& storage, size_t size, std::vector<RecordId>& recordIds)
 {
@@ -112,6 +288,121 @@ static void eraseRecords(RecordStorage<N>& storage, InputIt first, InputIt last)
    }
 }
 
+TEST_CASE("Small Records in slotted pages", "[RecordStorage]") {
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<1028>* blocks = blockStorage.get();
+    RecordStorage<1028> storage(std::move(blockStorage), RecordAllocation::Chained, RecordPacking::SlottedPages);
+    REQUIRE(storage.packing() == RecordPacking::SlottedPages);
+
+    std::vector<RecordId> recordIds;
+    addData(storage, 1000, recordIds);
+    REQUIRE(storage.size() == 1000U);
+    // Around 50 records of 20 bytes fit into a page.
+    REQUIRE(storage.numPages() < 30U);
+    REQUIRE(blocks->size() == storage.numPages() + 1 /* header */);
+
+    for (size_t i = 0; i < recordIds.size(); ++i) {
+        REQUIRE(recordIds[i] != kInvalidRecordId);
+        std::vector<uint8_t> data = storage.get(recordIds[i]);
+        REQUIRE(std::string(reinterpret_cast<const char*>(data.data())) == "TestString" + std::to_string(i));
+    }
+
+    // Erasing moves the other records of a page, their ids stay valid.
+    for (size_t i = 0; i < recordIds.size(); i += 2) {
+        storage.erase(recordIds[i]);
+    }
+    REQUIRE(storage.size() == 500U);
+    for (size_t i = 1; i < recordIds.size(); i += 2) {
+        std::vector<uint8_t> data = storage.get(recordIds[i]);
+        REQUIRE(std::string(reinterpret_cast<const char*>(data.data())) == "TestString" + std::to_string(i));
+    }
+
+    // The space is reused before new pages are created.
+    const uint64_t numPages = storage.numPages();
+    std::vector<RecordId> moreRecordIds;
+    addData(storage, 500, moreRecordIds);
+    REQUIRE(storage.numPages() == numPages);
+    REQUIRE(storage.get(moreRecordIds[499]).size() == std::string("TestString499").size() + 1);
+
+    // Large records still get blocks of their own.
+    std::vector<uint8_t> large(2000, 7);
+    RecordId largeId = storage.add(large.data(), large.size());
+    REQUIRE(largeId < blocks->capacity());
+    REQUIRE(storage.get(largeId) == large);
+
+    std::vector<uint8_t> empty;
+    RecordId emptyId = storage.add(empty.data(), 0);
+    REQUIRE(storage.get(emptyId).empty());
+    storage.erase(emptyId);
+}
+
+TEST_CASE("Optimistic reads of Records while they change", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(std::make_unique<ReservedMemory>(64 << 20)),
+        RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    // Small records share pages with the ones the writer churns, large ones
+    // span several blocks.
+    std::vector<RecordId> recordIds;
+    std::vector<std::vector<uint8_t> > records;
+    for (size_t i = 0; i < 200; ++i) {
+        std::vector<uint8_t> data(i % 2 == 0 ? 16 : 3000, static_cast<uint8_t>(i));
+        recordIds.push_back(storage.add(data.data(), data.size()));
+        records.push_back(data);
+    }
+
+    std::vector<uint8_t> data;
+    REQUIRE(storage.tryGetOptimistic(recordIds[0], data));
+    REQUIRE(data == records[0]);
+    REQUIRE(storage.getOptimistic(recordIds[1]) == records[1]);
+
+    std::atomic<bool> done(false);
+    std::thread writer([&storage, &done]() {
+        std::mt19937 random(42);
+        std::vector<RecordId> churnIds;
+        for (size_t i = 0; i < 5000; ++i) {
+            std::lock_guard<RecordStorage<1028> > lock(storage);
+            if (churnIds.size() < 100 || random() % 2 == 0) {
+                std::vector<uint8_t> data(random() % 2 == 0 ? 16 : 2000, 0xFF);
+                churnIds.push_back(storage.add(data.data(), data.size()));
+            } else {
+                size_t index = random() % churnIds.size();
+                storage.erase(churnIds[index]);
+                churnIds[index] = churnIds.back();
+                churnIds.pop_back();
+            }
+        }
+        done = true;
+    });
+
+    std::vector<std::thread> readers;
+    std::atomic<size_t> numMismatches(0);
+    for (size_t t = 0; t < 4; ++t) {
+        readers.emplace_back([&]() {
+            do {
+                for (size_t i = 0; i < recordIds.size(); ++i) {
+                    if (storage.getOptimistic(recordIds[i]) != records[i]) {
+                        ++numMismatches;
+                    }
+                }
+            } while (!done);
+        });
+    }
+
+    writer.join();
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    REQUIRE(numMismatches == 0U);
+
+    // Readers may also share the lock.
+    std::shared_lock<RecordStorage<1028> > lock(storage);
+    for (size_t i = 0; i < recordIds.size(); ++i) {
+        REQUIRE(storage.get(recordIds[i]) == records[i]);
+    }
+}
+
 // TEST_CASE("Stress Erase Record from RecordStorage", "[RecordStorage]") {
 //     RecordStorage<1028> storage(
 //         std::make_unique<BlockStorage<1028> >(
@@ -166,3 +457,357 @@ static void eraseRecords(RecordStorage<N>& storage, InputIt first, InputIt last)
 //     REQUIRE(storage.size() == 0U);
 // 
 // }
+
+TEST_CASE("Replace Records", "[RecordStorage]") {
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<1028>* blocks = blockStorage.get();
+    RecordStorage<1028> storage(std::move(blockStorage), RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    std::vector<uint8_t> large(3000, 1);
+    RecordId largeId = storage.add(large.data(), large.size());
+    const size_t numBlocks = blocks->size();
+
+    // Growing and shrinking keeps the id, the blocks follow the size.
+    std::vector<uint8_t> larger(5000, 2);
+    storage.replace(largeId, larger.data(), larger.size());
+    REQUIRE(storage.get(largeId) == larger);
+    REQUIRE(blocks->size() > numBlocks);
+
+    std::vector<uint8_t> smaller(10, 3);
+    storage.replace(largeId, smaller.data(), smaller.size());
+    REQUIRE(storage.get(largeId) == smaller);
+    REQUIRE(blocks->size() == 3U /* header, record and free space map */);
+    REQUIRE(storage.size() == 1U);
+    REQUIRE(storage.contiguousFraction() == 1.0);
+
+    std::vector<uint8_t> small(20, 4);
+    RecordId smallId = storage.add(small.data(), small.size());
+    RecordId otherId = storage.add(small.data(), small.size());
+    std::vector<uint8_t> bigger(100, 5);
+    storage.replace(smallId, bigger.data(), bigger.size());
+    REQUIRE(storage.get(smallId) == bigger);
+    REQUIRE(storage.get(otherId) == small);
+
+    // Too large for the page, the record moves into blocks of its own and
+    // keeps its id.
+    RecordStorage<1028>::Snapshot snapshot = storage.snapshot();
+    storage.replace(smallId, large.data(), large.size());
+    REQUIRE(storage.get(smallId) == large);
+    REQUIRE(storage.recordSize(smallId) == large.size());
+    REQUIRE(storage.getOptimistic(smallId) == large);
+    REQUIRE(storage.pin(smallId).size() == large.size());
+    REQUIRE(storage.get(otherId) == small);
+    std::vector<uint8_t> data;
+    REQUIRE(snapshot.get(smallId, data));
+    REQUIRE(data == bigger);
+    REQUIRE(storage.contiguousFraction() == 1.0);
+
+    const uint8_t patch[] = {9, 9};
+    storage.update(smallId, 2000, patch, sizeof(patch));
+    REQUIRE(storage.get(smallId)[2001] == 9);
+    storage.resize(smallId, 10);
+    REQUIRE(storage.get(smallId) == std::vector<uint8_t>(10, 1));
+
+    const size_t numBlocksForwarded = blocks->size();
+    storage.erase(smallId);
+    REQUIRE(storage.size() == 2U);
+    RecordId nextId = storage.add(small.data(), small.size());
+    REQUIRE(storage.get(nextId) == small);
+    REQUIRE(blocks->size() <= numBlocksForwarded);
+}
+
+TEST_CASE("Snapshots of RecordStorage", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(std::make_unique<FakeSharedMemory>(0U)),
+        RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    std::vector<uint8_t> first(2000, 1);
+    std::vector<uint8_t> second(30, 2);
+    RecordId changedId = storage.add(first.data(), first.size());
+    RecordId erasedId = storage.add(second.data(), second.size());
+
+    std::vector<uint8_t> data;
+    {
+        RecordStorage<1028>::Snapshot snapshot = storage.snapshot();
+
+        std::vector<uint8_t> changed(500, 3);
+        storage.replace(changedId, changed.data(), changed.size());
+        storage.erase(erasedId);
+        RecordId addedId = storage.add(second.data(), second.size());
+        REQUIRE(storage.numVersions() == 2U);
+        REQUIRE(storage.size() == 2U);
+
+        REQUIRE(snapshot.get(changedId, data));
+        REQUIRE(data == first);
+        REQUIRE(snapshot.get(erasedId, data));
+        REQUIRE(data == second);
+        REQUIRE((!snapshot.get(addedId, data) || addedId == erasedId));
+
+        // A later snapshot sees the changes, changing the record again only
+        // needs a copy for it.
+        RecordStorage<1028>::Snapshot later = storage.snapshot();
+        REQUIRE(later.get(changedId, data));
+        REQUIRE(data == changed);
+        storage.replace(changedId, first.data(), first.size());
+        REQUIRE(storage.numVersions() == 3U);
+        REQUIRE(later.get(changedId, data));
+        REQUIRE(data == changed);
+        REQUIRE(snapshot.get(changedId, data));
+        REQUIRE(data == first);
+    }
+
+    // Nobody sees the old versions anymore, the next change drops them.
+    storage.replace(changedId, second.data(), second.size());
+    REQUIRE(storage.numVersions() == 0U);
+    REQUIRE(storage.get(changedId) == second);
+}
+
+TEST_CASE("Snapshots do not see updates in place", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(std::make_unique<FakeSharedMemory>(0U)),
+        RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    std::vector<uint8_t> small(100, 'a');
+    std::vector<uint8_t> big(2000, 'a');
+    RecordId smallId = storage.add(small.data(), small.size());
+    RecordId bigId = storage.add(big.data(), big.size());
+
+    std::vector<uint8_t> data;
+    {
+        RecordStorage<1028>::Snapshot snapshot = storage.snapshot();
+        const uint8_t patch[] = {'b', 'b', 'b', 'b'};
+        storage.update(smallId, 0, patch, sizeof(patch));
+        storage.update(bigId, 1500, patch, sizeof(patch));
+        storage.update(bigId, 0, patch, sizeof(patch));
+        REQUIRE(storage.numVersions() == 2U);
+
+        REQUIRE(snapshot.get(smallId, data));
+        REQUIRE(data == small);
+        REQUIRE(snapshot.get(bigId, data));
+        REQUIRE(data == big);
+        REQUIRE(storage.get(smallId)[0] == 'b');
+        REQUIRE(storage.get(bigId)[1503] == 'b');
+    }
+
+    // The kept versions go away with the next change.
+    storage.replace(smallId, small.data(), small.size());
+    REQUIRE(storage.numVersions() == 0U);
+}
+
+TEST_CASE("Scan a Snapshot while Records change", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(std::make_unique<ReservedMemory>(64 << 20)),
+        RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    std::vector<RecordId> recordIds;
+    for (size_t i = 0; i < 100; ++i) {
+        std::vector<uint8_t> data(i % 2 == 0 ? 16 : 1500, 0);
+        recordIds.push_back(storage.add(data.data(), data.size()));
+    }
+
+    std::atomic<bool> scanning(true);
+    std::thread writer([&]() {
+        for (uint8_t round = 1; scanning; round = static_cast<uint8_t>(round % 200 + 1)) {
+            for (size_t i = 0; i < recordIds.size(); ++i) {
+                std::lock_guard<RecordStorage<1028> > lock(storage);
+                std::vector<uint8_t> data(i % 2 == 0 ? 16 : 1500, round);
+                storage.replace(recordIds[i], data.data(), data.size());
+            }
+        }
+    });
+
+    // Every scan sees the records of one point in time, they were all written
+    // in the same round or the next one.
+    for (size_t scan = 0; scan < 20; ++scan) {
+        RecordStorage<1028>::Snapshot snapshot = storage.snapshot();
+        std::vector<uint8_t> values;
+        for (RecordId recordId : recordIds) {
+            std::vector<uint8_t> data;
+            REQUIRE(snapshot.get(recordId, data));
+            REQUIRE(std::all_of(data.begin(), data.end(), [&data](uint8_t byte) { return byte == data[0]; }));
+            values.push_back(data[0]);
+        }
+        for (size_t i = 1; i < values.size(); ++i) {
+            REQUIRE((values[i] == values[i - 1] || values[i] + 1 == values[i - 1] || (values[i] == 200 && values[i - 1] == 1)));
+        }
+    }
+    scanning = false;
+    writer.join();
+
+    std::lock_guard<RecordStorage<1028> > lock(storage);
+    std::vector<uint8_t> data(16, 0);
+    storage.replace(recordIds[0], data.data(), data.size());
+    REQUIRE(storage.numVersions() == 0U);
+}
+
+TEST_CASE("Read Records in place", "[RecordStorage]") {
+    RecordStorage<1028> storage(
+        std::make_unique<BlockStorage<1028> >(std::make_unique<FakeSharedMemory>(0U)),
+        RecordAllocation::Chained, RecordPacking::SlottedPages);
+
+    std::vector<uint8_t> large(5000);
+    for (size_t i = 0; i < large.size(); ++i) {
+        large[i] = static_cast<uint8_t>(i * 7);
+    }
+    std::vector<uint8_t> small(30, 9);
+    RecordId largeId = storage.add(large.data(), large.size());
+    RecordId smallId = storage.add(small.data(), small.size());
+    REQUIRE(storage.recordSize(largeId) == large.size());
+    REQUIRE(storage.recordSize(smallId) == small.size());
+
+    {
+        RecordStorage<1028>::PinnedRecord pinned = storage.pin(largeId);
+        REQUIRE(pinned.size() == large.size());
+        REQUIRE(pinned.iovcnt() > 1);
+        std::vector<uint8_t> data;
+        for (const iovec& segment : pinned.segments()) {
+            const uint8_t* base = static_cast<const uint8_t*>(segment.iov_base);
+            data.insert(data.end(), base, base + segment.iov_len);
+        }
+        REQUIRE(data == large);
+    }
+
+    {
+        RecordStorage<1028>::PinnedRecord pinned = storage.pin(smallId);
+        REQUIRE(pinned.iovcnt() == 1);
+        REQUIRE(std::vector<uint8_t>(static_cast<const uint8_t*>(pinned.iov()->iov_base),
+                                     static_cast<const uint8_t*>(pinned.iov()->iov_base) + pinned.size()) == small);
+    }
+
+    // Pins are released, writers get the lock again.
+    storage.erase(smallId);
+
+    std::vector<uint8_t> buffer(100);
+    REQUIRE(storage.get(largeId, buffer.data(), buffer.size()) == large.size());
+    buffer.resize(large.size());
+    REQUIRE(storage.get(largeId, buffer.data(), buffer.size()) == large.size());
+    REQUIRE(buffer == large);
+}
+
+TEST_CASE("Stream Records into RecordStorage", "[RecordStorage]") {
+    RecordAllocation allocation = GENERATE(RecordAllocation::Chained, RecordAllocation::SizeClasses);
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<1028>* blocks = blockStorage.get();
+    RecordStorage<1028> storage(std::move(blockStorage), allocation, RecordPacking::SlottedPages);
+
+    std::vector<uint8_t> record(20000);
+    for (size_t i = 0; i < record.size(); ++i) {
+        record[i] = static_cast<uint8_t>(i * 13);
+    }
+
+    // Written in uneven pieces, as they would arrive from the network.
+    RecordStorage<1028>::RecordWriter writer = storage.writer();
+    for (size_t offset = 0; offset < record.size(); offset += 777) {
+        writer.write(record.data() + offset, std::min<size_t>(777, record.size() - offset));
+    }
+    REQUIRE(writer.size() == record.size());
+    REQUIRE(storage.size() == 0U);
+    RecordId recordId = writer.close();
+    REQUIRE(storage.size() == 1U);
+    REQUIRE(storage.get(recordId) == record);
+
+    // An empty record still gets its block.
+    RecordId emptyId = storage.writer().close();
+    REQUIRE(storage.get(emptyId).empty());
+
+    // A writer that is not closed gives its blocks back. The first block
+    // freed also creates the free space map.
+    const size_t numBlocks = blocks->size() + 1U /* free space map */;
+    {
+        RecordStorage<1028>::RecordWriter dropped = storage.writer();
+        dropped.write(record.data(), record.size());
+        REQUIRE(blocks->size() > numBlocks);
+    }
+    REQUIRE(blocks->size() == numBlocks);
+    REQUIRE(storage.size() == 2U);
+
+    // Gathered from several buffers, packed when small enough.
+    const uint8_t header[] = {1, 2, 3};
+    iovec small[] = {{const_cast<uint8_t*>(header), sizeof(header)}, {nullptr, 0}, {record.data(), 10}};
+    RecordId smallId = storage.add(small, 3);
+    std::vector<uint8_t> expected(header, header + sizeof(header));
+    expected.insert(expected.end(), record.begin(), record.begin() + 10);
+    REQUIRE(storage.get(smallId) == expected);
+
+    iovec large[] = {{record.data(), 5000}, {record.data() + 5000, 15000}};
+    RecordId largeId = storage.add(large, 2);
+    REQUIRE(storage.get(largeId) == record);
+    REQUIRE(storage.size() == 4U);
+
+    RecordStorage<1028>::RecordWriter gathered = storage.writer();
+    gathered.write(large, 2);
+    REQUIRE(storage.get(gathered.close()) == record);
+
+    storage.erase(recordId);
+    storage.erase(largeId);
+    REQUIRE(storage.size() == 3U);
+}
+
+TEST_CASE("Append to and resize Records in place", "[RecordStorage]") {
+    RecordAllocation allocation = GENERATE(RecordAllocation::Chained, RecordAllocation::SizeClasses);
+    std::unique_ptr<BlockStorage<1028> > blockStorage = std::make_unique<BlockStorage<1028> >(
+        std::make_unique<FakeSharedMemory>(0U));
+    BlockStorage<1028>* blocks = blockStorage.get();
+    RecordStorage<1028> storage(std::move(blockStorage), allocation, RecordPacking::SlottedPages);
+
+    std::vector<uint8_t> record(1000, 1);
+    RecordId recordId = storage.add(record.data(), record.size());
+    RecordStorage<1028>::Snapshot snapshot = storage.snapshot();
+
+    // Appending keeps the id, the old blocks keep their data.
+    std::vector<uint8_t> more(5000);
+    for (size_t i = 0; i < more.size(); ++i) {
+        more[i] = static_cast<uint8_t>(i);
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        storage.append(recordId, more.data(), more.size());
+        record.insert(record.end(), more.begin(), more.end());
+        REQUIRE(storage.get(recordId) == record);
+    }
+    REQUIRE(storage.recordSize(recordId) == 21000U);
+    REQUIRE(storage.size() == 1U);
+    REQUIRE(storage.contiguousFraction() == (storage.isContiguous(recordId) ? 1.0 : 0.0));
+
+    std::vector<uint8_t> data;
+    REQUIRE(snapshot.get(recordId, data));
+    REQUIRE(data == std::vector<uint8_t>(1000, 1));
+
+    // Changing a few bytes in the middle.
+    const uint8_t patch[] = {9, 9, 9};
+    storage.update(recordId, 12345, patch, sizeof(patch));
+    std::copy(patch, patch + sizeof(patch), record.begin() + 12345);
+    REQUIRE(storage.get(recordId) == record);
+
+    // Shrinking frees the blocks at the end, growing fills with zeros.
+    const size_t numBlocks = blocks->size();
+    storage.resize(recordId, 3000);
+    record.resize(3000);
+    REQUIRE(storage.get(recordId) == record);
+    REQUIRE(blocks->size() < numBlocks);
+    REQUIRE(storage.contiguousFraction() == (storage.isContiguous(recordId) ? 1.0 : 0.0));
+    storage.resize(recordId, 4000);
+    record.resize(4000, 0);
+    REQUIRE(storage.get(recordId) == record);
+    storage.resize(recordId, 0);
+    REQUIRE(storage.get(recordId).empty());
+    storage.append(recordId, more.data(), 10);
+    REQUIRE(storage.get(recordId) == std::vector<uint8_t>(more.begin(), more.begin() + 10));
+
+    // Packed records stay in their page as long as they fit.
+    std::vector<uint8_t> small(10, 3);
+    RecordId smallId = storage.add(small.data(), small.size());
+    storage.append(smallId, small.data(), small.size());
+    REQUIRE(storage.get(smallId) == std::vector<uint8_t>(20, 3));
+    storage.resize(smallId, 5);
+    REQUIRE(storage.get(smallId) == std::vector<uint8_t>(5, 3));
+    storage.append(smallId, more.data(), more.size());
+    REQUIRE(storage.recordSize(smallId) == 5 + more.size());
+    storage.append(smallId, more.data(), 10);
+    std::vector<uint8_t> grown(5, 3);
+    grown.insert(grown.end(), more.begin(), more.end());
+    grown.insert(grown.end(), more.begin(), more.begin() + 10);
+    REQUIRE(storage.get(smallId) == grown);
+    REQUIRE(storage.size() == 2U);
+}
@@ -1,6 +1,10 @@
 #include <catch.hpp>
 
 #include "BlockStorage.h"
+#include <iterator>
+#include <numeric>
+#include <sstream>
+#include <vector>
 
 TEST_CASE("Create RecordView", "[RecordView]") {
     std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
@@ -13,5 +17,81 @@ TEST_CASE("Create RecordView", "[RecordView]") {
     REQUIRE(record.capacity() > 0U);
     REQUIRE(record.size() == 0U);
     REQUIRE(record.data().empty() == true);
+    REQUIRE(record.begin() == record.end());
+    REQUIRE(record.cbegin() == record.cend());
+    REQUIRE(record.segments().empty());
+    uint8_t byte = 0;
+    REQUIRE(record.copyTo(&byte, 1) == 0U);
 }
 
+
+TEST_CASE("Assign and iterate RecordView", "[RecordView]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    RecordView<1028> record = RecordView<1028>::createRecordView(storage.create());
+    std::vector<uint8_t> data(2500);
+    std::iota(data.begin(), data.end(), uint8_t(0));
+    record.assign(data.begin(), data.end());
+    REQUIRE(record.size() == data.size());
+    REQUIRE(record.numBlocks() == 3U);
+    REQUIRE(record.data() == data);
+    REQUIRE(record[2400] == data[2400]);
+
+    // Forwards and backwards across the blocks.
+    REQUIRE(std::equal(record.begin(), record.end(), data.begin(), data.end()));
+    REQUIRE(std::distance(record.cbegin(), record.cend()) == 2500);
+    RecordView<1028>::iterator it = record.end();
+    for (size_t i = data.size(); i > 0; --i) {
+        REQUIRE(*--it == data[i - 1]);
+    }
+    REQUIRE(it == record.begin());
+    REQUIRE(record.segments().size() == 3U);
+
+    std::vector<uint8_t> buffer(data.size());
+    REQUIRE(record.copyTo(buffer.data(), buffer.size()) == data.size());
+    REQUIRE(buffer == data);
+
+    // Shrinking gives the blocks at the end back.
+    const size_t numBlocks = storage.size();
+    record.assign(10, 7);
+    REQUIRE(record.data() == std::vector<uint8_t>(10, 7));
+    REQUIRE(record.numBlocks() == 1U);
+    REQUIRE(storage.size() == numBlocks - 2U + 1U /* free space map */);
+
+    // Read once, like from a stream.
+    std::istringstream stream("abc");
+    record.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    REQUIRE(record.data() == std::vector<uint8_t>({'a', 'b', 'c'}));
+}
+
+TEST_CASE("Compact the blocks of a RecordView", "[RecordView]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    storage.createN(10);
+    RecordView<1028> record = RecordView<1028>::createRecordView(storage.create());
+    std::vector<uint8_t> data(2500);
+    std::iota(data.begin(), data.end(), uint8_t(0));
+    record.assign(data.begin(), data.end());
+    REQUIRE(storage.at(11).tag() == BlockTag::RecordContinuation);
+    REQUIRE(storage.at(12).tag() == BlockTag::RecordContinuation);
+    for (size_t index = 0; index < 10; ++index) {
+        storage.free(index);
+    }
+
+    // The continuation blocks and the free space map move in front of the
+    // head, which is untagged and stays.
+    REQUIRE(storage.compact(10, &RecordView<1028>::relink) == 3U);
+    REQUIRE(storage.size() == 4U);
+    REQUIRE(record.numBlocks() == 3U);
+    REQUIRE(record.data() == data);
+    RecordView<1028>::iterator it = record.end();
+    for (size_t i = data.size(); i > 0; --i) {
+        REQUIRE(*--it == data[i - 1]);
+    }
+
+    record.assign(10, 7);
+    REQUIRE(record.numBlocks() == 1U);
+    REQUIRE(record.data() == std::vector<uint8_t>(10, 7));
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "BlockStorage.h"
+
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// ISharedMemory that reserves a large range of virtual address space up front
+// and commits pages of it as the storage grows. The base address never
+// changes, so pointers and references into blocks (for example the T& handed
+// out by VectorView::operator[]) stay valid across create() calls and growth
+// never copies the existing contents.
+//
+// The reservation only costs address space, physical memory is used for the
+// committed part alone.
+class ReservedMemory : public ISharedMemory
+{
+public:
+   explicit ReservedMemory(size_t reservedSizeInBytes, size_t sizeInBytes = 0)
+      : m_mutex(),
+        m_address(nullptr),
+        m_reservedSize(roundToPageSize(reservedSizeInBytes)),
+        m_committedSize(0),
+        m_size(0)
+   {
+      void* address = ::mmap(nullptr, m_reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (address == MAP_FAILED) {
+         throw std::system_error(errno, std::generic_category(), "Failed to reserve address space");
+      }
+      m_address = address;
+
+      try {
+         realloc(sizeInBytes);
+      } catch (...) {
+         ::munmap(m_address, m_reservedSize);
+         throw;
+      }
+   }
+
+   ReservedMemory(const ReservedMemory&) = delete;
+   ReservedMemory& operator=(const ReservedMemory&) = delete;
+
+   virtual ~ReservedMemory()
+   {
+      ::munmap(m_address, m_reservedSize);
+   }
+
+   virtual void lock() override
+   {
+      m_mutex.lock();
+   }
+
+   virtual void unlock() override
+   {
+      m_mutex.unlock();
+   }
+
+   virtual void lock_shared() override
+   {
+      m_mutex.lock_shared();
+   }
+
+   virtual void unlock_shared() override
+   {
+      m_mutex.unlock_shared();
+   }
+
+   virtual void* get() override
+   {
+      return m_address;
+   }
+
+   virtual size_t size() override
+   {
+      return m_size;
+   }
+
+   virtual void realloc(size_t requestedSize) override
+   {
+      if (requestedSize <= size()) return;
+
+      if (requestedSize > m_reservedSize) {
+         throw std::length_error("Requested size exceeds the reserved address space");
+      }
+
+      size_t committedSize = roundToPageSize(requestedSize);
+      if (committedSize > m_committedSize) {
+         uint8_t* uncommitted = static_cast<uint8_t*>(m_address) + m_committedSize;
+         if (::mprotect(uncommitted, committedSize - m_committedSize, PROT_READ | PROT_WRITE) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Failed to commit reserved memory");
+         }
+         m_committedSize = committedSize;
+      }
+
+      m_size = requestedSize;
+   }
+
+   // Decommits the pages beyond requestedSize, they go back to being reserved
+   // address space only.
+   virtual void truncate(size_t requestedSize) override
+   {
+      if (requestedSize >= size()) return;
+
+      size_t committedSize = roundToPageSize(requestedSize);
+      if (committedSize < m_committedSize) {
+         uint8_t* released = static_cast<uint8_t*>(m_address) + committedSize;
+         void* address = ::mmap(released, m_committedSize - committedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+         if (address == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "Failed to decommit reserved memory");
+         }
+         m_committedSize = committedSize;
+      }
+
+      m_size = requestedSize;
+   }
+
+   virtual void release(size_t offset, size_t size) override
+   {
+      // Private anonymous pages read as zeros again after MADV_DONTNEED.
+      if (::madvise(static_cast<uint8_t*>(m_address) + offset, size, MADV_DONTNEED) != 0) {
+         throw std::system_error(errno, std::generic_category(), "Failed to release reserved memory");
+      }
+   }
+
+   size_t reservedSize() const
+   {
+      return m_reservedSize;
+   }
+
+private:
+   mutable std::shared_timed_mutex m_mutex;
+   void* m_address;
+   size_t m_reservedSize;
+   size_t m_committedSize;
+   size_t m_size;
+
+   static size_t roundToPageSize(size_t size)
+   {
+      size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+      return ((size + pageSize - 1) / pageSize) * pageSize;
+   }
+};
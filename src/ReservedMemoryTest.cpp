@@ -0,0 +1,106 @@
+#include <catch.hpp>
+
+#include "BlockStorage.h"
+#include "ReservedMemory.h"
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t numResidentPages(void* address, size_t size)
+{
+   const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+   std::vector<unsigned char> pages((size + pageSize - 1) / pageSize);
+   REQUIRE(mincore(address, size, pages.data()) == 0);
+
+   size_t numResident = 0;
+   for (unsigned char page : pages) {
+      numResident += page & 1;
+   }
+   return numResident;
+}
+
+TEST_CASE("Create ReservedMemory", "[ReservedMemory]") {
+    ReservedMemory memory(1 << 20);
+    REQUIRE(memory.size() == 0U);
+    REQUIRE(memory.reservedSize() == (1U << 20));
+
+    void* address = memory.get();
+    memory.realloc(100);
+    REQUIRE(memory.size() == 100U);
+    REQUIRE(memory.get() == address);
+
+    memory.realloc(1 << 20);
+    REQUIRE(memory.size() == (1U << 20));
+    REQUIRE(memory.get() == address);
+
+    REQUIRE_THROWS_AS(memory.realloc((1 << 20) + 1), std::length_error);
+}
+
+TEST_CASE("References stay valid while ReservedMemory grows", "[ReservedMemory]") {
+    BlockStorage<1028> storage(std::make_unique<ReservedMemory>(64 << 20));
+
+    Block<1028> block = storage.create();
+    VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(block);
+    vector.push_back(1234);
+    uint64_t& front = vector[0];
+
+    for (size_t index = 0; index < 10000; ++index) {
+        storage.create();
+    }
+    REQUIRE(storage.size() == 10001U);
+
+    REQUIRE(&front == &vector[0]);
+    REQUIRE(front == 1234U);
+}
+
+TEST_CASE("Truncate ReservedMemory", "[ReservedMemory]") {
+    ReservedMemory memory(1 << 20, 1 << 20);
+    void* address = memory.get();
+    static_cast<uint8_t*>(address)[10] = 42;
+    static_cast<uint8_t*>(address)[(1 << 20) - 1] = 42;
+
+    memory.truncate(100);
+    REQUIRE(memory.size() == 100U);
+    REQUIRE(memory.get() == address);
+    REQUIRE(static_cast<uint8_t*>(address)[10] == 42);
+
+    // Pages given back come back zeroed.
+    memory.realloc(1 << 20);
+    REQUIRE(memory.get() == address);
+    REQUIRE(static_cast<uint8_t*>(address)[(1 << 20) - 1] == 0);
+}
+
+TEST_CASE("Release pages of freed Blocks in ReservedMemory", "[ReservedMemory]") {
+    std::unique_ptr<ReservedMemory> memory = std::make_unique<ReservedMemory>(64 << 20);
+    ReservedMemory* reservedMemory = memory.get();
+    BlockStorage<1028> storage(std::move(memory));
+    storage.setReleaseFreedPages(true);
+
+    std::vector<uint8_t> data(1028 - Block<1028>::MIN_BLOCK_SIZE, 0xAB);
+    std::vector<uint64_t> blockIds;
+    for (size_t index = 0; index < 10000; ++index) {
+        Block<1028> block = storage.create();
+        block.set(data.data(), data.size());
+        blockIds.push_back(block.id());
+    }
+    const size_t residentBefore = numResidentPages(reservedMemory->get(), reservedMemory->size());
+
+    // Freeing every other block leaves no page without a used block.
+    for (size_t index = 0; index < blockIds.size(); index += 2) {
+        storage.free(blockIds[index]);
+    }
+    REQUIRE(numResidentPages(reservedMemory->get(), reservedMemory->size()) >= residentBefore);
+
+    for (size_t index = 1; index < blockIds.size(); index += 2) {
+        storage.free(blockIds[index]);
+    }
+    const size_t residentAfter = numResidentPages(reservedMemory->get(), reservedMemory->size());
+    REQUIRE(residentAfter < residentBefore / 10);
+
+    // Released blocks can be created again.
+    Block<1028> block = storage.create();
+    block.set(data.data(), data.size());
+    REQUIRE(block.size() == data.size());
+    REQUIRE(block.data()[0] == 0xAB);
+}
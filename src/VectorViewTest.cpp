@@ -2,6 +2,9 @@
 
 #include "BlockStorage.h"
 #include "RecordStorage.h"
+#include <algorithm>
+#include <numeric>
+#include <vector>
 
 TEST_CASE("Create VectorView", "[VectorView]") {
     std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
@@ -61,3 +64,167 @@ TEST_CASE("Index VectorView", "[VectorView]") {
        REQUIRE(vector[i] == i);
     }
 }
+
+TEST_CASE("Index a large VectorView through its block directory", "[VectorView]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    Block<1028> block = storage.create();
+    VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(block);
+
+    // Enough blocks for a directory two levels deep.
+    const uint64_t numItems = 100000;
+    for (uint64_t i = 0; i < numItems; ++i) {
+       vector.push_back(i * 3);
+    }
+    REQUIRE(vector.size() == numItems);
+    REQUIRE(vector.numBlocks() > 200U);
+    REQUIRE(vector.capacity() >= numItems);
+
+    for (uint64_t i = 0; i < numItems; i += 7) {
+       REQUIRE(vector[i] == i * 3);
+    }
+    REQUIRE(vector[numItems - 1] == (numItems - 1) * 3);
+
+    // Popping across blocks and pushing again reuses the directory entries.
+    const uint64_t numBlocks = vector.numBlocks();
+    for (uint64_t i = 0; i < 1000; ++i) {
+       REQUIRE(vector.pop_back() == (numItems - 1 - i) * 3);
+    }
+    REQUIRE(vector.numBlocks() < numBlocks);
+    for (uint64_t i = numItems - 1000; i < numItems; ++i) {
+       vector.push_back(i);
+    }
+    REQUIRE(vector.numBlocks() == numBlocks);
+    REQUIRE(vector[numItems - 1000] == numItems - 1000);
+    REQUIRE(vector[numItems - 1001] == (numItems - 1001) * 3);
+
+    // The head is all that is left after popping everything, the directory
+    // blocks are freed with the last continuation block.
+    while (vector.size() > 0) {
+       vector.pop_back();
+    }
+    REQUIRE(vector.numBlocks() == 1U);
+    for (uint64_t blockId = 0; blockId < storage.capacity(); ++blockId) {
+       REQUIRE((storage.isFree(blockId) || storage.at(blockId).tag() != BlockTag::VectorDirectory));
+    }
+
+    // And built again when the vector grows.
+    for (uint64_t i = 0; i < 1000; ++i) {
+       vector.push_back(i);
+    }
+    REQUIRE(vector[999] == 999U);
+}
+
+TEST_CASE("Iterate VectorView", "[VectorView]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    Block<1028> block = storage.create();
+    VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(block);
+    REQUIRE(vector.begin() == vector.end());
+    REQUIRE(vector.segments().size() == 1U);
+    REQUIRE(vector.segments()[0].size == 0U);
+
+    const uint64_t numItems = 5000;
+    for (uint64_t i = 0; i < numItems; ++i) {
+       vector.push_back(numItems - 1 - i);
+    }
+    REQUIRE(vector.end() - vector.begin() == static_cast<std::ptrdiff_t>(numItems));
+    REQUIRE(std::accumulate(vector.cbegin(), vector.cend(), uint64_t(0)) == numItems * (numItems - 1) / 2);
+
+    std::sort(vector.begin(), vector.end());
+    uint64_t expected = 0;
+    for (uint64_t item : vector) {
+       REQUIRE(item == expected++);
+    }
+    REQUIRE(std::find(vector.begin(), vector.end(), 4321U) - vector.begin() == 4321);
+
+    VectorView<uint64_t, 1028>::const_iterator it = vector.begin() + 1000;
+    REQUIRE(*it == 1000U);
+    REQUIRE(it[-1] == 999U);
+    REQUIRE(*(--it) == 999U);
+    REQUIRE(it < vector.cend());
+
+    // The segments cover every element once, block by block.
+    std::vector<Segment<const uint64_t> > segments = vector.csegments();
+    REQUIRE(segments.size() == vector.numBlocks());
+    expected = 0;
+    for (const Segment<const uint64_t>& segment : segments) {
+       REQUIRE(segment.size > 0U);
+       for (uint64_t item : segment) {
+          REQUIRE(item == expected++);
+       }
+    }
+    REQUIRE(expected == numItems);
+
+    // The segment of an iterator ends with its block.
+    Segment<uint64_t> segment = (vector.begin() + 1).segment();
+    REQUIRE(segment.size == segments[0].size - 1);
+    REQUIRE(segment.data[0] == 1U);
+}
+
+TEST_CASE("Bulk append, resize, insert and erase VectorView", "[VectorView]") {
+    std::unique_ptr<ISharedMemory> memory = std::make_unique<FakeSharedMemory>(0U);
+    BlockStorage<1028> storage(std::move(memory));
+
+    Block<1028> block = storage.create();
+    VectorView<uint64_t, 1028> vector = VectorView<uint64_t, 1028>::createVectorView(block);
+    std::vector<uint64_t> expected;
+
+    // Reserving allocates every block at once, pushing only fills them.
+    vector.reserve(3000);
+    REQUIRE(vector.capacity() >= 3000U);
+    const uint64_t numBlocks = vector.numBlocks();
+    const size_t numStorageBlocks = storage.size();
+    for (uint64_t i = 0; i < 3000; ++i) {
+       vector.push_back(i);
+       expected.push_back(i);
+    }
+    REQUIRE(vector.numBlocks() == numBlocks);
+    REQUIRE(storage.size() == numStorageBlocks);
+    REQUIRE(std::equal(vector.begin(), vector.end(), expected.begin(), expected.end()));
+
+    std::vector<uint64_t> items(10000);
+    std::iota(items.begin(), items.end(), 100000);
+    vector.append(items.begin(), items.end());
+    expected.insert(expected.end(), items.begin(), items.end());
+    vector.append(items.data(), 7);
+    expected.insert(expected.end(), items.begin(), items.begin() + 7);
+    REQUIRE(vector.size() == expected.size());
+    REQUIRE(std::equal(vector.begin(), vector.end(), expected.begin(), expected.end()));
+
+    vector.insert(vector.begin() + 5, items.begin(), items.begin() + 500);
+    expected.insert(expected.begin() + 5, items.begin(), items.begin() + 500);
+    vector.insert(vector.begin() + 2000, 42);
+    expected.insert(expected.begin() + 2000, 42);
+    REQUIRE(std::equal(vector.begin(), vector.end(), expected.begin(), expected.end()));
+
+    VectorView<uint64_t, 1028>::iterator it = vector.erase(vector.begin() + 100, vector.begin() + 4100);
+    expected.erase(expected.begin() + 100, expected.begin() + 4100);
+    REQUIRE(*it == expected[100]);
+    vector.erase(vector.begin());
+    expected.erase(expected.begin());
+    REQUIRE(vector.size() == expected.size());
+    REQUIRE(std::equal(vector.begin(), vector.end(), expected.begin(), expected.end()));
+
+    vector.resize(expected.size() + 1000, 9);
+    expected.resize(expected.size() + 1000, 9);
+    REQUIRE(std::equal(vector.begin(), vector.end(), expected.begin(), expected.end()));
+
+    // Shrinking frees the blocks behind the new end.
+    vector.resize(200);
+    expected.resize(200);
+    REQUIRE(std::equal(vector.begin(), vector.end(), expected.begin(), expected.end()));
+    REQUIRE(vector.numBlocks() == vector.segments().size());
+    vector.resize(0);
+    REQUIRE(vector.size() == 0U);
+    REQUIRE(vector.numBlocks() == 1U);
+
+    // Pushing after a resize continues in the right block.
+    vector.resize(1000, 1);
+    vector.push_back(2);
+    REQUIRE(vector[1000] == 2U);
+    REQUIRE(vector.pop_back() == 2U);
+    REQUIRE(vector.size() == 1000U);
+}